@@ -0,0 +1,413 @@
+/***********************************************************************
+ *          BENCH_RC_SQLITE.C
+ *
+ *          Benchmark of the Resource Driver for Sqlite3
+ *
+ *          Workloads over dba_rc_sqlite3(), against :memory: and a file:
+ *              insert_single   dba_create_record(), one by one
+ *              insert_bulk     rc_sqlite3_create_records(), by batches
+ *              update_by_id    dba_update_record() of random ids
+ *              load_filtered   dba_load_table() with filter on an indexed column
+ *              load_full       dba_load_table() of the full table
+ *
+ *          Result in stdout, json: ops/sec and p50/p99/p999 latency (usec).
+ *
+ *          Copyright (c) 2018 Niyamaka.
+ *          All Rights Reserved.
+***********************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <argp.h>
+#include "rc_sqlite3.h"
+
+/***************************************************************
+ *              Constants
+ ***************************************************************/
+#define APP_NAME        "bench_rc_sqlite"
+#define DEFAULT_ROWS    10000
+#define DEFAULT_COLS    8
+#define DEFAULT_PAYLOAD 256
+#define DEFAULT_FILE    "/tmp/bench_rc_sqlite.db"
+#define BULK_BATCH      1000
+#define DISTINCT_KEYS   100     // values of the filtered column
+#define FILTERED_LOADS  100
+#define FULL_LOADS      3
+
+/***************************************************************
+ *              Structures
+ ***************************************************************/
+struct arguments {
+    int rows;
+    int cols;
+    int payload;
+    char *file;
+    char *properties;
+    char *db;           // "memory", "file" or "all"
+};
+
+/***************************************************************
+ *              Prototypes
+ ***************************************************************/
+static error_t parse_opt(int key, char *arg, struct argp_state *state);
+
+/***************************************************************
+ *              Data
+ ***************************************************************/
+const char *argp_program_version = APP_NAME " 1.0";
+
+static char doc[] = "Benchmark of the yuneta rc_sqlite driver. Result in json.";
+static char args_doc[] = "";
+
+static struct argp_option options[] = {
+    {"rows",        'r', "ROWS",    0, "Rows of the table, 10^3 to 10^7 (default 10000)", 0},
+    {"cols",        'c', "COLS",    0, "Integer columns by record (default 8)", 0},
+    {"payload",     'p', "BYTES",   0, "Size of the json payload by record (default 256)", 0},
+    {"db",          'd', "DB",      0, "memory, file or all (default all)", 0},
+    {"file",        'f', "FILE",    0, "Database file (default " DEFAULT_FILE ")", 0},
+    {"properties",  'j', "JSON",    0, "jn_properties of dba_open() of the file database "
+                                       "(default {\"journal_mode\":\"WAL\",\"synchronous\":\"NORMAL\"})", 0},
+    {0}
+};
+
+static struct argp argp = {
+    options,
+    parse_opt,
+    args_doc,
+    doc
+};
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+
+    switch (key) {
+        case 'r':
+            arguments->rows = atoi(arg);
+            break;
+        case 'c':
+            arguments->cols = atoi(arg);
+            break;
+        case 'p':
+            arguments->payload = atoi(arg);
+            break;
+        case 'd':
+            arguments->db = arg;
+            break;
+        case 'f':
+            arguments->file = arg;
+            break;
+        case 'j':
+            arguments->properties = arg;
+            break;
+        case ARGP_KEY_ARG:
+            argp_usage(state);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Monotonic time in microseconds
+ ***************************************************************************/
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static int cmp_uint64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y? -1 : x > y? 1 : 0;
+}
+
+/***************************************************************************
+ *  Result of a workload: `ops` operations of `n` latencies
+ ***************************************************************************/
+static json_t *result(
+    const char *db,
+    const char *workload,
+    uint64_t *latencies,
+    int n,
+    uint64_t ops,
+    uint64_t elapsed_us
+)
+{
+    qsort(latencies, n, sizeof(uint64_t), cmp_uint64);
+
+    json_t *jn_result = json_object();
+    json_object_set_new(jn_result, "db", json_string(db));
+    json_object_set_new(jn_result, "workload", json_string(workload));
+    json_object_set_new(jn_result, "ops", json_integer(ops));
+    json_object_set_new(jn_result, "seconds", json_real(elapsed_us / 1e6));
+    json_object_set_new(jn_result, "ops_per_sec",
+        json_real(elapsed_us? ops * 1e6 / elapsed_us : 0)
+    );
+    json_object_set_new(jn_result, "p50_us", json_integer(n? latencies[n*50/100] : 0));
+    json_object_set_new(jn_result, "p99_us", json_integer(n? latencies[n*99/100] : 0));
+    json_object_set_new(jn_result, "p999_us", json_integer(n? latencies[n*999/1000] : 0));
+    return jn_result;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static json_t *new_record(struct arguments *arguments, int i, const char *payload)
+{
+    json_t *kw_record = json_object();
+    json_object_set_new(kw_record, "k", json_integer(i % DISTINCT_KEYS));
+    char name[32];
+    snprintf(name, sizeof(name), "record-%d", i);
+    json_object_set_new(kw_record, "name", json_string(name));
+    for(int c=0; c<arguments->cols; c++) {
+        char col[32];
+        snprintf(col, sizeof(col), "c%d", c);
+        json_object_set_new(kw_record, col, json_integer(i + c));
+    }
+    json_t *jn_payload = json_object();
+    json_object_set_new(jn_payload, "n", json_integer(i));
+    json_object_set_new(jn_payload, "data", json_string(payload));
+    json_object_set_new(kw_record, "payload", jn_payload);
+    return kw_record;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+static int count_record(hgobj gobj, const char *resource, void *user_data, json_t *kw_record)
+{
+    (*(uint64_t *)user_data)++;
+    JSON_DECREF(kw_record);
+    return 0;   // ignore, don't keep the records in memory
+}
+
+/***************************************************************************
+ *  Run the workloads against a database, append the results to jn_results
+ ***************************************************************************/
+static int run_workloads(
+    struct arguments *arguments,
+    const char *db_name,
+    const char *database,
+    json_t *jn_properties,  // owned
+    json_t *jn_results
+)
+{
+    dba_persistent_t *dba = dba_rc_sqlite3();
+    const int rows = arguments->rows;
+    /*
+     *  A latency by op of the longest workload:
+     *  rows, batches (<= rows), FILTERED_LOADS or FULL_LOADS
+     */
+    int slots = rows;
+    if(slots < FILTERED_LOADS) {
+        slots = FILTERED_LOADS;
+    }
+    if(slots < FULL_LOADS) {
+        slots = FULL_LOADS;
+    }
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (slots + 1));
+    char *payload = malloc(arguments->payload + 1);
+    if(!latencies || !payload) {
+        fprintf(stderr, "%s: no memory\n", APP_NAME);
+        free(latencies);
+        free(payload);
+        JSON_DECREF(jn_properties);
+        return -1;
+    }
+    memset(payload, 'x', arguments->payload);
+    payload[arguments->payload] = 0;
+
+    void *pDb = dba->dba_open(0, database, jn_properties);
+    if(!pDb) {
+        fprintf(stderr, "%s: cannot open %s\n", APP_NAME, database);
+        free(latencies);
+        free(payload);
+        return -1;
+    }
+
+    json_t *kw_fields = new_record(arguments, 0, "");
+    json_object_set_new(kw_fields, "id", json_integer(0));
+    json_object_set_new(kw_fields, "__indexes__", json_pack("[s]", "k"));
+    dba->dba_create_table(0, pDb, "bench", "id", json_incref(kw_fields));
+    dba->dba_create_table(0, pDb, "bench_bulk", "id", kw_fields);
+
+    /*
+     *  insert_single
+     */
+    uint64_t start = now_usec();
+    for(int i=0; i<rows; i++) {
+        json_t *kw_record = new_record(arguments, i, payload);
+        uint64_t t = now_usec();
+        dba->dba_create_record(0, pDb, "bench", kw_record);
+        latencies[i] = now_usec() - t;
+    }
+    rc_sqlite3_flush(0, pDb);
+    json_array_append_new(jn_results,
+        result(db_name, "insert_single", latencies, rows, rows, now_usec() - start)
+    );
+
+    /*
+     *  insert_bulk, latency by batch
+     */
+    int batches = 0;
+    start = now_usec();
+    for(int i=0; i<rows; i+=BULK_BATCH) {
+        json_t *jn_records = json_array();
+        for(int j=i; j<rows && j<i+BULK_BATCH; j++) {
+            json_array_append_new(jn_records, new_record(arguments, j, payload));
+        }
+        uint64_t t = now_usec();
+        json_t *jn_ids = rc_sqlite3_create_records(0, pDb, "bench_bulk", jn_records);
+        latencies[batches++] = now_usec() - t;
+        JSON_DECREF(jn_ids);
+    }
+    rc_sqlite3_flush(0, pDb);
+    json_array_append_new(jn_results,
+        result(db_name, "insert_bulk", latencies, batches, rows, now_usec() - start)
+    );
+
+    /*
+     *  update_by_id
+     */
+    srand(1);
+    start = now_usec();
+    for(int i=0; i<rows; i++) {
+        json_t *kw_filtro = json_pack("{s:I}", "id", (json_int_t)(rand() % rows) + 1);
+        json_t *kw_record = json_pack("{s:s,s:i}", "name", "updated", "c0", i);
+        uint64_t t = now_usec();
+        dba->dba_update_record(0, pDb, "bench", kw_filtro, kw_record);
+        latencies[i] = now_usec() - t;
+    }
+    rc_sqlite3_flush(0, pDb);
+    json_array_append_new(jn_results,
+        result(db_name, "update_by_id", latencies, rows, rows, now_usec() - start)
+    );
+
+    /*
+     *  load_filtered, ops are the loaded records
+     */
+    uint64_t loaded = 0;
+    start = now_usec();
+    for(int i=0; i<FILTERED_LOADS; i++) {
+        json_t *kw_filtro = json_pack("{s:i}", "k", i % DISTINCT_KEYS);
+        uint64_t t = now_usec();
+        json_t *jn_list = dba->dba_load_table(
+            0, pDb, "bench", "bench", &loaded, kw_filtro, count_record, 0
+        );
+        latencies[i] = now_usec() - t;
+        JSON_DECREF(jn_list);
+    }
+    json_array_append_new(jn_results,
+        result(db_name, "load_filtered", latencies, FILTERED_LOADS, loaded, now_usec() - start)
+    );
+
+    /*
+     *  load_full, ops are the loaded records
+     */
+    loaded = 0;
+    start = now_usec();
+    for(int i=0; i<FULL_LOADS; i++) {
+        uint64_t t = now_usec();
+        json_t *jn_list = dba->dba_load_table(
+            0, pDb, "bench", "bench", &loaded, json_object(), count_record, 0
+        );
+        latencies[i] = now_usec() - t;
+        JSON_DECREF(jn_list);
+    }
+    json_array_append_new(jn_results,
+        result(db_name, "load_full", latencies, FULL_LOADS, loaded, now_usec() - start)
+    );
+
+    dba->dba_close(0, pDb);
+    free(latencies);
+    free(payload);
+    return 0;
+}
+
+/***************************************************************************
+ *  Remove the database file created by the bench and its sidecars
+ ***************************************************************************/
+static void remove_database(const char *database)
+{
+    const char *suffixes[] = {"", "-wal", "-shm", "-journal", 0};
+    for(int i=0; suffixes[i]; i++) {
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s%s", database, suffixes[i]);
+        unlink(path);
+    }
+}
+
+/***************************************************************************
+ *                      Main
+ ***************************************************************************/
+int main(int argc, char *argv[])
+{
+    struct arguments arguments;
+    memset(&arguments, 0, sizeof(arguments));
+    arguments.rows = DEFAULT_ROWS;
+    arguments.cols = DEFAULT_COLS;
+    arguments.payload = DEFAULT_PAYLOAD;
+    arguments.file = DEFAULT_FILE;
+    arguments.properties = "{\"journal_mode\":\"WAL\",\"synchronous\":\"NORMAL\"}";
+    arguments.db = "all";
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if(arguments.rows < 1 || arguments.cols < 0 || arguments.payload < 0) {
+        fprintf(stderr, "%s: rows must be > 0, cols and payload >= 0\n", APP_NAME);
+        exit(-1);
+    }
+    BOOL file = strcmp(arguments.db, "file")==0 || strcmp(arguments.db, "all")==0;
+    if(file && access(arguments.file, 0)==0) {
+        // Never delete a database the bench didn't create
+        fprintf(stderr, "%s: %s already exists, remove it or use --file\n",
+            APP_NAME, arguments.file
+        );
+        exit(-1);
+    }
+
+    init_ghelpers_library(APP_NAME);
+
+    json_t *jn_bench = json_object();
+    json_object_set_new(jn_bench, "rows", json_integer(arguments.rows));
+    json_object_set_new(jn_bench, "cols", json_integer(arguments.cols));
+    json_object_set_new(jn_bench, "payload", json_integer(arguments.payload));
+    json_object_set_new(jn_bench, "sqlite", json_string(sqlite3_libversion()));
+    json_t *jn_results = json_array();
+    json_object_set_new(jn_bench, "results", jn_results);
+
+    int ret = 0;
+    if(strcmp(arguments.db, "memory")==0 || strcmp(arguments.db, "all")==0) {
+        ret += run_workloads(&arguments, "memory", ":memory:", json_object(), jn_results);
+    }
+    if(file) {
+        json_t *jn_properties = json_loads(arguments.properties, 0, 0);
+        if(!jn_properties) {
+            fprintf(stderr, "%s: properties are not valid json\n", APP_NAME);
+            exit(-1);
+        }
+        ret += run_workloads(&arguments, "file", arguments.file, jn_properties, jn_results);
+        remove_database(arguments.file);
+    }
+
+    char *s = json_dumps(jn_bench, JSON_INDENT(4));
+    printf("%s\n", s);
+    gbmem_free(s);
+    JSON_DECREF(jn_bench);
+
+    end_ghelpers_library();
+    return ret<0? -1 : 0;
+}
@@ -6,18 +6,391 @@
  *          Copyright (c) 2018 Niyamaka.
  *          All Rights Reserved.
 ***********************************************************************/
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "rc_sqlite3.h"
 
 /***************************************************************
  *              Constants
  ***************************************************************/
+/*
+ *  Generated columns of json paths: config.region -> __path_config__region
+ */
+#define PATH_COLUMN_PREFIX "__path_"
+
+#define DEFAULT_STMT_CACHE_SIZE 64
+#define DEFAULT_GROUP_COMMIT_SIZE 100       // writes by transaction
+#define DEFAULT_GROUP_COMMIT_LATENCY 100    // miliseconds
+
+#define DEFAULT_SLOW_QUERY_RATE 10    // slow query logs by minute
+
+#define DEFAULT_BACKUP_PAGES 256         // pages copied by tick
+
+#define SHARD_ID_BLOCK 1000     // ids of a partitioned table reserved by write of __shard_ids__
+
+#define DEFAULT_CHECKPOINT_INTERVAL 1000            // miliseconds between passive checkpoints
+#define DEFAULT_CHECKPOINT_IDLE 100                 // miliseconds without writes
+#define DEFAULT_CHECKPOINT_WAL_MAX (64*1024*1024)   // bytes of wal to truncate it
+#define DEFAULT_CHECKPOINT_BUSY_TIMEOUT 1000        // miliseconds, open reads (the truncate don't wait)
+
+#define RECORDSET_BLOCK_SIZE (1024*1024)   // arena block of the record sets
+#define RECORDSET_INDEX_ROWS 65536         // rows by block of the index
+
+#define STATS_BUCKETS 24    // latency histogram, log2 of usec: <1us ... >=4s
 
 /***************************************************************
  *              Structures
  ***************************************************************/
+/*
+ *  Row decoder plan, built once by prepared statement:
+ *  column names and how to convert each column to json.
+ */
+typedef enum {
+    COL_INTEGER = 0,
+    COL_REAL,
+    COL_TEXT,
+    COL_BLOB,           // json text or jsonb, or any json from nonlegalbuffer2json()
+    COL_DYNAMIC,        // No declared type (expressions): use sqlite3_column_type()
+    COL_HIDDEN,         // Generated column of a json path, not in the record
+} col_type_t;
+
+typedef struct {
+    int cols;
+    int reprepares;     // SQLITE_STMTSTATUS_REPREPARE when the plan was built
+    char **names;
+    col_type_t *types;
+} ROW_DECODER;
+
+/*
+ *  Prepared statement cache entry.
+ *  The key is the sql text, that holds the table, the operation
+ *  and the ordered column set, the values go as bound parameters.
+ */
+typedef struct stmt_cache_s {
+    struct stmt_cache_s *prev;
+    struct stmt_cache_s *next;
+    char *sql;
+    sqlite3_stmt *pStmt;
+    ROW_DECODER *decoder;
+    BOOL jsonb;         // Blobs are decoded as jsonb: select of a table with jsonb storage.
+    BOOL cached;        // FALSE: temporary statement, finalized on release.
+    BOOL in_use;        // Don't evict while stepping (re-entrant dba_filter callbacks).
+} STMT_CACHE;
+
+/*
+ *  Statistics by table and operation, see rc_sqlite3_stats()
+ */
+typedef enum {
+    STATS_OP_CREATE = 0,
+    STATS_OP_UPDATE,
+    STATS_OP_DELETE,
+    STATS_OP_UPSERT,
+    STATS_OP_LOAD,
+    STATS_OPS
+} stats_op_t;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t rows;          // rows written, or read by the loads
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t histogram[STATS_BUCKETS];  // bucket i: latency < 2^i usec
+} OP_STATS;
+
+typedef struct table_stats_s {
+    struct table_stats_s *next;
+    char *tablename;
+    OP_STATS ops[STATS_OPS];
+} TABLE_STATS;
+
+/*
+ *  Record set, see rc_sqlite3_load_recordset()
+ *
+ *  The rows are packed in the blocks of an arena, each row:
+ *      uint64_t values[cols]   integer, real (bits), or text/json: offset
+ *                              from the row start (low 32) and length (high 32)
+ *      uint8_t kinds[cols]     RS_*, padded to 8
+ *      text and json data, nul ended
+ *  The column names are interned: only one copy, in the record set.
+ */
+typedef enum {
+    RS_NULL = 0,
+    RS_INTEGER,
+    RS_REAL,
+    RS_TEXT,
+    RS_JSON,            // json text
+    RS_JSONB,           // jsonb
+} rs_kind_t;
+
+typedef struct rs_block_s {
+    struct rs_block_s *next;
+    size_t size;
+    size_t used;
+    char data[];
+} RS_BLOCK;
+
+typedef struct {
+    int cols;
+    char **names;
+    col_type_t *types;
+    int *columns;       // column of the select of each column of the set (no hidden)
+    BOOL jsonb;         // blobs are jsonb, table with jsonb storage
+    size_t rows;
+    char ***index;      // blocks of RECORDSET_INDEX_ROWS pointers to rows
+    size_t index_blocks;
+    RS_BLOCK *blocks;   // current block first
+    size_t memory;
+} RECORDSET;
+
+/*
+ *  Cursor over the rows of a select, see rc_sqlite3_cursor_open()
+ */
+typedef struct dba_cursor_s DBA_CURSOR;
+
+/*
+ *  Async operation, see rc_sqlite3_async_submit()
+ */
+typedef struct async_op_s {
+    struct async_op_s *next;
+    hgobj gobj;         // who receives the completion event
+    char *event;
+    json_t *kw_op;      // request
+    json_t *kw_result;  // response
+} ASYNC_OP;
+
+/*
+ *  Worker thread with its own connection, see rc_sqlite3_async_submit()
+ */
+typedef struct async_worker_s ASYNC_WORKER;
+
+/*
+ *  Pool of read-only connections
+ */
+typedef struct read_pool_s READ_POOL;
+
+/*
+ *  Sharded mode, see "shards" of dba_open()
+ */
+typedef struct shard_set_s SHARD_SET;
+
+/*
+ *  Online backup, see rc_sqlite3_backup_start()
+ */
+typedef enum {
+    BACKUP_RUNNING = 0,
+    BACKUP_DONE,
+    BACKUP_FAILED,
+} backup_state_t;
+
+typedef struct {
+    char *path;
+    char *partial;              // path + ".partial", renamed to path when done
+    char *database;             // file of the database, to the vacuum thread
+    char *event;                // sent to gobj at the end, optional
+    hgobj gobj;
+    BOOL vacuum;                // VACUUM INTO, in a thread
+    int pages_per_tick;
+    sqlite3 *dest;
+    sqlite3_backup *backup;
+    pthread_t thread;
+    BOOL thread_running;
+    pthread_mutex_t mutex;
+    backup_state_t state;       // protected by mutex while the thread runs
+    int pages_total;
+    int pages_remaining;
+    uint64_t start;             // miliseconds
+    uint64_t elapsed;
+    char *errmsg;
+} BACKUP;
+
+/*
+ *  WAL checkpoints in a thread, with its own connection
+ */
+typedef struct {
+    sqlite3 *db;                // connection of the thread
+    char *wal;                  // path of the wal file
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BOOL stop;                  // protected by mutex
+    BOOL idle_request;          // protected by mutex, set by rc_sqlite3_tick()
+    BOOL truncate_retry;        // protected by mutex, truncate busy, again in the next tick
+    uint64_t interval;          // miliseconds, 0: only at idle
+    uint64_t idle;              // miliseconds
+    uint64_t wal_max;           // bytes
+
+    /*
+     *  Writes of the writer, only used by rc_sqlite3_tick()
+     */
+    sqlite3_int64 last_changes;
+    uint64_t last_write;        // miliseconds
+    BOOL dirty;                 // writes not requested to checkpoint
+
+    /*
+     *  Metrics, protected by mutex
+     */
+    uint64_t runs;
+    uint64_t idle_runs;
+    uint64_t truncates;
+    uint64_t busy;
+    uint64_t errors;
+    uint64_t errors_logged;     // by rc_sqlite3_tick()
+    char *errmsg;               // last error
+    uint64_t last_us;
+    uint64_t max_us;
+    uint64_t total_us;
+    int wal_frames;             // frames in the wal after the last checkpoint
+    int checkpointed_frames;
+    uint64_t wal_bytes;         // size of the wal file after the last checkpoint
+} CHECKPOINTER;
+
+/*
+ *  Handle returned by dba_open()
+ */
+typedef struct dba_handle_s {
+    sqlite3 *db;
+
+    json_t *jn_stmt_index;      // sql -> STMT_CACHE *
+    STMT_CACHE *lru_head;       // most recently used
+    STMT_CACHE *lru_tail;       // least recently used
+    size_t stmt_cache_size;     // max cached statements, 0 disable the cache
+    size_t stmt_cache_count;
+    uint64_t stmt_cache_hits;
+    uint64_t stmt_cache_misses;
+    uint64_t stmt_cache_evictions;
+
+    /*
+     *  Group commit: writes go to an open transaction,
+     *  committed by size, by latency or by rc_sqlite3_flush().
+     */
+    BOOL gc_enabled;
+    size_t gc_batch_size;
+    uint64_t gc_max_latency;    // miliseconds
+    BOOL gc_tx_open;
+    uint64_t gc_tx_start;       // miliseconds
+    size_t gc_pending;          // queue depth: writes not committed
+    size_t gc_max_pending;
+    uint64_t gc_flushes;
+    uint64_t gc_flushed_writes;
+    uint64_t gc_last_flush_us;
+    uint64_t gc_max_flush_us;
+    uint64_t gc_total_flush_us;
+
+    json_t *jn_pragmas;         // effective values of the pragmas
+
+    json_t *jn_table_keys;      // tablename -> key of dba_create_table(), for the upserts
+    json_t *jn_json_paths;      // tablename -> {path: generated column}
+    json_t *jn_json_storage;    // tablename -> "jsonb", object/array fields stored as jsonb
+
+    BOOL index_advisor;         // check the query plan of the selects with filter
+    json_t *jn_index_advisor;   // sql -> {tablename, columns, full_scan, selects}
+
+    pthread_mutex_t stats_mutex;    // the loads can end in other threads
+    TABLE_STATS *table_stats;   // protected by stats_mutex
+
+    /*
+     *  Slow query log, protected by stats_mutex
+     */
+    uint64_t slow_query_us;     // threshold, 0 disabled
+    int slow_query_rate;        // max logs by minute
+    uint64_t slow_window_start; // miliseconds
+    int slow_window_logs;
+    uint64_t slow_suppressed;   // logs not done by the rate limit
+    json_t *jn_slow_queries;    // sql -> {count, max_us, last_us, rows, ..., plan}
+
+    ASYNC_WORKER *async;        // Async mode: worker thread
+    READ_POOL *read_pool;       // Read-only connections for the loads
+    BACKUP *backup;             // Running or last backup
+    SHARD_SET *shards;          // Sharded mode: no connection, only routes to the shards
+    CHECKPOINTER *checkpointer; // WAL checkpoints out of the writes
+
+    /*
+     *  In-memory copy of the file: serves the reads, the writes
+     *  are applied to the file and then to the copy.
+     */
+    struct dba_handle_s *memory;
+    BOOL memory_lost;           // the copy diverged: the reads go to the file
+    uint64_t memory_writes;     // statements applied to the copy
+    uint64_t memory_restore_ms;
+} DBA_HANDLE;
+
+struct shard_set_s {
+    int size;
+    DBA_HANDLE **handles;       // handle of each file, returned by dba_open()
+    json_t *jn_tables;          // tablename -> shard, tables placed in one file
+    json_t *jn_keys;            // tablename -> partition column, tables hashed in all files
+    json_t *jn_next_ids;        // tablename -> next id, the ids are unique in all the files
+    json_t *jn_id_limits;       // tablename -> end of the ids reserved in __shard_ids__
+};
+
+struct read_pool_s {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int size;
+    DBA_HANDLE **readers;
+    BOOL *busy;                 // protected by mutex
+    uint64_t acquires;
+    uint64_t waits;             // acquires that waited a free reader
+    uint64_t fallbacks;         // loads done by the writer connection
+};
+
+struct async_worker_s {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    BOOL stop;
+    DBA_HANDLE *h;              // connection of the worker, only used by the thread
+    ASYNC_OP *submit_head;      // protected by mutex
+    ASYNC_OP *submit_tail;
+    ASYNC_OP *done_head;        // protected by mutex
+    ASYNC_OP *done_tail;
+    size_t queue_depth;         // submitted and not done
+    uint64_t submitted;
+    uint64_t completed;
+};
+
+/*
+ *  Partition of a parallel load, see rc_sqlite3_load_table_parallel()
+ */
+typedef struct {
+    pthread_t thread;
+    hgobj gobj;
+    DBA_CURSOR *cursor;
+    json_t *jn_records;         // loaded by the thread
+    int ret;
+} LOAD_PARTITION;
+
+struct dba_cursor_s {
+    DBA_HANDLE *h;              // handle returned by dba_open()
+    DBA_HANDLE *conn;           // connection of the cursor: a reader or the writer
+    STMT_CACHE *entry;
+    json_t *jn_params;          // bound values, alive until the statement is reset
+    TABLE_STATS *stats;
+    uint64_t t0;                // usec, the load is measured from open to close
+    uint64_t rows;
+    int fullscan_step;          // sqlite3_stmt_status() at open, to the slow query log
+    int vm_step;
+    BOOL eof;
+    BOOL error;
+
+    /*
+     *  Cursor over the shards of a partitioned table: the cursors
+     *  of the shards, ordered by id, merged by the lowest id.
+     */
+    int nshards;
+    DBA_CURSOR **shards;
+    json_t **heads;             // next record of each shard
+    json_int_t limit;           // -1 without limit
+    json_int_t offset;
+};
 
 /***************************************************************
  *              DBA persistent functions
@@ -76,7 +449,217 @@ PRIVATE json_t *dba_load_table(
 /***************************************************************
  *              Prototypes
  ***************************************************************/
-PRIVATE int one_step(hgobj gobj, const char *sql, sqlite3 *pDb);
+PRIVATE int one_step(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params   // not owned. If null the statement is not cached.
+);
+PRIVATE json_int_t insert_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record // owned
+);
+PRIVATE json_int_t upsert_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record,  // owned
+    const char *key
+);
+PRIVATE int tr_begin(hgobj gobj, DBA_HANDLE *h, const char *name);
+PRIVATE int tr_commit(hgobj gobj, DBA_HANDLE *h, const char *name);
+PRIVATE int tr_rollback(hgobj gobj, DBA_HANDLE *h, const char *name);
+PRIVATE int apply_pragmas(hgobj gobj, DBA_HANDLE *h, json_t *jn_properties);
+PRIVATE int pragma_set(hgobj gobj, DBA_HANDLE *h, const char *name, json_t *jn_value);
+PRIVATE json_t *pragma_exec(hgobj gobj, DBA_HANDLE *h, const char *sql);
+PRIVATE int gc_begin(hgobj gobj, DBA_HANDLE *h);
+PRIVATE void gc_written(hgobj gobj, DBA_HANDLE *h, size_t writes);
+PRIVATE int gc_flush(hgobj gobj, DBA_HANDLE *h);
+PRIVATE uint64_t time_in_usec(void);
+PRIVATE TABLE_STATS *table_stats(DBA_HANDLE *h, const char *tablename);
+PRIVATE void stats_add(
+    DBA_HANDLE *h,
+    TABLE_STATS *stats,
+    stats_op_t op,
+    uint64_t t0,
+    json_int_t rows     // -1: error
+);
+PRIVATE json_t *stats_tables(DBA_HANDLE *h);
+PRIVATE void slow_query(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,
+    sqlite3_stmt *pStmt,
+    uint64_t elapsed,
+    json_int_t rows,
+    int fullscan_step,  // sqlite3_stmt_status() before the execution
+    int vm_step
+);
+PRIVATE json_t *stats_db_status(sqlite3 *db);
+PRIVATE void stats_statements(DBA_HANDLE *h, json_t *jn_statements);
+PRIVATE ASYNC_WORKER *async_start(
+    hgobj gobj,
+    const char *database,
+    json_t *jn_properties // not owned
+);
+PRIVATE void async_stop(hgobj gobj, DBA_HANDLE *h);
+PRIVATE int async_dispatch(DBA_HANDLE *h);
+PRIVATE void async_table_meta(hgobj gobj, DBA_HANDLE *h, const char *tablename);
+PRIVATE int backup_tick(hgobj gobj, DBA_HANDLE *h);
+PRIVATE int backup_end(hgobj gobj, DBA_HANDLE *h, backup_state_t state);
+PRIVATE void *backup_vacuum_thread(void *arg);
+PRIVATE BOOL backup_running(BACKUP *backup);
+PRIVATE void backup_free(BACKUP *backup);
+PRIVATE CHECKPOINTER *checkpoint_start(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *database,
+    json_t *jn_properties // not owned
+);
+PRIVATE void checkpoint_stop(CHECKPOINTER *ck);
+PRIVATE void checkpoint_run(CHECKPOINTER *ck, BOOL idle);
+PRIVATE void *checkpoint_thread(void *arg);
+PRIVATE void checkpoint_tick(hgobj gobj, DBA_HANDLE *h);
+PRIVATE json_t *checkpoint_stats(CHECKPOINTER *ck);
+PRIVATE DBA_HANDLE *shards_open(
+    hgobj gobj,
+    const char *database,
+    json_t *jn_properties // not owned
+);
+PRIVATE int shards_close(hgobj gobj, DBA_HANDLE *h);
+PRIVATE int shard_of_table(SHARD_SET *set, const char *tablename);
+PRIVATE const char *shard_column(SHARD_SET *set, const char *tablename);
+PRIVATE int shard_of_value(SHARD_SET *set, json_t *jn_value);
+PRIVATE int shard_of_filter(SHARD_SET *set, const char *tablename, json_t *kw_filtro);
+PRIVATE DBA_HANDLE *shard_handle(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // not owned
+    const char *function
+);
+PRIVATE int shard_route(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record,  // not owned, the id is set
+    BOOL upsert
+);
+PRIVATE BOOL shard_upsert_key(hgobj gobj, SHARD_SET *set, const char *tablename, const char *key);
+PRIVATE int shards_create_table(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    const char *key,
+    json_t *kw_fields   // owned
+);
+PRIVATE int shards_drop_table(hgobj gobj, DBA_HANDLE *h, const char *tablename);
+PRIVATE json_int_t shards_create_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record   // owned
+);
+PRIVATE int shards_write(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *kw_record   // owned, null: delete
+);
+PRIVATE json_t *shards_create_records(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *jn_records, // owned
+    BOOL upsert,
+    const char *key
+);
+PRIVATE DBA_CURSOR *shards_cursor_open(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+);
+PRIVATE json_t *shards_cursor_next(hgobj gobj, DBA_CURSOR *cursor);
+PRIVATE int shards_cursor_close(hgobj gobj, DBA_CURSOR *cursor);
+PRIVATE int shards_async_submit(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *event,
+    json_t *kw_op  // owned
+);
+PRIVATE DBA_HANDLE *handle_open(
+    hgobj gobj,
+    const char *database,
+    int flags,
+    json_t *jn_properties // not owned
+);
+PRIVATE int handle_close(hgobj gobj, DBA_HANDLE *h);
+PRIVATE DBA_HANDLE *memory_open(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    json_t *jn_properties // not owned
+);
+PRIVATE void memory_mirror(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params,  // not owned
+    BOOL jsonb
+);
+PRIVATE void memory_lost(hgobj gobj, DBA_HANDLE *h, const char *sql, const char *errmsg);
+PRIVATE READ_POOL *read_pool_open(
+    hgobj gobj,
+    const char *database,
+    int size,
+    json_t *jn_properties // not owned
+);
+PRIVATE void read_pool_close(hgobj gobj, READ_POOL *pool);
+PRIVATE void read_pool_flush_cache(READ_POOL *pool);
+PRIVATE DBA_HANDLE *read_conn_acquire(DBA_HANDLE *h, BOOL wait);
+PRIVATE void read_conn_release(DBA_HANDLE *h, DBA_HANDLE *conn);
+PRIVATE DBA_CURSOR *cursor_open(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+);
+PRIVATE void *load_partition_thread(void *arg);
+PRIVATE STMT_CACHE *stmt_acquire(hgobj gobj, DBA_HANDLE *h, const char *sql);
+PRIVATE void stmt_release(DBA_HANDLE *h, STMT_CACHE *entry);
+PRIVATE void stmt_cache_flush(DBA_HANDLE *h);
+PRIVATE void decoder_free(ROW_DECODER *decoder);
+PRIVATE ROW_DECODER *decoder_create(hgobj gobj, sqlite3_stmt *pStmt);
+PRIVATE int bind_params(hgobj gobj, sqlite3_stmt *pStmt, json_t *jn_params, BOOL jsonb);
+PRIVATE int one_step_bind(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params,  // not owned. If null the statement is not cached.
+    BOOL jsonb          // bind objects and arrays as jsonb
+);
+PRIVATE BOOL is_jsonb_table(DBA_HANDLE *h, const char *tablename);
+PRIVATE size_t json2jsonb(json_t *jn, unsigned char *bf);
+PRIVATE json_t *jsonb2json(const unsigned char *bf, size_t len);
+PRIVATE GBUFFER *sqlite_create_index(
+    hgobj gobj,
+    const char *tablename,
+    json_t *jn_index    // not owned
+);
+PRIVATE void index_advisor(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,
+    const char *tablename,
+    const char *columns,
+    const char *sql
+);
 PRIVATE GBUFFER *sqlite_create_table(
     hgobj gobj,
     const char *tablename,
@@ -87,30 +670,86 @@ PRIVATE GBUFFER *sqlite_drop_table(hgobj gobj, const char *tablename);
 PRIVATE GBUFFER *sqlite_insert_new(
     hgobj gobj,
     const char *tablename,
-    json_t *kw_record
+    json_t *kw_record,  // owned
+    json_t *jn_params   // not owned, values to bind are appended
+);
+PRIVATE GBUFFER *sqlite_upsert(
+    hgobj gobj,
+    const char *tablename,
+    const char *key,
+    json_t *kw_record,  // owned
+    json_t *jn_params   // not owned, values to bind are appended
 );
-PRIVATE GBUFFER *sqlite_update_id(
+PRIVATE GBUFFER *sqlite_update(
     hgobj gobj,
     const char *tablename,
-    json_int_t id,
-    json_t *kw_record
+    json_t *kw_filtro,  // not owned
+    json_t *kw_record,  // owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
 );
-PRIVATE GBUFFER *sqlite_delete_id(
+PRIVATE GBUFFER *sqlite_delete(
     hgobj gobj,
     const char *tablename,
-    json_int_t id
+    json_t *kw_filtro,  // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
 );
 
+PRIVATE const char *jsontype2sqltype(json_t *jn);
+PRIVATE col_type_t decltype2coltype(const char *decltype);
+PRIVATE BOOL is_column_name(const char *name);
+PRIVATE BOOL path_column_name(const char *path, char *bf, size_t bfsize);
+PRIVATE BOOL filter_field(
+    const char *key,
+    json_t *jn_paths,
+    char *bf,
+    size_t bfsize
+);
+PRIVATE int change_feed_add(hgobj gobj, DBA_HANDLE *h, const char *tablename);
+PRIVATE int table_meta_set(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    const char *key,
+    json_t *kw_fields   // not owned
+);
+PRIVATE void table_meta_del(DBA_HANDLE *h, const char *tablename);
+PRIVATE int json_paths_add(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *jn_paths    // not owned
+);
+PRIVATE BOOL is_order_term(const char *term);
+PRIVATE int sqlite_predicate(
+    hgobj gobj,
+    GBUFFER *gbuf_script,
+    const char *field,
+    json_t *jn_ops,     // not owned
+    json_t *jn_params   // not owned, values to bind are appended
+);
+PRIVATE int sqlite_where(
+    hgobj gobj,
+    GBUFFER *gbuf_script,
+    json_t *kw_filtro,  // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
+);
 PRIVATE GBUFFER *sqlite_select(
     hgobj gobj,
     const char *tablename,
-    json_t *kw_filtro  // owned
+    json_t *kw_filtro,  // owned
+    json_t *jn_options, // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
 );
 
 PRIVATE json_t *sqlrow2json(
     hgobj gobj,
-    sqlite3_stmt *pStmt
+    STMT_CACHE *entry
 );
+PRIVATE int recordset_append(hgobj gobj, RECORDSET *rs, sqlite3_stmt *pStmt);
 
 /***************************************************************
  *              Data
@@ -118,6 +757,49 @@ PRIVATE json_t *sqlrow2json(
 PRIVATE BOOL __sqlite_initialized__ = FALSE;
 PRIVATE BOOL verbose;
 
+PRIVATE const char *stats_op_names[STATS_OPS] = {
+    "create",
+    "update",
+    "delete",
+    "upsert",
+    "load"
+};
+
+/*
+ *  Filter operators with a bound value, see sqlite_predicate()
+ */
+PRIVATE const struct {
+    const char *op;
+    const char *sql;
+} binary_ops[] = {
+    {"$eq",     "="},
+    {"$ne",     "<>"},
+    {"$gt",     ">"},
+    {"$gte",    ">="},
+    {"$lt",     "<"},
+    {"$lte",    "<="},
+    {"$like",   " LIKE "},
+    {"$glob",   " GLOB "},
+    {0, 0}
+};
+
+/*
+ *  Pragmas configurable by jn_properties of dba_open(), in apply order.
+ *  page_size must go before journal_mode: it cannot change in WAL mode.
+ */
+PRIVATE const char *pragma_names[] = {
+    "page_size",
+    "journal_mode",
+    "synchronous",
+    "cache_size",
+    "mmap_size",
+    "temp_store",
+    "busy_timeout",
+    "wal_autocheckpoint",
+    "foreign_keys",
+    0
+};
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -136,6 +818,197 @@ PUBLIC dba_persistent_t *dba_rc_sqlite3(void)
     return &dba;
 }
 
+/***************************************************************************
+ *  Return statistics of the handle returned by dba_open()
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_stats(hgobj gobj, void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    if(!h) {
+        return 0;
+    }
+    json_t *jn_stats = json_object();
+
+    if(h->shards) {
+        json_t *jn_shards = json_array();
+        for(int i=0; i<h->shards->size; i++) {
+            json_array_append_new(jn_shards, rc_sqlite3_stats(gobj, h->shards->handles[i]));
+        }
+        json_object_set_new(jn_stats, "shards", jn_shards);
+        return jn_stats;
+    }
+
+    json_t *jn_cache = json_object();
+    json_object_set_new(jn_cache, "size", json_integer(h->stmt_cache_size));
+    json_object_set_new(jn_cache, "count", json_integer(h->stmt_cache_count));
+    json_object_set_new(jn_cache, "hits", json_integer(h->stmt_cache_hits));
+    json_object_set_new(jn_cache, "misses", json_integer(h->stmt_cache_misses));
+    json_object_set_new(jn_cache, "evictions", json_integer(h->stmt_cache_evictions));
+    json_object_set_new(jn_stats, "stmt_cache", jn_cache);
+
+    json_t *jn_gc = json_object();
+    json_object_set_new(jn_gc, "enabled", json_boolean(h->gc_enabled));
+    json_object_set_new(jn_gc, "batch_size", json_integer(h->gc_batch_size));
+    json_object_set_new(jn_gc, "max_latency_ms", json_integer(h->gc_max_latency));
+    json_object_set_new(jn_gc, "queue_depth", json_integer(h->gc_pending));
+    json_object_set_new(jn_gc, "max_queue_depth", json_integer(h->gc_max_pending));
+    json_object_set_new(jn_gc, "flushes", json_integer(h->gc_flushes));
+    json_object_set_new(jn_gc, "flushed_writes", json_integer(h->gc_flushed_writes));
+    json_object_set_new(jn_gc, "last_flush_us", json_integer(h->gc_last_flush_us));
+    json_object_set_new(jn_gc, "max_flush_us", json_integer(h->gc_max_flush_us));
+    json_object_set_new(jn_gc, "total_flush_us", json_integer(h->gc_total_flush_us));
+    json_object_set_new(jn_stats, "group_commit", jn_gc);
+
+    json_object_set(jn_stats, "pragmas", h->jn_pragmas);
+
+    json_object_set_new(jn_stats, "tables", stats_tables(h));
+    json_object_set_new(jn_stats, "db_status", stats_db_status(h->db));
+    json_t *jn_statements = json_object();
+    stats_statements(h, jn_statements);
+    json_object_set_new(jn_stats, "statements", jn_statements);
+
+    if(h->slow_query_us) {
+        json_t *jn_slow = json_object();
+        pthread_mutex_lock(&h->stats_mutex);
+        json_object_set_new(jn_slow, "threshold_ms", json_integer(h->slow_query_us/1000));
+        json_object_set_new(jn_slow, "suppressed", json_integer(h->slow_suppressed));
+        json_object_set_new(jn_slow, "queries", json_deep_copy(h->jn_slow_queries));
+        pthread_mutex_unlock(&h->stats_mutex);
+        json_object_set_new(jn_stats, "slow_queries", jn_slow);
+    }
+
+    if(h->index_advisor) {
+        json_t *jn_advisor = json_array();
+        const char *sql;
+        json_t *jn_select;
+        json_object_foreach(h->jn_index_advisor, sql, jn_select) {
+            if(kw_get_bool(jn_select, "full_scan", 0, 0)) {
+                json_array_append(jn_advisor, jn_select);
+            }
+        }
+        json_object_set_new(jn_stats, "index_advisor", jn_advisor);
+    }
+
+    if(h->read_pool) {
+        READ_POOL *pool = h->read_pool;
+        json_t *jn_pool = json_object();
+        pthread_mutex_lock(&pool->mutex);
+        int busy = 0;
+        for(int i=0; i<pool->size; i++) {
+            if(pool->busy[i]) {
+                busy++;
+            }
+        }
+        json_object_set_new(jn_pool, "size", json_integer(pool->size));
+        json_object_set_new(jn_pool, "busy", json_integer(busy));
+        json_object_set_new(jn_pool, "acquires", json_integer(pool->acquires));
+        json_object_set_new(jn_pool, "waits", json_integer(pool->waits));
+        json_object_set_new(jn_pool, "fallbacks", json_integer(pool->fallbacks));
+        /*
+         *  The free readers are not used by other threads while the mutex is held.
+         *  The loads of the readers are in "tables", by the handle.
+         */
+        json_t *jn_readers = json_array();
+        for(int i=0; i<pool->size; i++) {
+            if(pool->busy[i]) {
+                json_array_append_new(jn_readers, json_null());
+                continue;
+            }
+            json_array_append_new(jn_readers, stats_db_status(pool->readers[i]->db));
+            stats_statements(pool->readers[i], jn_statements);
+        }
+        json_object_set_new(jn_pool, "db_status", jn_readers);
+        pthread_mutex_unlock(&pool->mutex);
+        json_object_set_new(jn_stats, "read_pool", jn_pool);
+    }
+
+    if(h->checkpointer) {
+        json_object_set_new(jn_stats, "checkpoint", checkpoint_stats(h->checkpointer));
+    }
+
+    if(h->memory) {
+        json_t *jn_memory = json_object();
+        json_object_set_new(jn_memory, "lost", json_boolean(h->memory_lost));
+        json_object_set_new(jn_memory, "writes", json_integer(h->memory_writes));
+        json_object_set_new(jn_memory, "restore_ms", json_integer(h->memory_restore_ms));
+        json_object_set_new(jn_memory, "db_status", stats_db_status(h->memory->db));
+        stats_statements(h->memory, jn_statements);
+        json_object_set_new(jn_stats, "in_memory", jn_memory);
+    }
+
+    if(h->backup) {
+        json_object_set_new(jn_stats, "backup", rc_sqlite3_backup_status(gobj, h));
+    }
+
+    if(h->async) {
+        ASYNC_WORKER *worker = h->async;
+        json_t *jn_async = json_object();
+        pthread_mutex_lock(&worker->mutex);
+        json_object_set_new(jn_async, "queue_depth", json_integer(worker->queue_depth));
+        json_object_set_new(jn_async, "submitted", json_integer(worker->submitted));
+        json_object_set_new(jn_async, "completed", json_integer(worker->completed));
+        pthread_mutex_unlock(&worker->mutex);
+        /*
+         *  The operations of the worker are done with its own connection
+         */
+        json_object_set_new(jn_async, "tables", stats_tables(worker->h));
+        json_object_set_new(jn_async, "db_status", stats_db_status(worker->h->db));
+        json_object_set_new(jn_stats, "async", jn_async);
+    }
+
+    return jn_stats;
+}
+
+/***************************************************************************
+ *  Group commit: commit now the pending writes.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_flush(hgobj gobj, void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        int ret = 0;
+        for(int i=0; i<h->shards->size; i++) {
+            if(gc_flush(gobj, h->shards->handles[i])<0) {
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+    return gc_flush(gobj, h);
+}
+
+/***************************************************************************
+ *  To call periodically (from the timer of the gobj).
+ *  Group commit: commit the pending writes older than the max latency.
+ *  Checkpoints: request a checkpoint when the writes stop.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_tick(hgobj gobj, void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    int ret = 0;
+    if(h->shards) {
+        for(int i=0; i<h->shards->size; i++) {
+            if(rc_sqlite3_tick(gobj, h->shards->handles[i])<0) {
+                ret = -1;
+            }
+        }
+        return ret;
+    }
+    if(h->gc_tx_open && time_in_miliseconds() - h->gc_tx_start >= h->gc_max_latency) {
+        ret = gc_flush(gobj, h);
+    }
+    if(h->async) {
+        async_dispatch(h);
+    }
+    if(h->backup && backup_running(h->backup)) {
+        backup_tick(gobj, h);
+    }
+    if(h->checkpointer) {
+        checkpoint_tick(gobj, h);
+    }
+    return ret;
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -161,377 +1034,5730 @@ PRIVATE void * dba_open(
     json_t *jn_properties   // owned
 )
 {
-    int ret;
-    sqlite3 *pDb;
+    DBA_HANDLE *h;
 
     if(!__sqlite_initialized__) { // Global variable, only one time can be called sqlite3_config()
         __sqlite_initialized__ = TRUE;
         sqlite3_config(SQLITE_CONFIG_LOG, sqlite_errorLogCallback, gobj);
     }
+    if(kw_get_int(jn_properties, "shards", 0, 0) > 1) {
+        h = shards_open(gobj, database, jn_properties);
+        JSON_DECREF(jn_properties);
+        return h;
+    }
     if(access(database, 0)==0) {
-        ret = sqlite3_open_v2(database, &pDb, SQLITE_OPEN_READWRITE , 0);
+        h = handle_open(gobj, database, SQLITE_OPEN_READWRITE, jn_properties);
     } else {
-        ret = sqlite3_open_v2(database, &pDb, SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE, 0);
+        h = handle_open(gobj, database, SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE, jn_properties);
         chmod(database, yuneta_rpermission());
     }
-    if(ret != SQLITE_OK) {
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_SERVICE_ERROR,
-            "msg",          "%s", "sqlite3_open_v2() FAILED",
-            "ret",          "%d", ret,
-            "error",        "%d", sqlite3_errcode(pDb),
-            "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(pDb)),
-            NULL
-        );
+    if(!h) {
+        // Error already logged
+        JSON_DECREF(jn_properties);
+        return 0;
     }
-    if(1) { // !gobj_read_bool_attr(gobj, "disable_fkeys")) {
-        one_step(gobj, "PRAGMA foreign_keys = ON;", pDb);
+
+    BOOL memory = strcmp(database, ":memory:")==0 || strstr(database, "mode=memory") || !*database;
+    if(kw_get_bool(jn_properties, "checkpoint", 0, 0)) {
+        const char *journal_mode = kw_get_str(h->jn_pragmas, "journal_mode", "", 0);
+        if(memory || strcasecmp(journal_mode, "wal")!=0) {
+            log_warning(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "checkpoint ignored, needs a database file in WAL mode",
+                "database",     "%s", database,
+                "journal_mode", "%s", journal_mode,
+                NULL
+            );
+        } else {
+            h->checkpointer = checkpoint_start(gobj, h, database, jn_properties);
+        }
     }
-    JSON_DECREF(jn_properties);
-    return pDb;
-}
 
-/***************************************************************************
- *
- ***************************************************************************/
-PRIVATE int dba_close(hgobj gobj, void *pDb)
-{
-    return sqlite3_close(pDb);
-}
+    if(kw_get_bool(jn_properties, "in_memory", 0, 0)) {
+        if(memory) {
+            log_warning(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "in_memory ignored, in-memory database",
+                "database",     "%s", database,
+                NULL
+            );
+        } else {
+            h->memory = memory_open(gobj, h, jn_properties);
+        }
+    }
 
-/***************************************************************************
- *  HACK this function MUST BE idempotent!
- ***************************************************************************/
-PRIVATE int dba_create_table(
-    hgobj gobj,
-    void *pDb,
-    const char *tablename,
-    const char *key,
-    json_t *kw_fields   // owned
-)
-{
-    GBUFFER *gbuf_sql = sqlite_create_table(gobj, tablename, key, kw_fields);
-    if(!gbuf_sql) {
-        // Error already logged
-        KW_DECREF(kw_fields);
-        return -1;
+    int read_connections = kw_get_int(jn_properties, "read_connections", 0, 0);
+    if(read_connections > 0) {
+        if(memory || h->memory) {
+            log_warning(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "read_connections ignored, in-memory database or copy",
+                "database",     "%s", database,
+                NULL
+            );
+        } else {
+            h->read_pool = read_pool_open(gobj, database, read_connections, jn_properties);
+        }
     }
-    int ret = one_step(gobj, gbuf_cur_rd_pointer(gbuf_sql), pDb);
-    gbuf_decref(gbuf_sql);
-    KW_DECREF(kw_fields);
-    return ret;
+
+    if(kw_get_bool(jn_properties, "async", 0, 0)) {
+        if(memory || h->memory) {
+            // The worker would open another database, or its writes miss the copy
+            log_warning(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "async ignored, in-memory database or copy",
+                "database",     "%s", database,
+                NULL
+            );
+        } else {
+            h->async = async_start(gobj, database, jn_properties);
+        }
+    }
+
+    JSON_DECREF(jn_properties);
+    return h;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int dba_drop_table(
-    hgobj gobj,
-    void *pDb,
-    const char *tablename
-)
+PRIVATE int dba_close(hgobj gobj, void *pDb)
 {
-    GBUFFER *gbuf_sql = sqlite_drop_table(gobj, tablename);
-    if(!gbuf_sql) {
-        // Error already logged
+    DBA_HANDLE *h = pDb;
+    if(!h) {
         return -1;
     }
-    int ret = one_step(gobj, gbuf_cur_rd_pointer(gbuf_sql), pDb);
-    gbuf_decref(gbuf_sql);
-    return ret;
+    if(h->shards) {
+        return shards_close(gobj, h);
+    }
+    if(h->backup) {
+        rc_sqlite3_backup_cancel(gobj, h);
+        backup_free(h->backup);
+        h->backup = 0;
+    }
+    if(h->async) {
+        async_stop(gobj, h);
+        h->async = 0;
+    }
+    if(h->read_pool) {
+        read_pool_close(gobj, h->read_pool);
+        h->read_pool = 0;
+    }
+    if(h->memory) {
+        handle_close(gobj, h->memory);
+        h->memory = 0;
+    }
+    if(h->checkpointer) {
+        checkpoint_stop(h->checkpointer);
+        h->checkpointer = 0;
+    }
+    return handle_close(gobj, h);
 }
 
 /***************************************************************************
- *
+ *  Open a connection and its handle, apply the properties.
  ***************************************************************************/
-PRIVATE uint64_t dba_create_record(
+PRIVATE DBA_HANDLE *handle_open(
     hgobj gobj,
-    void *pDb,
-    const char *tablename,
-    json_t *kw_record  // owned
+    const char *database,
+    int flags,
+    json_t *jn_properties // not owned
 )
 {
-    json_int_t id = kw_get_int(kw_record, "id", 0, 0);
-    if(id==0) {
-        /*
-         *  Remove the id columns
-         *  to let sqlite assign the id if not set by user
-         */
-        json_object_del(kw_record, "id");
-    }
-    /*
-     *  Insert sqlite sql
-     */
-    GBUFFER *gbuf_sql = sqlite_insert_new(
-        gobj,
-        tablename,
-        kw_record // owned
-    );
-    if(!gbuf_sql) {
-        // Error already logged
-        return -1;
+    sqlite3 *pDb = 0;
+
+    int ret = sqlite3_open_v2(database, &pDb, flags, 0);
+    if(ret != SQLITE_OK) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_open_v2() FAILED",
+            "database",     "%s", database,
+            "ret",          "%d", ret,
+            "error",        "%d", sqlite3_errcode(pDb),
+            "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(pDb)),
+            NULL
+        );
+        sqlite3_close(pDb);
+        return 0;
     }
 
-    /*
-     *  Ejecuta el script
-     */
-    int ret = one_step(gobj, gbuf_cur_rd_pointer(gbuf_sql), pDb);
-    if(ret < 0) {
-        // Error already logged
-        gbuf_decref(gbuf_sql);
-        return -1;
+    DBA_HANDLE *h = gbmem_malloc(sizeof(DBA_HANDLE));
+    if(!h) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(DBA_HANDLE),
+            NULL
+        );
+        sqlite3_close(pDb);
+        return 0;
     }
-    gbuf_decref(gbuf_sql);
+    h->db = pDb;
+    h->jn_stmt_index = json_object();
+    h->stmt_cache_size = kw_get_int(
+        jn_properties, "stmt_cache_size", DEFAULT_STMT_CACHE_SIZE, 0
+    );
+    h->gc_enabled = kw_get_bool(jn_properties, "group_commit", 0, 0);
+    h->gc_batch_size = kw_get_int(
+        jn_properties, "group_commit_size", DEFAULT_GROUP_COMMIT_SIZE, 0
+    );
+    h->gc_max_latency = kw_get_int(
+        jn_properties, "group_commit_latency", DEFAULT_GROUP_COMMIT_LATENCY, 0
+    );
+    h->jn_table_keys = json_object();
+    h->jn_json_paths = json_object();
+    h->jn_json_storage = json_object();
+    h->index_advisor = kw_get_bool(jn_properties, "index_advisor", 0, 0);
+    h->jn_index_advisor = json_object();
+    pthread_mutex_init(&h->stats_mutex, 0);
+    h->slow_query_us = kw_get_int(jn_properties, "slow_query_ms", 0, 0) * 1000;
+    h->slow_query_rate = kw_get_int(
+        jn_properties, "slow_query_rate", DEFAULT_SLOW_QUERY_RATE, 0
+    );
+    h->jn_slow_queries = json_object();
 
-    /*
-     *  Get the id given by sqlite (given by us, or not).
-     */
-    sqlite3_int64 rowid = sqlite3_last_insert_rowid(pDb);
-    return rowid;
+    apply_pragmas(gobj, h, jn_properties);
+
+    return h;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int dba_update_record(
+PRIVATE int handle_close(hgobj gobj, DBA_HANDLE *h)
+{
+    gc_flush(gobj, h);
+    stmt_cache_flush(h);
+    JSON_DECREF(h->jn_stmt_index);
+    JSON_DECREF(h->jn_pragmas);
+    JSON_DECREF(h->jn_index_advisor);
+    JSON_DECREF(h->jn_table_keys);
+    JSON_DECREF(h->jn_json_paths);
+    JSON_DECREF(h->jn_json_storage);
+    JSON_DECREF(h->jn_slow_queries);
+    TABLE_STATS *stats = h->table_stats;
+    while(stats) {
+        TABLE_STATS *next = stats->next;
+        gbmem_free(stats->tablename);
+        gbmem_free(stats);
+        stats = next;
+    }
+    pthread_mutex_destroy(&h->stats_mutex);
+    int ret = sqlite3_close(h->db);
+    gbmem_free(h);
+    return ret;
+}
+
+/***************************************************************************
+ *  Open the read-only connections.
+ *  Only the properties that matter to a reader are applied.
+ ***************************************************************************/
+PRIVATE READ_POOL *read_pool_open(
     hgobj gobj,
-    void *pDb,
-    const char *tablename,
-    json_t *kw_filtro,  // owned
-    json_t *kw_record   // owned
+    const char *database,
+    int size,
+    json_t *jn_properties // not owned
 )
 {
-    uint64_t id = kw_get_int(kw_filtro, "id", 0, KW_REQUIRED);
-    KW_DECREF(kw_filtro);
-    json_object_del(kw_record, "id");
+    READ_POOL *pool = gbmem_malloc(sizeof(READ_POOL));
+    if(pool) {
+        pool->readers = gbmem_malloc(sizeof(DBA_HANDLE *) * size);
+        pool->busy = gbmem_malloc(sizeof(BOOL) * size);
+    }
+    if(!pool || !pool->readers || !pool->busy) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        if(pool) {
+            if(pool->readers) {
+                gbmem_free(pool->readers);
+            }
+            if(pool->busy) {
+                gbmem_free(pool->busy);
+            }
+            gbmem_free(pool);
+        }
+        return 0;
+    }
+    pthread_mutex_init(&pool->mutex, 0);
+    pthread_cond_init(&pool->cond, 0);
 
-    /*
-     *  Update sqlite sql
-     */
-    GBUFFER *gbuf_sql;
-    gbuf_sql = sqlite_update_id(
-        gobj,
-        tablename,
-        id,
-        kw_record // owned
-    );
+    const char *reader_properties[] = {
+        "stmt_cache_size",
+        "cache_size",
+        "mmap_size",
+        "temp_store",
+        "busy_timeout",
+        0
+    };
+    json_t *jn_reader = json_object();
+    for(int i=0; reader_properties[i]; i++) {
+        json_t *jn_value = json_object_get(jn_properties, reader_properties[i]);
+        if(jn_value) {
+            json_object_set(jn_reader, reader_properties[i], jn_value);
+        }
+    }
 
-    if(!gbuf_sql) {
-        // Error already logged
-        return -1;
+    for(int i=0; i<size; i++) {
+        DBA_HANDLE *reader = handle_open(
+            gobj,
+            database,
+            SQLITE_OPEN_READONLY|SQLITE_OPEN_NOMUTEX,
+            jn_reader
+        );
+        if(!reader) {
+            // Error already logged
+            break;
+        }
+        pool->readers[pool->size++] = reader;
     }
+    JSON_DECREF(jn_reader);
 
-    /*
-     *  Ejecuta el script
-     */
-    int ret = one_step(gobj, gbuf_cur_rd_pointer(gbuf_sql), pDb);
-    gbuf_decref(gbuf_sql);
-    return ret;
+    if(pool->size == 0) {
+        read_pool_close(gobj, pool);
+        return 0;
+    }
+    return pool;
 }
 
 /***************************************************************************
  *
  ***************************************************************************/
-PRIVATE int dba_delete_record(
-    hgobj gobj,
-    void *pDb,
-    const char *tablename,
-    json_t *kw_filtro // owned
-)
+PRIVATE void read_pool_close(hgobj gobj, READ_POOL *pool)
 {
-    // By the moment, uso restringido de kw_filtro, solo para id.
-    uint64_t id = kw_get_int(kw_filtro, "id", 0, KW_REQUIRED);
-    KW_DECREF(kw_filtro);
+    for(int i=0; i<pool->size; i++) {
+        handle_close(gobj, pool->readers[i]);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    gbmem_free(pool->readers);
+    gbmem_free(pool->busy);
+    gbmem_free(pool);
+}
 
-    GBUFFER *gbuf_sql;
-    gbuf_sql = sqlite_delete_id(
-        gobj,
-        tablename,
-        id
-    );
-    if(!gbuf_sql) {
-        return -1;
+/***************************************************************************
+ *  Finalize the cached statements of the free readers (schema changed)
+ ***************************************************************************/
+PRIVATE void read_pool_flush_cache(READ_POOL *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    for(int i=0; i<pool->size; i++) {
+        if(!pool->busy[i]) {
+            stmt_cache_flush(pool->readers[i]);
+        }
     }
+    pthread_mutex_unlock(&pool->mutex);
+}
 
-    /*
-     *  Ejecuta el script
-     */
-    int ret = one_step(gobj, gbuf_cur_rd_pointer(gbuf_sql), pDb);
-    if(ret < 0) {
-        // Error already logged
-        gbuf_decref(gbuf_sql);
-        return -1;
+/***************************************************************************
+ *  Get a connection to read.
+ *  The in-memory copy if there is one.
+ *  The writer is returned if there is no pool, or if the writer has
+ *  a transaction open: its writes are not visible to other connections yet.
+ *  If all readers are busy: wait one if `wait`, else return the writer
+ *  (loads called from dba_filter callbacks must not block).
+ ***************************************************************************/
+PRIVATE DBA_HANDLE *read_conn_acquire(DBA_HANDLE *h, BOOL wait)
+{
+    if(h->memory && !h->memory_lost) {
+        return h->memory;
+    }
+    READ_POOL *pool = h->read_pool;
+    if(!pool) {
+        return h;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    if(!sqlite3_get_autocommit(h->db)) {
+        pool->fallbacks++;
+        pthread_mutex_unlock(&pool->mutex);
+        return h;
+    }
+    BOOL waited = FALSE;
+    while(TRUE) {
+        for(int i=0; i<pool->size; i++) {
+            if(!pool->busy[i]) {
+                pool->busy[i] = TRUE;
+                pool->acquires++;
+                if(waited) {
+                    pool->waits++;
+                }
+                pthread_mutex_unlock(&pool->mutex);
+                return pool->readers[i];
+            }
+        }
+        if(!wait) {
+            pool->fallbacks++;
+            pthread_mutex_unlock(&pool->mutex);
+            return h;
+        }
+        waited = TRUE;
+        pthread_cond_wait(&pool->cond, &pool->mutex);
     }
-    gbuf_decref(gbuf_sql);
-    return 0;
 }
 
 /***************************************************************************
- *
+ *  Give back a connection got with read_conn_acquire()
  ***************************************************************************/
-PRIVATE json_t *dba_load_table(
+PRIVATE void read_conn_release(DBA_HANDLE *h, DBA_HANDLE *conn)
+{
+    READ_POOL *pool = h->read_pool;
+    if(!pool || conn == h || conn == h->memory) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    for(int i=0; i<pool->size; i++) {
+        if(pool->readers[i] == conn) {
+            pool->busy[i] = FALSE;
+            break;
+        }
+    }
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/***************************************************************************
+ *  In-memory copy of the database, restored from the file with the
+ *  backup api. Only the properties that matter to the copy are applied.
+ ***************************************************************************/
+PRIVATE DBA_HANDLE *memory_open(
     hgobj gobj,
-    void *pDb,
-    const char* tablename,
-    const char* resource,
-    void *user_data,    // To use as parameter in dba_record_cb() callback.
-    json_t *kw_filtro,  // owned. Filter the records if you don't full table. See kw_record keys.
-    dba_record_cb dba_filter,
-    json_t *jn_record_list
+    DBA_HANDLE *h,
+    json_t *jn_properties // not owned
 )
 {
-    if(!jn_record_list) {
-        jn_record_list = json_array();
+    const char *memory_properties[] = {
+        "stmt_cache_size",
+        "cache_size",
+        "temp_store",
+        "foreign_keys",
+        0
+    };
+    json_t *jn_memory = json_object();
+    for(int i=0; memory_properties[i]; i++) {
+        json_t *jn_value = json_object_get(jn_properties, memory_properties[i]);
+        if(jn_value) {
+            json_object_set(jn_memory, memory_properties[i], jn_value);
+        }
     }
-
-    GBUFFER *gbuf_sql = sqlite_select(
+    DBA_HANDLE *memory = handle_open(
         gobj,
-        tablename,
-        kw_filtro  // owned
+        ":memory:",
+        SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE,
+        jn_memory
     );
-    if(!gbuf_sql) {
+    JSON_DECREF(jn_memory);
+    if(!memory) {
         // Error already logged
-        return jn_record_list;
+        return 0;
     }
 
-    sqlite3_stmt *pStmt;
-    const char *sql = gbuf_cur_rd_pointer(gbuf_sql);
-
-    int ret = sqlite3_prepare_v2(
-        pDb,
-        sql,
-        -1,
-        &pStmt,
-        0
-    );
-    if(ret != SQLITE_OK) {
+    uint64_t t0 = time_in_miliseconds();
+    sqlite3_backup *backup = sqlite3_backup_init(memory->db, "main", h->db, "main");
+    int ret = backup? sqlite3_backup_step(backup, -1) : sqlite3_errcode(memory->db);
+    int pages = backup? sqlite3_backup_pagecount(backup) : 0;
+    sqlite3_backup_finish(backup);
+    if(ret != SQLITE_DONE) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_SERVICE_ERROR,
-            "msg",          "%s", "sqlite3_prepare_v2() FAILED",
-            "sql",          "%s", sql,
+            "msg",          "%s", "restore of the database in memory FAILED",
+            "database",     "%s", sqlite3_db_filename(h->db, "main"),
             "ret",          "%d", ret,
-            "error",        "%d", sqlite3_errcode(pDb),
-            "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(pDb)),
+            "errormsg",     "%s", sqlite3_errstr(ret),
             NULL
         );
-        log_debug_dump(
-            0,
-            sql,
-            strlen(sql),
-            "sqlite3_prepare_v2() FAILED"
-        );
-        gbuf_decref(gbuf_sql);
-        return jn_record_list;
+        handle_close(gobj, memory);
+        return 0;
     }
-    while(TRUE) {
-        ret = sqlite3_step(pStmt);
-        if(ret == SQLITE_ROW) {
-            json_t *kw_record = sqlrow2json(gobj, pStmt);
-            JSON_INCREF(kw_record);
-            int ret = dba_filter(gobj, resource, user_data, kw_record);
-            // Return 1 append, 0 ignore, -1 break the load.
-            if(ret < 0) {
-                JSON_DECREF(kw_record);
-                break;
-            } else if(ret==0) {
+    h->memory_restore_ms = time_in_miliseconds() - t0;
+
+    log_info(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_DATABASE,
+        "msg",          "%s", "database restored in memory",
+        "database",     "%s", sqlite3_db_filename(h->db, "main"),
+        "pages",        "%d", pages,
+        "elapsed_ms",   "%llu", (unsigned long long)h->memory_restore_ms,
+        NULL
+    );
+    return memory;
+}
+
+/***************************************************************************
+ *  Apply to the in-memory copy a statement done in the file.
+ *  Transaction control statements too: the copy commits and rolls back
+ *  with the file.
+ ***************************************************************************/
+PRIVATE void memory_mirror(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params,  // not owned
+    BOOL jsonb
+)
+{
+    DBA_HANDLE *memory = h->memory;
+    int ret;
+    if(jn_params) {
+        STMT_CACHE *entry = stmt_acquire(gobj, memory, sql);
+        if(!entry) {
+            // Error already logged
+            memory_lost(gobj, h, sql, sqlite3_errmsg(memory->db));
+            return;
+        }
+        ret = bind_params(gobj, entry->pStmt, jn_params, jsonb)<0? SQLITE_ERROR : SQLITE_ROW;
+        while(ret == SQLITE_ROW) {
+            ret = sqlite3_step(entry->pStmt);   // upserts return the id
+        }
+        stmt_release(memory, entry);
+    } else {
+        ret = sqlite3_exec(memory->db, sql, 0, 0, 0)==SQLITE_OK? SQLITE_DONE : SQLITE_ERROR;
+    }
+    if(ret != SQLITE_DONE) {
+        memory_lost(gobj, h, sql, sqlite3_errmsg(memory->db));
+        return;
+    }
+    h->memory_writes++;
+}
+
+/***************************************************************************
+ *  The copy is not equal to the file: stop using it, the file rules.
+ *  It's closed by dba_close(), cursors can be open on it.
+ ***************************************************************************/
+PRIVATE void memory_lost(hgobj gobj, DBA_HANDLE *h, const char *sql, const char *errmsg)
+{
+    log_error(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_SERVICE_ERROR,
+        "msg",          "%s", "in-memory copy lost, the reads go to the file",
+        "sql",          "%s", sql,
+        "errormsg",     "%s", errmsg?errmsg:"",
+        NULL
+    );
+    h->memory_lost = TRUE;
+}
+
+/***************************************************************************
+ *  HACK this function MUST BE idempotent!
+ ***************************************************************************/
+PRIVATE int dba_create_table(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    const char *key,
+    json_t *kw_fields   // owned
+)
+{
+    if(((DBA_HANDLE *)pDb)->shards) {
+        return shards_create_table(gobj, pDb, tablename, key, kw_fields);
+    }
+    GBUFFER *gbuf_sql = sqlite_create_table(gobj, tablename, key, kw_fields);
+    if(!gbuf_sql) {
+        // Error already logged
+        KW_DECREF(kw_fields);
+        return -1;
+    }
+    int ret = one_step(gobj, pDb, gbuf_cur_rd_pointer(gbuf_sql), 0);
+    gbuf_decref(gbuf_sql);
+    if(ret < 0) {
+        // Error already logged
+        KW_DECREF(kw_fields);
+        return -1;
+    }
+
+    ret = table_meta_set(gobj, pDb, tablename, key, kw_fields);
+
+    /*
+     *  Secondary indexes
+     */
+    json_t *jn_indexes = json_object_get(kw_fields, "__indexes__");
+    size_t idx;
+    json_t *jn_index;
+    json_array_foreach(jn_indexes, idx, jn_index) {
+        if(ret < 0) {
+            break;
+        }
+        gbuf_sql = sqlite_create_index(gobj, tablename, jn_index);
+        if(!gbuf_sql) {
+            // Error already logged
+            ret = -1;
+            break;
+        }
+        ret = one_step(gobj, pDb, gbuf_cur_rd_pointer(gbuf_sql), 0);
+        gbuf_decref(gbuf_sql);
+    }
+
+    /*
+     *  Change feed
+     */
+    if(ret >= 0 && kw_get_bool(kw_fields, "__change_feed__", 0, 0)) {
+        ret = change_feed_add(gobj, pDb, tablename);
+    }
+
+    if(((DBA_HANDLE *)pDb)->async) {
+        async_table_meta(gobj, pDb, tablename);
+    }
+
+    KW_DECREF(kw_fields);
+    return ret;
+}
+
+/***************************************************************************
+ *  Metadata of a table kept by the handle: key of the upserts,
+ *  storage of the object/array fields, generated columns of json paths.
+ ***************************************************************************/
+PRIVATE int table_meta_set(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    const char *key,
+    json_t *kw_fields   // not owned
+)
+{
+    if(key) {
+        json_object_set_new(h->jn_table_keys, tablename, json_string(key));
+    }
+
+    /*
+     *  Storage of the object/array fields
+     */
+    const char *json_storage = kw_get_str(kw_fields, "__json_storage__", "text", 0);
+    if(strcmp(json_storage, "jsonb")==0) {
+        json_object_set_new(h->jn_json_storage, tablename, json_string("jsonb"));
+    } else {
+        json_object_del(h->jn_json_storage, tablename);
+    }
+
+    /*
+     *  Generated columns of json paths
+     */
+    json_t *jn_paths = json_object_get(kw_fields, "__paths__");
+    if(jn_paths) {
+        return json_paths_add(gobj, h, tablename, jn_paths);
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Forget a dropped table: metadata and cached statements.
+ ***************************************************************************/
+PRIVATE void table_meta_del(DBA_HANDLE *h, const char *tablename)
+{
+    json_object_del(h->jn_table_keys, tablename);
+    json_object_del(h->jn_json_storage, tablename);
+    json_object_del(h->jn_json_paths, tablename);
+    stmt_cache_flush(h);
+    if(h->read_pool) {
+        read_pool_flush_cache(h->read_pool);
+    }
+}
+
+/***************************************************************************
+ *  Change feed of a table: triggers that journal in __changes__
+ *  the rowid and the operation of each write, with a version
+ *  (AUTOINCREMENT, never reused). __change_feed__ has the tables
+ *  with feed and the last version trimmed of each one.
+ ***************************************************************************/
+PRIVATE int change_feed_add(hgobj gobj, DBA_HANDLE *h, const char *tablename)
+{
+    const char *schema[] = {
+        "CREATE TABLE IF NOT EXISTS __changes__ ("
+            "version INTEGER PRIMARY KEY AUTOINCREMENT, "
+            "tablename TEXT NOT NULL, "
+            "row_id INTEGER NOT NULL, "
+            "op TEXT NOT NULL);",
+        "CREATE INDEX IF NOT EXISTS __changes_tablename__ ON __changes__ (tablename, version);",
+        "CREATE TABLE IF NOT EXISTS __change_feed__ ("
+            "tablename TEXT PRIMARY KEY, "
+            "trimmed INTEGER NOT NULL DEFAULT 0);",
+        0
+    };
+    const struct {
+        const char *op;
+        const char *event;
+        const char *row;
+    } triggers[] = {
+        {"insert", "INSERT", "NEW"},
+        {"update", "UPDATE", "NEW"},
+        {"delete", "DELETE", "OLD"},
+        {0}
+    };
+
+    if(tr_begin(gobj, h, "change_feed")<0) {
+        // Error already logged
+        return -1;
+    }
+    int ret = 0;
+    for(int i=0; schema[i] && ret>=0; i++) {
+        ret = one_step(gobj, h, schema[i], 0);
+    }
+    if(ret >= 0) {
+        char *sql = sqlite3_mprintf(
+            "INSERT OR IGNORE INTO __change_feed__ (tablename) VALUES (%Q);",
+            tablename
+        );
+        ret = one_step(gobj, h, sql, 0);
+        sqlite3_free(sql);
+    }
+    for(int i=0; triggers[i].op && ret>=0; i++) {
+        char *sql = sqlite3_mprintf(
+            "CREATE TRIGGER IF NOT EXISTS __changes_%s_%s__ AFTER %s ON %s BEGIN "
+                "INSERT INTO __changes__ (tablename, row_id, op) VALUES (%Q, %s.rowid, '%s'); "
+            "END;",
+            tablename, triggers[i].op, triggers[i].event, tablename,
+            tablename, triggers[i].row, triggers[i].op
+        );
+        ret = one_step(gobj, h, sql, 0);
+        sqlite3_free(sql);
+    }
+    if(ret < 0 || tr_commit(gobj, h, "change_feed")<0) {
+        // Error already logged
+        tr_rollback(gobj, h, "change_feed");
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Add the generated columns of the json paths not created yet,
+ *  and register them to the filters of the table.
+ *      "__paths__": {"config.region": "", "config.limits.max": 0}
+ *  The value is the type, as in kw_fields.
+ ***************************************************************************/
+PRIVATE int json_paths_add(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *jn_paths    // not owned
+)
+{
+    json_t *jn_table_paths = json_object_get(h->jn_json_paths, tablename);
+    if(!jn_table_paths) {
+        jn_table_paths = json_object();
+        json_object_set_new(h->jn_json_paths, tablename, jn_table_paths);
+    }
+
+    const char *path;
+    json_t *jn_type;
+    json_object_foreach(jn_paths, path, jn_type) {
+        char column[256];
+        if(!path_column_name(path, column, sizeof(column))) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "json path not valid, field.key[.key...] expected",
+                "tablename",    "%s", tablename,
+                "path",         "%s", path,
+                NULL
+            );
+            return -1;
+        }
+
+        /*
+         *  Already created?
+         */
+        BOOL exists = FALSE;
+        sqlite3_stmt *pStmt = 0;
+        if(sqlite3_prepare_v2(h->db,
+                "SELECT 1 FROM pragma_table_xinfo(?) WHERE name=?;", -1, &pStmt, 0)==SQLITE_OK) {
+            sqlite3_bind_text(pStmt, 1, tablename, -1, SQLITE_STATIC);
+            sqlite3_bind_text(pStmt, 2, column, -1, SQLITE_STATIC);
+            exists = sqlite3_step(pStmt)==SQLITE_ROW;
+        }
+        sqlite3_finalize(pStmt);
+
+        if(!exists) {
+            const char *dot = strchr(path, '.');
+            char *sql = sqlite3_mprintf(
+                "ALTER TABLE %s ADD COLUMN %s %s "
+                "GENERATED ALWAYS AS (json_extract(%.*s, '$%s')) VIRTUAL;",
+                tablename,
+                column,
+                jsontype2sqltype(jn_type),
+                (int)(dot - path), path,
+                dot
+            );
+            int ret = one_step(gobj, h, sql, 0);
+            sqlite3_free(sql);
+            if(ret < 0) {
+                // Error already logged
+                return -1;
+            }
+        }
+        json_object_set_new(jn_table_paths, path, json_string(column));
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int dba_drop_table(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename
+)
+{
+    if(((DBA_HANDLE *)pDb)->shards) {
+        return shards_drop_table(gobj, pDb, tablename);
+    }
+    GBUFFER *gbuf_sql = sqlite_drop_table(gobj, tablename);
+    if(!gbuf_sql) {
+        // Error already logged
+        return -1;
+    }
+    /*
+     *  Cached statements of the table are not valid anymore.
+     */
+    DBA_HANDLE *h = pDb;
+    stmt_cache_flush(h);
+    if(h->read_pool) {
+        read_pool_flush_cache(h->read_pool);
+    }
+    if(h->memory) {
+        stmt_cache_flush(h->memory);
+    }
+
+    int ret = one_step(gobj, pDb, gbuf_cur_rd_pointer(gbuf_sql), 0);
+    gbuf_decref(gbuf_sql);
+
+    /*
+     *  Journal of the change feed, the triggers are dropped with the table
+     */
+    if(ret >= 0 && sqlite3_table_column_metadata(
+            h->db, 0, "__change_feed__", "tablename", 0, 0, 0, 0, 0)==SQLITE_OK) {
+        json_t *jn_params = json_pack("[s]", tablename);
+        ret = one_step(gobj, h, "DELETE FROM __changes__ WHERE tablename=?;", jn_params);
+        if(ret >= 0) {
+            ret = one_step(gobj, h, "DELETE FROM __change_feed__ WHERE tablename=?;", jn_params);
+        }
+        JSON_DECREF(jn_params);
+    }
+    return ret;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE uint64_t dba_create_record(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_record  // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_create_record(gobj, h, tablename, kw_record);
+    }
+    uint64_t t0 = time_in_usec();
+    gc_begin(gobj, h);
+    json_int_t id = insert_record(gobj, h, tablename, kw_record);
+    if(id >= 0) {
+        gc_written(gobj, h, 1);
+    }
+    stats_add(h, table_stats(h, tablename), STATS_OP_CREATE, t0, id<0?-1:1);
+    return id;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int dba_update_record(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *kw_record   // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_write(gobj, h, tablename, kw_filtro, kw_record);
+    }
+    uint64_t t0 = time_in_usec();
+    json_object_del(kw_record, "id");
+
+    /*
+     *  Update sqlite sql
+     */
+    json_t *jn_params = json_array();
+    GBUFFER *gbuf_sql;
+    gbuf_sql = sqlite_update(
+        gobj,
+        tablename,
+        kw_filtro,
+        kw_record, // owned
+        json_object_get(h->jn_json_paths, tablename),
+        jn_params
+    );
+    KW_DECREF(kw_filtro);
+
+    if(!gbuf_sql) {
+        // Error already logged
+        stats_add(h, table_stats(h, tablename), STATS_OP_UPDATE, t0, -1);
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    /*
+     *  Ejecuta el script
+     */
+    gc_begin(gobj, h);
+    int ret = one_step_bind(
+        gobj,
+        h,
+        gbuf_cur_rd_pointer(gbuf_sql),
+        jn_params,
+        is_jsonb_table(h, tablename)
+    );
+    gbuf_decref(gbuf_sql);
+    JSON_DECREF(jn_params);
+    if(ret < 0) {
+        // Error already logged
+        stats_add(h, table_stats(h, tablename), STATS_OP_UPDATE, t0, -1);
+        return -1;
+    }
+    sqlite3_int64 changes = sqlite3_changes64(h->db);
+    gc_written(gobj, h, changes);
+    stats_add(h, table_stats(h, tablename), STATS_OP_UPDATE, t0, changes);
+    return (int)changes;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int dba_delete_record(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_write(gobj, h, tablename, kw_filtro, 0);
+    }
+    uint64_t t0 = time_in_usec();
+    json_t *jn_params = json_array();
+    GBUFFER *gbuf_sql;
+    gbuf_sql = sqlite_delete(
+        gobj,
+        tablename,
+        kw_filtro,
+        json_object_get(h->jn_json_paths, tablename),
+        jn_params
+    );
+    KW_DECREF(kw_filtro);
+    if(!gbuf_sql) {
+        stats_add(h, table_stats(h, tablename), STATS_OP_DELETE, t0, -1);
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    /*
+     *  Ejecuta el script
+     */
+    gc_begin(gobj, h);
+    int ret = one_step(gobj, h, gbuf_cur_rd_pointer(gbuf_sql), jn_params);
+    gbuf_decref(gbuf_sql);
+    JSON_DECREF(jn_params);
+    if(ret < 0) {
+        // Error already logged
+        stats_add(h, table_stats(h, tablename), STATS_OP_DELETE, t0, -1);
+        return -1;
+    }
+    sqlite3_int64 changes = sqlite3_changes64(h->db);
+    gc_written(gobj, h, changes);
+    stats_add(h, table_stats(h, tablename), STATS_OP_DELETE, t0, changes);
+    return (int)changes;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *dba_load_table(
+    hgobj gobj,
+    void *pDb,
+    const char* tablename,
+    const char* resource,
+    void *user_data,    // To use as parameter in dba_record_cb() callback.
+    json_t *kw_filtro,  // owned. Filter the records if you don't full table. See kw_record keys.
+    dba_record_cb dba_filter,
+    json_t *jn_record_list
+)
+{
+    if(!jn_record_list) {
+        jn_record_list = json_array();
+    }
+
+    DBA_CURSOR *cursor = rc_sqlite3_cursor_open(gobj, pDb, tablename, kw_filtro, 0);
+    if(!cursor) {
+        // Error already logged
+        return jn_record_list;
+    }
+
+    json_t *kw_record;
+    while((kw_record = rc_sqlite3_cursor_next(gobj, cursor))) {
+        JSON_INCREF(kw_record);
+        int ret = dba_filter(gobj, resource, user_data, kw_record);
+        // Return 1 append, 0 ignore, -1 break the load.
+        if(ret < 0) {
+            JSON_DECREF(kw_record);
+            break;
+        } else if(ret==0) {
+            JSON_DECREF(kw_record);
+            continue;
+        }
+        json_array_append_new(jn_record_list, kw_record);
+    }
+    rc_sqlite3_cursor_close(gobj, cursor);
+
+    return jn_record_list;
+}
+
+/***************************************************************************
+ *  Convert the object/array fields of the records of a table
+ *  to the storage "jsonb" or "text", and use it in the next writes.
+ *  The rows are converted by batches of ids, in a transaction.
+ *  Return the number of values converted, -1 on error.
+ ***************************************************************************/
+PUBLIC json_int_t rc_sqlite3_json_storage_migrate(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    const char *storage     // "jsonb" or "text"
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        SHARD_SET *set = h->shards;
+        int shard = shard_of_table(set, tablename);
+        if(shard >= 0) {
+            return rc_sqlite3_json_storage_migrate(gobj, set->handles[shard], tablename, storage);
+        }
+        json_int_t converted = 0;
+        for(int i=0; i<set->size; i++) {
+            json_int_t ret = rc_sqlite3_json_storage_migrate(
+                gobj, set->handles[i], tablename, storage
+            );
+            if(ret < 0) {
+                // Error already logged
+                return -1;
+            }
+            converted += ret;
+        }
+        return converted;
+    }
+    BOOL to_jsonb = strcmp(storage, "jsonb")==0;
+    if(!to_jsonb && strcmp(storage, "text")!=0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "storage must be jsonb or text",
+            "tablename",    "%s", tablename,
+            "storage",      "%s", storage,
+            NULL
+        );
+        return -1;
+    }
+
+    /*
+     *  The object/array fields: declared BLOB
+     */
+    json_t *jn_columns = json_array();
+    sqlite3_stmt *pStmt = 0;
+    if(sqlite3_prepare_v2(h->db,
+            "SELECT name, type FROM pragma_table_info(?);", -1, &pStmt, 0)==SQLITE_OK) {
+        sqlite3_bind_text(pStmt, 1, tablename, -1, SQLITE_STATIC);
+        while(sqlite3_step(pStmt)==SQLITE_ROW) {
+            const char *type = (const char *)sqlite3_column_text(pStmt, 1);
+            if(type && decltype2coltype(type)==COL_BLOB) {
+                json_array_append_new(
+                    jn_columns, json_string((const char *)sqlite3_column_text(pStmt, 0))
+                );
+            }
+        }
+    }
+    sqlite3_finalize(pStmt);
+
+    if(tr_begin(gobj, h, "json_storage")<0) {
+        // Error already logged
+        JSON_DECREF(jn_columns);
+        return -1;
+    }
+
+    json_int_t converted = 0;
+    size_t idx;
+    json_t *jn_column;
+    json_array_foreach(jn_columns, idx, jn_column) {
+        const char *column = json_string_value(jn_column);
+        char *select = sqlite3_mprintf(
+            "SELECT id, %s FROM %s WHERE id>? AND typeof(%s)=? ORDER BY id LIMIT 1000;",
+            column, tablename, column
+        );
+        char *update = sqlite3_mprintf("UPDATE %s SET %s=? WHERE id=?;", tablename, column);
+
+        json_int_t last_id = -1;
+        BOOL more = TRUE;
+        while(more && converted >= 0) {
+            /*
+             *  A batch of ids and values, converted out of the select
+             */
+            json_t *jn_batch = json_array();
+            int rows = 0;
+            if(sqlite3_prepare_v2(h->db, select, -1, &pStmt, 0)!=SQLITE_OK) {
+                converted = -1;
+            } else {
+                sqlite3_bind_int64(pStmt, 1, last_id);
+                sqlite3_bind_text(pStmt, 2, to_jsonb?"text":"blob", -1, SQLITE_STATIC);
+                while(sqlite3_step(pStmt)==SQLITE_ROW) {
+                    rows++;
+                    last_id = sqlite3_column_int64(pStmt, 0);
+                    const void *v = sqlite3_column_blob(pStmt, 1);
+                    size_t len = sqlite3_column_bytes(pStmt, 1);
+                    json_t *jn_value = to_jsonb?
+                        json_loadb(v, len, 0, 0) :
+                        jsonb2json(v, len);
+                    if(jn_value) {
+                        // Not json values are left as they are
+                        json_array_append_new(jn_batch,
+                            json_pack("[o,I]", jn_value, last_id)
+                        );
+                    }
+                }
+            }
+            sqlite3_finalize(pStmt);
+            more = rows > 0;
+
+            size_t i;
+            json_t *jn_params;
+            json_array_foreach(jn_batch, i, jn_params) {
+                if(converted < 0) {
+                    break;
+                }
+                if(one_step_bind(gobj, h, update, jn_params, to_jsonb)<0) {
+                    // Error already logged
+                    converted = -1;
+                    break;
+                }
+                converted++;
+            }
+            JSON_DECREF(jn_batch);
+        }
+        sqlite3_free(select);
+        sqlite3_free(update);
+        if(converted < 0) {
+            break;
+        }
+    }
+    JSON_DECREF(jn_columns);
+
+    if(converted < 0) {
+        tr_rollback(gobj, h, "json_storage");
+        return -1;
+    }
+    if(tr_commit(gobj, h, "json_storage")<0) {
+        // Error already logged
+        return -1;
+    }
+
+    if(to_jsonb) {
+        json_object_set_new(h->jn_json_storage, tablename, json_string("jsonb"));
+    } else {
+        json_object_del(h->jn_json_storage, tablename);
+    }
+    if(h->async) {
+        async_table_meta(gobj, h, tablename);
+    }
+    return converted;
+}
+
+/***************************************************************************
+ *  Load a table with `threads` threads, each one with a reader of the pool
+ *  loading a range of ids. The records are passed to dba_filter, in this
+ *  thread, in id order, as dba_load_table() does.
+ *  Without free readers (no pool, writer with a transaction open)
+ *  it's a serial dba_load_table().
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_load_table_parallel(
+    hgobj gobj,
+    void *pDb,
+    const char* tablename,
+    const char* resource,
+    void *user_data,    // To use as parameter in dba_record_cb() callback.
+    json_t *kw_filtro,  // owned
+    dba_record_cb dba_filter,
+    json_t *jn_record_list,
+    int threads
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        /*
+         *  In one shard: with its readers. Over the shards: the merged serial load.
+         */
+        int shard = shard_of_filter(h->shards, tablename, kw_filtro);
+        if(shard < 0) {
+            return dba_load_table(
+                gobj, h, tablename, resource, user_data, kw_filtro, dba_filter, jn_record_list
+            );
+        }
+        h = h->shards->handles[shard];
+    }
+    if(h->memory && !h->memory_lost) {
+        // One connection to the copy: the loads from memory are serial
+        return dba_load_table(
+            gobj, h, tablename, resource, user_data, kw_filtro, dba_filter, jn_record_list
+        );
+    }
+
+    /*
+     *  Get the readers, no more than the pool has
+     */
+    int pool_size = h->read_pool? h->read_pool->size : 0;
+    if(threads > pool_size) {
+        threads = pool_size;
+    }
+    DBA_HANDLE *readers[threads>0?threads:1];
+    int n = 0;
+    while(n < threads) {
+        DBA_HANDLE *conn = read_conn_acquire(h, FALSE);
+        if(conn == h) {
+            break;
+        }
+        readers[n++] = conn;
+    }
+
+    /*
+     *  Id range of the table
+     */
+    json_int_t min_id = 0, max_id = 0;
+    if(n > 1) {
+        char sql[256];
+        snprintf(sql, sizeof(sql), "SELECT min(id), max(id) FROM %s;", tablename);
+        sqlite3_stmt *pStmt;
+        if(sqlite3_prepare_v2(readers[0]->db, sql, -1, &pStmt, 0)==SQLITE_OK) {
+            if(sqlite3_step(pStmt)==SQLITE_ROW) {
+                min_id = sqlite3_column_int64(pStmt, 0);
+                max_id = sqlite3_column_int64(pStmt, 1);
+            }
+            sqlite3_finalize(pStmt);
+        }
+        if(max_id - min_id + 1 < n) {
+            // Few records, not worth
+            while(n > 1) {
+                read_conn_release(h, readers[--n]);
+            }
+        }
+    }
+
+    if(n <= 1) {
+        if(n == 1) {
+            read_conn_release(h, readers[0]);
+        }
+        return dba_load_table(
+            gobj, h, tablename, resource, user_data, kw_filtro, dba_filter, jn_record_list
+        );
+    }
+
+    /*
+     *  Open a cursor by range, and load them in parallel
+     */
+    LOAD_PARTITION partitions[n];
+    memset(partitions, 0, sizeof(partitions));
+    json_int_t span = (max_id - min_id + 1) / n;
+    for(int i=0; i<n; i++) {
+        json_t *jn_options = json_object();
+        json_object_set_new(jn_options, "after_id", json_integer(min_id - 1 + i*span));
+        json_object_set_new(jn_options, "until_id",
+            json_integer(i==n-1? max_id : min_id - 1 + (i+1)*span)
+        );
+        partitions[i].gobj = gobj;
+        partitions[i].cursor = cursor_open(
+            gobj,
+            h,
+            readers[i],
+            tablename,
+            json_deep_copy(kw_filtro), // each thread its own copy, refcounts are touched
+            jn_options
+        );
+        if(!partitions[i].cursor) {
+            // Error already logged
+            partitions[i].ret = -1;
+            continue;
+        }
+        if(pthread_create(&partitions[i].thread, 0, load_partition_thread, &partitions[i])!=0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "pthread_create() FAILED, loading in this thread",
+                "tablename",    "%s", tablename,
+                NULL
+            );
+            partitions[i].thread = 0;
+            load_partition_thread(&partitions[i]);
+        }
+    }
+    KW_DECREF(kw_filtro);
+
+    for(int i=0; i<n; i++) {
+        if(partitions[i].thread) {
+            pthread_join(partitions[i].thread, 0);
+        }
+    }
+
+    /*
+     *  A failed partition is a range of ids missing: all or nothing
+     */
+    int failed = 0;
+    for(int i=0; i<n; i++) {
+        if(partitions[i].ret < 0) {
+            failed++;
+        }
+    }
+    if(failed) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", "parallel load FAILED",
+            "tablename",    "%s", tablename,
+            "partitions",   "%d", n,
+            "failed",       "%d", failed,
+            NULL
+        );
+        for(int i=0; i<n; i++) {
+            JSON_DECREF(partitions[i].jn_records);
+        }
+        JSON_DECREF(jn_record_list);
+        return 0;
+    }
+
+    /*
+     *  Merge in id order
+     */
+    if(!jn_record_list) {
+        jn_record_list = json_array();
+    }
+    BOOL stop = FALSE;
+    for(int i=0; i<n; i++) {
+        size_t idx;
+        json_t *kw_record;
+        json_array_foreach(partitions[i].jn_records, idx, kw_record) {
+            if(stop) {
+                break;
+            }
+            JSON_INCREF(kw_record);     // own it, as got from the cursor
+            JSON_INCREF(kw_record);
+            int ret = dba_filter(gobj, resource, user_data, kw_record);
+            // Return 1 append, 0 ignore, -1 break the load.
+            if(ret < 0) {
+                JSON_DECREF(kw_record);
+                stop = TRUE;
+                break;
+            } else if(ret==0) {
                 JSON_DECREF(kw_record);
                 continue;
             }
-            json_array_append_new(jn_record_list, kw_record);
+            json_array_append_new(jn_record_list, kw_record);
+        }
+        JSON_DECREF(partitions[i].jn_records);
+    }
+
+    return jn_record_list;
+}
+
+/***************************************************************************
+ *  Thread of a partition of rc_sqlite3_load_table_parallel()
+ ***************************************************************************/
+PRIVATE void *load_partition_thread(void *arg)
+{
+    LOAD_PARTITION *partition = arg;
+
+    partition->jn_records = json_array();
+    json_t *kw_record;
+    while((kw_record = rc_sqlite3_cursor_next(partition->gobj, partition->cursor))) {
+        json_array_append_new(partition->jn_records, kw_record);
+    }
+    partition->ret = rc_sqlite3_cursor_close(partition->gobj, partition->cursor);
+    partition->cursor = 0;
+    return 0;
+}
+
+/***************************************************************************
+ *  Open a cursor over the records of a table.
+ *  jn_options:
+ *      "after_id": only records with id greater than it (keyset pagination)
+ *      "until_id": only records with id less or equal than it
+ *      "order_by": "field" or ["field DESC", "field2 ASC", ...]
+ *      "limit":    max records
+ *      "offset":   records to skip
+ *  Without order_by, with any of them the records are ordered by id.
+ ***************************************************************************/
+PUBLIC void *rc_sqlite3_cursor_open(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_cursor_open(gobj, h, tablename, kw_filtro, jn_options);
+    }
+    return cursor_open(
+        gobj,
+        h,
+        read_conn_acquire(h, FALSE),
+        tablename,
+        kw_filtro,
+        jn_options
+    );
+}
+
+/***************************************************************************
+ *  Open a cursor on the connection `conn`, got with read_conn_acquire().
+ *  The connection is released when the cursor is closed, or on error.
+ ***************************************************************************/
+PRIVATE DBA_CURSOR *cursor_open(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+)
+{
+    uint64_t t0 = time_in_usec();
+    TABLE_STATS *stats = table_stats(h, tablename);
+
+    /*
+     *  Filter columns, to the index advisor
+     */
+    char columns[256] = {0};
+    if(h->index_advisor) {
+        int len = 0;
+        const char *k;
+        json_t *jn_value;
+        json_object_foreach(kw_filtro, k, jn_value) {
+            if(*k == '$') {
+                continue;   // $or/$and groups
+            }
+            len += snprintf(columns + len, sizeof(columns) - len, "%s%s", len?",":"", k);
+            if(len >= sizeof(columns)) {
+                break;
+            }
+        }
+    }
+
+    json_t *jn_params = json_array();
+    GBUFFER *gbuf_sql = sqlite_select(
+        gobj,
+        tablename,
+        kw_filtro,  // owned
+        jn_options,
+        json_object_get(h->jn_json_paths, tablename),
+        jn_params
+    );
+    JSON_DECREF(jn_options);
+    if(!gbuf_sql) {
+        // Error already logged
+        read_conn_release(h, conn);
+        stats_add(h, stats, STATS_OP_LOAD, t0, -1);
+        JSON_DECREF(jn_params);
+        return 0;
+    }
+
+    STMT_CACHE *entry = stmt_acquire(gobj, conn, gbuf_cur_rd_pointer(gbuf_sql));
+    gbuf_decref(gbuf_sql);
+    if(!entry) {
+        // Error already logged
+        read_conn_release(h, conn);
+        stats_add(h, stats, STATS_OP_LOAD, t0, -1);
+        JSON_DECREF(jn_params);
+        return 0;
+    }
+    entry->jsonb = is_jsonb_table(h, tablename);
+    if(bind_params(gobj, entry->pStmt, jn_params, FALSE)<0) {
+        // Error already logged
+        stmt_release(conn, entry);
+        read_conn_release(h, conn);
+        stats_add(h, stats, STATS_OP_LOAD, t0, -1);
+        JSON_DECREF(jn_params);
+        return 0;
+    }
+    if(*columns) {
+        index_advisor(gobj, h, conn, tablename, columns, entry->sql);
+    }
+
+    DBA_CURSOR *cursor = gbmem_malloc(sizeof(DBA_CURSOR));
+    if(!cursor) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(DBA_CURSOR),
+            NULL
+        );
+        stmt_release(conn, entry);
+        read_conn_release(h, conn);
+        stats_add(h, stats, STATS_OP_LOAD, t0, -1);
+        JSON_DECREF(jn_params);
+        return 0;
+    }
+    cursor->h = h;
+    cursor->conn = conn;
+    cursor->entry = entry;
+    cursor->jn_params = jn_params;
+    cursor->stats = stats;
+    cursor->t0 = t0;
+    if(h->slow_query_us) {
+        cursor->fullscan_step = sqlite3_stmt_status(
+            entry->pStmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0
+        );
+        cursor->vm_step = sqlite3_stmt_status(entry->pStmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    }
+    return cursor;
+}
+
+/***************************************************************************
+ *  Index advisor: the first time a select with filter is seen
+ *  check its query plan, and log it if it's a full table scan.
+ ***************************************************************************/
+PRIVATE void index_advisor(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,
+    const char *tablename,
+    const char *columns,
+    const char *sql
+)
+{
+    json_t *jn_select = json_object_get(h->jn_index_advisor, sql);
+    if(jn_select) {
+        json_object_set_new(jn_select, "selects",
+            json_integer(kw_get_int(jn_select, "selects", 0, 0) + 1)
+        );
+        return;
+    }
+
+    BOOL full_scan = FALSE;
+    char *eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql);
+    sqlite3_stmt *pStmt = 0;
+    if(eqp && sqlite3_prepare_v2(conn->db, eqp, -1, &pStmt, 0)==SQLITE_OK) {
+        while(sqlite3_step(pStmt)==SQLITE_ROW) {
+            // detail: "SCAN t" or "SEARCH t USING INDEX ..."
+            const char *detail = (const char *)sqlite3_column_text(pStmt, 3);
+            if(detail && strncmp(detail, "SCAN ", 5)==0 && !strstr(detail, "INDEX")) {
+                full_scan = TRUE;
+            }
+        }
+    }
+    sqlite3_finalize(pStmt);
+    sqlite3_free(eqp);
+
+    jn_select = json_object();
+    json_object_set_new(jn_select, "tablename", json_string(tablename));
+    json_object_set_new(jn_select, "columns", json_string(columns));
+    json_object_set_new(jn_select, "full_scan", json_boolean(full_scan));
+    json_object_set_new(jn_select, "selects", json_integer(1));
+    json_object_set_new(h->jn_index_advisor, sql, jn_select);
+
+    if(full_scan) {
+        log_warning(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", "select without index, full table scan",
+            "tablename",    "%s", tablename,
+            "columns",      "%s", columns,
+            "sql",          "%s", sql,
+            NULL
+        );
+    }
+}
+
+/***************************************************************************
+ *  Return the next record (yours), or null at the end or on error.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_cursor_next(hgobj gobj, void *cursor_)
+{
+    DBA_CURSOR *cursor = cursor_;
+    if(cursor->shards) {
+        return shards_cursor_next(gobj, cursor);
+    }
+    if(cursor->eof) {
+        return 0;
+    }
+
+    int ret = sqlite3_step(cursor->entry->pStmt);
+    if(ret == SQLITE_ROW) {
+        cursor->rows++;
+        return sqlrow2json(gobj, cursor->entry);
+    }
+
+    cursor->eof = TRUE;
+    if(ret != SQLITE_DONE) {
+        cursor->error = TRUE;
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sqlite3_sql(cursor->entry->pStmt),
+            "ret",          "%d", ret,
+            "error",        "%d", sqlite3_errcode(cursor->conn->db),
+            "errormsg",     "%s", sqlite3_errmsg(cursor->conn->db),
+            NULL
+        );
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Return 0 if all the records were read without error, -1 otherwise.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_cursor_close(hgobj gobj, void *cursor_)
+{
+    DBA_CURSOR *cursor = cursor_;
+    if(cursor->shards) {
+        return shards_cursor_close(gobj, cursor);
+    }
+    int ret = cursor->error?-1:0;
+    DBA_HANDLE *h = cursor->h;
+    uint64_t elapsed = time_in_usec() - cursor->t0;
+    if(h->slow_query_us && elapsed >= h->slow_query_us && ret == 0) {
+        slow_query(
+            gobj,
+            h,
+            cursor->conn,
+            cursor->entry->pStmt,
+            elapsed,
+            cursor->rows,
+            cursor->fullscan_step,
+            cursor->vm_step
+        );
+    }
+    stmt_release(cursor->conn, cursor->entry);
+    read_conn_release(cursor->h, cursor->conn);
+    stats_add(cursor->h, cursor->stats, STATS_OP_LOAD, cursor->t0, ret<0?-1:cursor->rows);
+    JSON_DECREF(cursor->jn_params);
+    gbmem_free(cursor);
+    return ret;
+}
+
+/***************************************************************************
+ *  Load a table without keeping the records:
+ *  dba_stream takes the ownership of each record,
+ *  it returns 0 to continue, -1 to break the load.
+ *  Return the number of records streamed, -1 on error.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_load_stream(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    const char *resource,
+    void *user_data,    // To use as parameter in dba_stream() callback.
+    json_t *kw_filtro,  // owned
+    dba_record_cb dba_stream
+)
+{
+    DBA_CURSOR *cursor = rc_sqlite3_cursor_open(gobj, pDb, tablename, kw_filtro, 0);
+    if(!cursor) {
+        // Error already logged
+        return -1;
+    }
+
+    int records = 0;
+    json_t *kw_record;
+    while((kw_record = rc_sqlite3_cursor_next(gobj, cursor))) {
+        records++;
+        if(dba_stream(gobj, resource, user_data, kw_record)<0) {
+            break;
+        }
+    }
+    if(rc_sqlite3_cursor_close(gobj, cursor)<0) {
+        // Error already logged
+        return -1;
+    }
+    return records;
+}
+
+/***************************************************************************
+ *  Keyset pagination: return up to `limit` records with id > after_id,
+ *  ordered by id. Continue with the id of the last record returned.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_load_page(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_int_t after_id,
+    size_t limit
+)
+{
+    json_t *jn_options = json_object();
+    json_object_set_new(jn_options, "after_id", json_integer(after_id));
+    json_object_set_new(jn_options, "limit", json_integer(limit));
+
+    json_t *jn_record_list = json_array();
+    DBA_CURSOR *cursor = rc_sqlite3_cursor_open(gobj, pDb, tablename, kw_filtro, jn_options);
+    if(!cursor) {
+        // Error already logged
+        return jn_record_list;
+    }
+    json_t *kw_record;
+    while((kw_record = rc_sqlite3_cursor_next(gobj, cursor))) {
+        json_array_append_new(jn_record_list, kw_record);
+    }
+    rc_sqlite3_cursor_close(gobj, cursor);
+
+    return jn_record_list;
+}
+
+/***************************************************************************
+ *  Load the records in a compact record set instead of json objects:
+ *  fixed width numbers, text and json kept as bytes in an arena,
+ *  converted to json only by rc_sqlite3_recordset_record/value().
+ ***************************************************************************/
+PUBLIC void *rc_sqlite3_load_recordset(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+)
+{
+    if(((DBA_HANDLE *)pDb)->shards) {
+        pDb = shard_handle(gobj, pDb, tablename, kw_filtro, __FUNCTION__);
+        if(!pDb) {
+            // Error already logged
+            KW_DECREF(kw_filtro);
+            JSON_DECREF(jn_options);
+            return 0;
+        }
+    }
+    DBA_CURSOR *cursor = rc_sqlite3_cursor_open(gobj, pDb, tablename, kw_filtro, jn_options);
+    if(!cursor) {
+        // Error already logged
+        return 0;
+    }
+
+    /*
+     *  Columns of the set, interned from the decoder plan of the statement
+     */
+    sqlite3_stmt *pStmt = cursor->entry->pStmt;
+    ROW_DECODER *decoder = decoder_create(gobj, pStmt);
+    RECORDSET *rs = decoder? gbmem_malloc(sizeof(RECORDSET)) : 0;
+    if(rs) {
+        rs->names = gbmem_malloc(sizeof(char *) * (decoder->cols+1));
+        rs->types = gbmem_malloc(sizeof(col_type_t) * (decoder->cols+1));
+        rs->columns = gbmem_malloc(sizeof(int) * (decoder->cols+1));
+        rs->jsonb = cursor->entry->jsonb;
+    }
+    if(!rs || !rs->names || !rs->types || !rs->columns) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        decoder_free(decoder);
+        rc_sqlite3_recordset_free(rs);
+        rc_sqlite3_cursor_close(gobj, cursor);
+        return 0;
+    }
+    for(int i=0; i<decoder->cols; i++) {
+        if(decoder->types[i] == COL_HIDDEN) {
+            continue;
+        }
+        rs->names[rs->cols] = decoder->names[i];
+        decoder->names[i] = 0;
+        rs->types[rs->cols] = decoder->types[i];
+        rs->columns[rs->cols] = i;
+        rs->cols++;
+    }
+    decoder_free(decoder);
+
+    int ret;
+    while((ret = sqlite3_step(pStmt)) == SQLITE_ROW) {
+        cursor->rows++;
+        if(recordset_append(gobj, rs, pStmt)<0) {
+            // Error already logged
+            break;
+        }
+    }
+    if(ret != SQLITE_ROW && ret != SQLITE_DONE) {
+        cursor->error = TRUE;
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sqlite3_sql(pStmt),
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(cursor->conn->db),
+            NULL
+        );
+    }
+    cursor->eof = TRUE;
+    if(rc_sqlite3_cursor_close(gobj, cursor)<0 || ret != SQLITE_DONE) {
+        rc_sqlite3_recordset_free(rs);
+        return 0;
+    }
+    return rs;
+}
+
+/***************************************************************************
+ *  Pack the current row of the statement at the end of the record set
+ ***************************************************************************/
+PRIVATE int recordset_append(hgobj gobj, RECORDSET *rs, sqlite3_stmt *pStmt)
+{
+    const int cols = rs->cols;
+    size_t header = cols * sizeof(uint64_t) + ((cols + 7) & ~7);
+
+    /*
+     *  Size of the row, and the kind of each value, as sqlrow2json() decodes them
+     */
+    uint8_t kinds[cols+1];
+    const void *bytes[cols+1];
+    int lens[cols+1];
+    size_t size = header;
+    for(int c=0; c<cols; c++) {
+        int i = rs->columns[c];
+        int storage = sqlite3_column_type(pStmt, i);
+        bytes[c] = 0;
+        lens[c] = 0;
+        switch(rs->types[c]) {
+            case COL_INTEGER:
+                kinds[c] = RS_INTEGER;
+                break;
+            case COL_REAL:
+                kinds[c] = RS_REAL;
+                break;
+            case COL_TEXT:
+                kinds[c] = storage==SQLITE_NULL? RS_NULL : RS_TEXT;
+                break;
+            case COL_BLOB:
+                kinds[c] = storage==SQLITE_NULL? RS_NULL :
+                    storage==SQLITE_BLOB && rs->jsonb? RS_JSONB : RS_JSON;
+                break;
+            case COL_DYNAMIC:
+            default:
+                kinds[c] = storage==SQLITE_INTEGER? RS_INTEGER :
+                    storage==SQLITE_FLOAT? RS_REAL :
+                    storage==SQLITE_TEXT? RS_TEXT :
+                    storage==SQLITE_BLOB? (rs->jsonb? RS_JSONB : RS_JSON) : RS_NULL;
+                break;
+        }
+        if(kinds[c] == RS_TEXT || kinds[c] == RS_JSON) {
+            bytes[c] = sqlite3_column_text(pStmt, i);
+            lens[c] = sqlite3_column_bytes(pStmt, i);
+            size += lens[c] + 1;
+        } else if(kinds[c] == RS_JSONB) {
+            bytes[c] = sqlite3_column_blob(pStmt, i);
+            lens[c] = sqlite3_column_bytes(pStmt, i);
+            size += lens[c] + 1;
+        }
+    }
+    size = (size + 7) & ~7;
+
+    /*
+     *  Room in the arena and in the index
+     */
+    RS_BLOCK *block = rs->blocks;
+    if(!block || block->size - block->used < size) {
+        size_t block_size = size > RECORDSET_BLOCK_SIZE? size : RECORDSET_BLOCK_SIZE;
+        block = gbmem_malloc(sizeof(RS_BLOCK) + block_size);
+        if(!block) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbmem_malloc() FAILED",
+                "size",         "%d", (int)(sizeof(RS_BLOCK) + block_size),
+                NULL
+            );
+            return -1;
+        }
+        block->size = block_size;
+        block->next = rs->blocks;
+        rs->blocks = block;
+        rs->memory += sizeof(RS_BLOCK) + block_size;
+    }
+    if(rs->rows == rs->index_blocks * RECORDSET_INDEX_ROWS) {
+        char ***index = gbmem_realloc(rs->index, sizeof(char **) * (rs->index_blocks + 1));
+        char **rows = index? gbmem_malloc(sizeof(char *) * RECORDSET_INDEX_ROWS) : 0;
+        if(!rows) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbmem_malloc() FAILED",
+                NULL
+            );
+            if(index) {
+                rs->index = index;
+            }
+            return -1;
+        }
+        rs->index = index;
+        rs->index[rs->index_blocks++] = rows;
+        rs->memory += sizeof(char *) * RECORDSET_INDEX_ROWS;
+    }
+
+    char *row = block->data + block->used;
+    block->used += size;
+    rs->index[rs->rows / RECORDSET_INDEX_ROWS][rs->rows % RECORDSET_INDEX_ROWS] = row;
+    rs->rows++;
+
+    uint64_t *values = (uint64_t *)row;
+    memcpy(row + cols * sizeof(uint64_t), kinds, cols);
+    size_t offset = header;
+    for(int c=0; c<cols; c++) {
+        int i = rs->columns[c];
+        switch(kinds[c]) {
+            case RS_INTEGER:
+                values[c] = (uint64_t)sqlite3_column_int64(pStmt, i);
+                break;
+            case RS_REAL:
+                {
+                    double d = sqlite3_column_double(pStmt, i);
+                    memcpy(&values[c], &d, sizeof(double));
+                }
+                break;
+            case RS_TEXT:
+            case RS_JSON:
+            case RS_JSONB:
+                if(lens[c]) {
+                    memcpy(row + offset, bytes[c], lens[c]);
+                }
+                row[offset + lens[c]] = 0;
+                values[c] = (uint64_t)offset | ((uint64_t)lens[c] << 32);
+                offset += lens[c] + 1;
+                break;
+            default:
+                values[c] = 0;
+                break;
+        }
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Free the record set, all its memory
+ ***************************************************************************/
+PUBLIC void rc_sqlite3_recordset_free(void *recordset)
+{
+    RECORDSET *rs = recordset;
+    if(!rs) {
+        return;
+    }
+    RS_BLOCK *block = rs->blocks;
+    while(block) {
+        RS_BLOCK *next = block->next;
+        gbmem_free(block);
+        block = next;
+    }
+    for(size_t i=0; i<rs->index_blocks; i++) {
+        gbmem_free(rs->index[i]);
+    }
+    if(rs->index) {
+        gbmem_free(rs->index);
+    }
+    for(int c=0; c<rs->cols; c++) {
+        gbmem_free(rs->names[c]);
+    }
+    if(rs->names) {
+        gbmem_free(rs->names);
+    }
+    if(rs->types) {
+        gbmem_free(rs->types);
+    }
+    if(rs->columns) {
+        gbmem_free(rs->columns);
+    }
+    gbmem_free(rs);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC size_t rc_sqlite3_recordset_rows(void *recordset)
+{
+    RECORDSET *rs = recordset;
+    return rs? rs->rows : 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_recordset_cols(void *recordset)
+{
+    RECORDSET *rs = recordset;
+    return rs? rs->cols : 0;
+}
+
+/***************************************************************************
+ *  Bytes allocated by the record set
+ ***************************************************************************/
+PUBLIC size_t rc_sqlite3_recordset_memory(void *recordset)
+{
+    RECORDSET *rs = recordset;
+    return rs? rs->memory : 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC const char *rc_sqlite3_recordset_col_name(void *recordset, int col)
+{
+    RECORDSET *rs = recordset;
+    if(!rs || col < 0 || col >= rs->cols) {
+        return 0;
+    }
+    return rs->names[col];
+}
+
+/***************************************************************************
+ *  Return the column of the field, -1 if not found
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_recordset_col(void *recordset, const char *field)
+{
+    RECORDSET *rs = recordset;
+    for(int c=0; rs && c<rs->cols; c++) {
+        if(strcmp(rs->names[c], field)==0) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+/***************************************************************************
+ *  Row and kind of a value, null if out of range
+ ***************************************************************************/
+PRIVATE const char *recordset_cell(RECORDSET *rs, size_t row, int col, rs_kind_t *kind)
+{
+    if(!rs || row >= rs->rows || col < 0 || col >= rs->cols) {
+        return 0;
+    }
+    const char *p = rs->index[row / RECORDSET_INDEX_ROWS][row % RECORDSET_INDEX_ROWS];
+    *kind = (rs_kind_t)(uint8_t)p[rs->cols * sizeof(uint64_t) + col];
+    return p;
+}
+
+/***************************************************************************
+ *  Type of a value: SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT,
+ *  or SQLITE_BLOB for json (object/array) values.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_recordset_type(void *recordset, size_t row, int col)
+{
+    rs_kind_t kind;
+    if(!recordset_cell(recordset, row, col, &kind)) {
+        return SQLITE_NULL;
+    }
+    switch(kind) {
+        case RS_INTEGER:
+            return SQLITE_INTEGER;
+        case RS_REAL:
+            return SQLITE_FLOAT;
+        case RS_TEXT:
+            return SQLITE_TEXT;
+        case RS_JSON:
+        case RS_JSONB:
+            return SQLITE_BLOB;
+        case RS_NULL:
+        default:
+            return SQLITE_NULL;
+    }
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC json_int_t rc_sqlite3_recordset_int(void *recordset, size_t row, int col)
+{
+    rs_kind_t kind;
+    const char *p = recordset_cell(recordset, row, col, &kind);
+    if(!p) {
+        return 0;
+    }
+    uint64_t value = ((const uint64_t *)p)[col];
+    if(kind == RS_INTEGER) {
+        return (json_int_t)value;
+    } else if(kind == RS_REAL) {
+        double d;
+        memcpy(&d, &value, sizeof(double));
+        return (json_int_t)d;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PUBLIC double rc_sqlite3_recordset_real(void *recordset, size_t row, int col)
+{
+    rs_kind_t kind;
+    const char *p = recordset_cell(recordset, row, col, &kind);
+    if(!p) {
+        return 0;
+    }
+    uint64_t value = ((const uint64_t *)p)[col];
+    if(kind == RS_REAL) {
+        double d;
+        memcpy(&d, &value, sizeof(double));
+        return d;
+    } else if(kind == RS_INTEGER) {
+        return (double)(json_int_t)value;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Text of a string value, or json text. Null for other types and jsonb.
+ *  The pointer is valid until rc_sqlite3_recordset_free().
+ ***************************************************************************/
+PUBLIC const char *rc_sqlite3_recordset_text(
+    void *recordset,
+    size_t row,
+    int col,
+    size_t *len     // optional
+)
+{
+    rs_kind_t kind;
+    const char *p = recordset_cell(recordset, row, col, &kind);
+    if(!p || (kind != RS_TEXT && kind != RS_JSON)) {
+        return 0;
+    }
+    uint64_t value = ((const uint64_t *)p)[col];
+    if(len) {
+        *len = value >> 32;
+    }
+    return p + (value & 0xFFFFFFFF);
+}
+
+/***************************************************************************
+ *  Value converted to json, null if the record has not the field.
+ *  Return json is yours.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_recordset_value(void *recordset, size_t row, int col)
+{
+    RECORDSET *rs = recordset;
+    rs_kind_t kind;
+    const char *p = recordset_cell(rs, row, col, &kind);
+    if(!p) {
+        return 0;
+    }
+    uint64_t value = ((const uint64_t *)p)[col];
+    const char *bf = p + (value & 0xFFFFFFFF);
+    size_t len = value >> 32;
+
+    switch(kind) {
+        case RS_INTEGER:
+            return json_integer((json_int_t)value);
+        case RS_REAL:
+            {
+                double d;
+                memcpy(&d, &value, sizeof(double));
+                return json_real(d);
+            }
+        case RS_TEXT:
+            return json_stringn(bf, len);
+        case RS_JSONB:
+            {
+                json_t *jn_v = jsonb2json((const unsigned char *)bf, len);
+                if(jn_v) {
+                    return jn_v;
+                }
+            }
+            return nonlegalbuffer2json(bf, len, TRUE);
+        case RS_JSON:
+            return nonlegalbuffer2json(bf, len, TRUE);
+        case RS_NULL:
+        default:
+            // As sqlrow2json(): null text and json are not in the record
+            return rs->types[col] == COL_DYNAMIC? json_null() : 0;
+    }
+}
+
+/***************************************************************************
+ *  Record converted to json, the same that the loads return.
+ *  Return json is yours, null if row is out of range.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_recordset_record(void *recordset, size_t row)
+{
+    RECORDSET *rs = recordset;
+    if(!rs || row >= rs->rows) {
+        return 0;
+    }
+    json_t *kw_record = json_object();
+    for(int c=0; c<rs->cols; c++) {
+        json_t *jn_v = rc_sqlite3_recordset_value(rs, row, c);
+        if(jn_v) {
+            json_object_set_new_nocheck(kw_record, rs->names[c], jn_v);
+        }
+    }
+    return kw_record;
+}
+
+/***************************************************************************
+ *  Change feed: the rows of the table written after since_version,
+ *  the last change of each row, in version order.
+ *  Return {"version", "reload", "changes": [{"version", "op", "rowid", "record"}]}
+ *  or null on error (the table has no change feed).
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_load_changes(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_int_t since_version
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        h = shard_handle(gobj, h, tablename, 0, __FUNCTION__);
+        if(!h) {
+            // Error already logged
+            return 0;
+        }
+    }
+    uint64_t t0 = time_in_usec();
+    DBA_HANDLE *conn = read_conn_acquire(h, FALSE);
+
+    /*
+     *  Versions trimmed after since_version are lost: reload the table
+     */
+    BOOL feed = FALSE;
+    json_int_t trimmed = 0, last_version = 0;
+    sqlite3_stmt *pStmt = 0;
+    char *sql = sqlite3_mprintf(
+        "SELECT f.trimmed, (SELECT seq FROM sqlite_sequence WHERE name='__changes__') "
+        "FROM __change_feed__ f WHERE f.tablename=%Q;",
+        tablename
+    );
+    if(sql && sqlite3_prepare_v2(conn->db, sql, -1, &pStmt, 0)==SQLITE_OK) {
+        if(sqlite3_step(pStmt)==SQLITE_ROW) {
+            feed = TRUE;
+            trimmed = sqlite3_column_int64(pStmt, 0);
+            last_version = sqlite3_column_int64(pStmt, 1);
+        }
+    }
+    sqlite3_finalize(pStmt);
+    sqlite3_free(sql);
+    if(!feed) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "table without change feed",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        read_conn_release(h, conn);
+        stats_add(h, table_stats(h, tablename), STATS_OP_LOAD, t0, -1);
+        return 0;
+    }
+
+    json_t *jn_result = json_object();
+    json_t *jn_changes = json_array();
+    json_object_set_new(jn_result, "changes", jn_changes);
+    if(since_version < trimmed) {
+        json_object_set_new(jn_result, "version", json_integer(last_version));
+        json_object_set_new(jn_result, "reload", json_true());
+        read_conn_release(h, conn);
+        stats_add(h, table_stats(h, tablename), STATS_OP_LOAD, t0, 0);
+        return jn_result;
+    }
+
+    /*
+     *  Only the last change of each rowid: the row at the rowid is the one
+     *  of that change, although the rowid was reused after a delete.
+     *  The deletes are not joined, the rowid can belong to other row now.
+     */
+    sql = sqlite3_mprintf(
+        "SELECT c.version AS __version__, c.op AS __op__, c.row_id AS __row_id__, t.* "
+        "FROM __changes__ c LEFT JOIN %s t ON c.op <> 'delete' AND t.rowid = c.row_id "
+        "WHERE c.version IN (SELECT max(version) FROM __changes__ "
+            "WHERE tablename=? AND version>? GROUP BY row_id) "
+        "ORDER BY c.version;",
+        tablename
+    );
+    STMT_CACHE *entry = sql? stmt_acquire(gobj, conn, sql) : 0;
+    sqlite3_free(sql);
+    if(entry) {
+        entry->jsonb = is_jsonb_table(h, tablename);
+    }
+    json_t *jn_params = json_pack("[s,I]", tablename, since_version);
+    if(!entry || bind_params(gobj, entry->pStmt, jn_params, FALSE)<0) {
+        // Error already logged
+        if(entry) {
+            stmt_release(conn, entry);
+        }
+        JSON_DECREF(jn_params);
+        JSON_DECREF(jn_result);
+        read_conn_release(h, conn);
+        stats_add(h, table_stats(h, tablename), STATS_OP_LOAD, t0, -1);
+        return 0;
+    }
+
+    json_int_t version = since_version;
+    int ret;
+    while((ret = sqlite3_step(entry->pStmt)) == SQLITE_ROW) {
+        json_t *kw_record = sqlrow2json(gobj, entry);
+        json_t *jn_change = json_object();
+        version = kw_get_int(kw_record, "__version__", 0, 0);
+        json_object_set_new(jn_change, "version", json_integer(version));
+        json_object_set(jn_change, "op", json_object_get(kw_record, "__op__"));
+        json_object_set(jn_change, "rowid", json_object_get(kw_record, "__row_id__"));
+        json_object_del(kw_record, "__version__");
+        json_object_del(kw_record, "__op__");
+        json_object_del(kw_record, "__row_id__");
+        if(strcmp(kw_get_str(jn_change, "op", "", 0), "delete")==0) {
+            JSON_DECREF(kw_record);
+            json_object_set_new(jn_change, "record", json_null());
+        } else {
+            json_object_set_new(jn_change, "record", kw_record);
+        }
+        json_array_append_new(jn_changes, jn_change);
+    }
+    if(ret != SQLITE_DONE) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sqlite3_sql(entry->pStmt),
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(conn->db),
+            NULL
+        );
+        JSON_DECREF(jn_result);
+    } else {
+        json_object_set_new(jn_result, "version", json_integer(version));
+        json_object_set_new(jn_result, "reload", json_false());
+    }
+    stmt_release(conn, entry);
+    JSON_DECREF(jn_params);
+    read_conn_release(h, conn);
+    stats_add(
+        h, table_stats(h, tablename), STATS_OP_LOAD, t0,
+        jn_result? (json_int_t)json_array_size(jn_changes) : -1
+    );
+    return jn_result;
+}
+
+/***************************************************************************
+ *  Change feed: remove from the journal the changes of the table
+ *  with version <= `version`. Loads of changes since an older version
+ *  will be asked to reload the table.
+ *  Return the number of changes removed, -1 on error.
+ ***************************************************************************/
+PUBLIC json_int_t rc_sqlite3_changes_trim(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_int_t version
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        h = shard_handle(gobj, h, tablename, 0, __FUNCTION__);
+        if(!h) {
+            // Error already logged
+            return -1;
+        }
+    }
+    gc_begin(gobj, h);
+    if(tr_begin(gobj, h, "changes_trim")<0) {
+        // Error already logged
+        return -1;
+    }
+    json_t *jn_params = json_pack("[s,I]", tablename, version);
+    int ret = one_step(
+        gobj,
+        h,
+        "DELETE FROM __changes__ WHERE tablename=? AND version<=?;",
+        jn_params
+    );
+    sqlite3_int64 changes = sqlite3_changes64(h->db);
+    if(ret >= 0) {
+        ret = one_step(
+            gobj,
+            h,
+            "UPDATE __change_feed__ SET trimmed=max(trimmed, ?2) WHERE tablename=?1;",
+            jn_params
+        );
+    }
+    JSON_DECREF(jn_params);
+    if(ret < 0 || tr_commit(gobj, h, "changes_trim")<0) {
+        // Error already logged
+        tr_rollback(gobj, h, "changes_trim");
+        return -1;
+    }
+    gc_written(gobj, h, changes);
+    return changes;
+}
+
+/***************************************************************************
+ *  Async mode: submit an operation to the worker thread of the handle.
+ *  When done, `event` is sent to gobj from rc_sqlite3_tick(),
+ *  with kw {"op", "tablename", "user", "ret", "result"}.
+ *
+ *  kw_op:
+ *      "op":           "create_table", "drop_table", "create_record",
+ *                      "create_records", "update_record", "delete_record",
+ *                      "load_table", "flush"
+ *      "tablename":    table
+ *      "key":          create_table: primary key
+ *      "fields":       create_table: fields
+ *      "record":       create_record, update_record
+ *      "records":      create_records
+ *      "filter":       update_record, delete_record, load_table
+ *      "options":      load_table, options of rc_sqlite3_cursor_open()
+ *      "user":         any json, returned as is in the event
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_async_submit(
+    hgobj gobj,
+    void *pDb,
+    const char *event,
+    json_t *kw_op  // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_async_submit(gobj, h, event, kw_op);
+    }
+    ASYNC_WORKER *worker = h->async;
+    if(!worker) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "async mode not enabled, open with \"async\": true",
+            NULL
+        );
+        JSON_DECREF(kw_op);
+        return -1;
+    }
+
+    ASYNC_OP *op = gbmem_malloc(sizeof(ASYNC_OP));
+    if(!op) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(ASYNC_OP),
+            NULL
+        );
+        JSON_DECREF(kw_op);
+        return -1;
+    }
+    op->gobj = gobj;
+    op->event = event? gbmem_strdup(event) : 0;  // internal operations: no event
+    op->kw_op = kw_op;
+
+    pthread_mutex_lock(&worker->mutex);
+    if(worker->submit_tail) {
+        worker->submit_tail->next = op;
+    } else {
+        worker->submit_head = op;
+    }
+    worker->submit_tail = op;
+    worker->queue_depth++;
+    worker->submitted++;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+
+    return 0;
+}
+
+/***************************************************************************
+ *  Execute an async operation on the worker connection, return the response.
+ *  In the worker thread: no gobj, the errors go in "errormsg" of the response,
+ *  logged by async_dispatch().
+ ***************************************************************************/
+PRIVATE json_t *async_execute(DBA_HANDLE *h, json_t *kw_op)
+{
+    const char *op = kw_get_str(kw_op, "op", "", KW_REQUIRED);
+    const char *tablename = kw_get_str(kw_op, "tablename", "", 0);
+    json_t *kw_filtro = kw_get_dict(kw_op, "filter", 0, 0);
+    json_t *kw_record = kw_get_dict(kw_op, "record", 0, 0);
+    json_t *jn_result = 0;
+    const char *errmsg = 0;
+    int ret = 0;
+
+    if(strcmp(op, "create_table")==0) {
+        json_t *kw_fields = kw_get_dict(kw_op, "fields", 0, KW_REQUIRED);
+        ret = dba_create_table(
+            0,
+            h,
+            tablename,
+            kw_get_str(kw_op, "key", 0, 0),
+            json_incref(kw_fields)
+        );
+        if(ret >= 0) {
+            // Committed before async_dispatch() reads the schema in the main connection
+            ret = gc_flush(0, h);
+        }
+
+    } else if(strcmp(op, "drop_table")==0) {
+        ret = dba_drop_table(0, h, tablename);
+        if(ret >= 0) {
+            ret = gc_flush(0, h);
+        }
+
+    } else if(strcmp(op, "create_record")==0) {
+        json_int_t id = (json_int_t)dba_create_record(
+            0,
+            h,
+            tablename,
+            kw_record?json_copy(kw_record):json_object()
+        );
+        if(id < 0) {
+            ret = -1;
+        } else {
+            jn_result = json_integer(id);
+        }
+
+    } else if(strcmp(op, "create_records")==0) {
+        json_t *jn_records = kw_get_list(kw_op, "records", 0, KW_REQUIRED);
+        jn_result = rc_sqlite3_create_records(0, h, tablename, json_incref(jn_records));
+        if(!jn_result) {
+            ret = -1;
+        }
+
+    } else if(strcmp(op, "upsert_record")==0) {
+        json_int_t id = rc_sqlite3_upsert_record(
+            0,
+            h,
+            tablename,
+            kw_record?json_copy(kw_record):json_object(),
+            kw_get_str(kw_op, "key", 0, 0)
+        );
+        if(id < 0) {
+            ret = -1;
+        } else {
+            jn_result = json_integer(id);
+        }
+
+    } else if(strcmp(op, "upsert_records")==0) {
+        json_t *jn_records = kw_get_list(kw_op, "records", 0, KW_REQUIRED);
+        jn_result = rc_sqlite3_upsert_records(
+            0,
+            h,
+            tablename,
+            json_incref(jn_records),
+            kw_get_str(kw_op, "key", 0, 0)
+        );
+        if(!jn_result) {
+            ret = -1;
+        }
+
+    } else if(strcmp(op, "update_record")==0) {
+        ret = dba_update_record(
+            0,
+            h,
+            tablename,
+            json_incref(kw_filtro),
+            kw_record?json_copy(kw_record):json_object()
+        );
+        if(ret >= 0) {
+            jn_result = json_integer(ret);  // changed records
+        }
+
+    } else if(strcmp(op, "delete_record")==0) {
+        ret = dba_delete_record(0, h, tablename, json_incref(kw_filtro));
+        if(ret >= 0) {
+            jn_result = json_integer(ret);  // deleted records
+        }
+
+    } else if(strcmp(op, "load_table")==0) {
+        json_t *jn_options = kw_get_dict(kw_op, "options", 0, 0);
+        DBA_CURSOR *cursor = rc_sqlite3_cursor_open(
+            0,
+            h,
+            tablename,
+            json_incref(kw_filtro),
+            json_incref(jn_options)
+        );
+        if(!cursor) {
+            ret = -1;
+        } else {
+            jn_result = json_array();
+            json_t *kw;
+            while((kw = rc_sqlite3_cursor_next(0, cursor))) {
+                json_array_append_new(jn_result, kw);
+            }
+            ret = rc_sqlite3_cursor_close(0, cursor);
+        }
+
+    } else if(strcmp(op, "flush")==0) {
+        ret = gc_flush(0, h);
+
+    } else if(strcmp(op, "__table_meta__")==0) {
+        // Table metadata of the main connection, see async_table_meta()
+        json_t *jn_key = json_object_get(kw_op, "key");
+        if(jn_key) {
+            json_object_set(h->jn_table_keys, tablename, jn_key);
+        } else {
+            json_object_del(h->jn_table_keys, tablename);
+        }
+        json_t *jn_json_storage = json_object_get(kw_op, "json_storage");
+        if(jn_json_storage) {
+            json_object_set(h->jn_json_storage, tablename, jn_json_storage);
+        } else {
+            json_object_del(h->jn_json_storage, tablename);
+        }
+        json_t *jn_paths = json_object_get(kw_op, "paths");
+        if(jn_paths) {
+            json_object_set(h->jn_json_paths, tablename, jn_paths);
+        } else {
+            json_object_del(h->jn_json_paths, tablename);
+        }
+
+    } else {
+        errmsg = "async op UNKNOWN";
+        ret = -1;
+    }
+    if(ret < 0 && !errmsg) {
+        errmsg = sqlite3_errcode(h->db)!=SQLITE_OK? sqlite3_errmsg(h->db) : "async op FAILED";
+    }
+
+    json_t *kw_result = json_object();
+    json_object_set_new(kw_result, "op", json_string(op));
+    json_object_set_new(kw_result, "tablename", json_string(tablename));
+    json_t *jn_user = json_object_get(kw_op, "user");
+    if(jn_user) {
+        json_object_set(kw_result, "user", jn_user);
+    }
+    json_object_set_new(kw_result, "ret", json_integer(ret<0?-1:0));
+    json_object_set_new(kw_result, "result", jn_result?jn_result:json_null());
+    if(errmsg) {
+        json_object_set_new(kw_result, "errormsg", json_string(errmsg));
+    }
+    return kw_result;
+}
+
+/***************************************************************************
+ *  Worker thread: execute the submitted operations in order,
+ *  and handle the group commit latency of its connection.
+ ***************************************************************************/
+PRIVATE void *async_thread(void *arg)
+{
+    ASYNC_WORKER *worker = arg;
+
+    pthread_mutex_lock(&worker->mutex);
+    while(TRUE) {
+        if(!worker->submit_head) {
+            if(worker->stop) {
+                break;
+            }
+            if(worker->h->gc_tx_open) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += worker->h->gc_max_latency * 1000000;
+                ts.tv_sec += ts.tv_nsec / 1000000000;
+                ts.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&worker->cond, &worker->mutex, &ts);
+            } else {
+                pthread_cond_wait(&worker->cond, &worker->mutex);
+            }
+            if(!worker->submit_head) {
+                pthread_mutex_unlock(&worker->mutex);
+                rc_sqlite3_tick(0, worker->h);
+                pthread_mutex_lock(&worker->mutex);
+                continue;
+            }
+        }
+
+        ASYNC_OP *op = worker->submit_head;
+        worker->submit_head = op->next;
+        if(!worker->submit_head) {
+            worker->submit_tail = 0;
+        }
+        op->next = 0;
+        pthread_mutex_unlock(&worker->mutex);
+
+        op->kw_result = async_execute(worker->h, op->kw_op);
+
+        pthread_mutex_lock(&worker->mutex);
+        if(worker->done_tail) {
+            worker->done_tail->next = op;
+        } else {
+            worker->done_head = op;
+        }
+        worker->done_tail = op;
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    gc_flush(0, worker->h);
+    return 0;
+}
+
+/***************************************************************************
+ *  Send the completion events of the done operations.
+ *  Called from the thread of the event loop (rc_sqlite3_tick()).
+ *  The tables created or dropped by the worker update the main connection.
+ ***************************************************************************/
+PRIVATE int async_dispatch(DBA_HANDLE *h)
+{
+    ASYNC_WORKER *worker = h->async;
+    pthread_mutex_lock(&worker->mutex);
+    ASYNC_OP *op = worker->done_head;
+    worker->done_head = worker->done_tail = 0;
+    pthread_mutex_unlock(&worker->mutex);
+
+    int dispatched = 0;
+    while(op) {
+        ASYNC_OP *next = op->next;
+        const char *errmsg = kw_get_str(op->kw_result, "errormsg", 0, 0);
+        if(errmsg) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(op->gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_DATABASE,
+                "msg",          "%s", "async op FAILED",
+                "op",           "%s", kw_get_str(op->kw_result, "op", "", 0),
+                "tablename",    "%s", kw_get_str(op->kw_result, "tablename", "", 0),
+                "errormsg",     "%s", errmsg,
+                NULL
+            );
+        } else {
+            const char *opname = kw_get_str(op->kw_op, "op", "", 0);
+            const char *tablename = kw_get_str(op->kw_op, "tablename", "", 0);
+            if(strcmp(opname, "create_table")==0) {
+                table_meta_set(
+                    op->gobj,
+                    h,
+                    tablename,
+                    kw_get_str(op->kw_op, "key", 0, 0),
+                    kw_get_dict(op->kw_op, "fields", 0, 0)
+                );
+            } else if(strcmp(opname, "drop_table")==0) {
+                table_meta_del(h, tablename);
+            }
+        }
+        JSON_DECREF(op->kw_op);
+        if(op->event) {
+            gobj_send_event(op->gobj, op->event, op->kw_result, op->gobj);
+            gbmem_free(op->event);
+        } else {
+            JSON_DECREF(op->kw_result);
+        }
+        gbmem_free(op);
+        dispatched++;
+        op = next;
+    }
+
+    if(dispatched) {
+        pthread_mutex_lock(&worker->mutex);
+        worker->queue_depth -= dispatched;
+        worker->completed += dispatched;
+        pthread_mutex_unlock(&worker->mutex);
+    }
+    return dispatched;
+}
+
+/***************************************************************************
+ *  Copy to the worker connection the metadata of a table of the main one
+ *  (key of the upserts, json storage, json paths),
+ *  queued to be in order with the operations.
+ ***************************************************************************/
+PRIVATE void async_table_meta(hgobj gobj, DBA_HANDLE *h, const char *tablename)
+{
+    json_t *kw_op = json_pack("{s:s, s:s}",
+        "op", "__table_meta__",
+        "tablename", tablename
+    );
+    json_t *jn_key = json_object_get(h->jn_table_keys, tablename);
+    if(jn_key) {
+        json_object_set_new(kw_op, "key", json_deep_copy(jn_key));
+    }
+    json_t *jn_json_storage = json_object_get(h->jn_json_storage, tablename);
+    if(jn_json_storage) {
+        json_object_set_new(kw_op, "json_storage", json_deep_copy(jn_json_storage));
+    }
+    json_t *jn_paths = json_object_get(h->jn_json_paths, tablename);
+    if(jn_paths) {
+        json_object_set_new(kw_op, "paths", json_deep_copy(jn_paths));
+    }
+    rc_sqlite3_async_submit(gobj, h, 0, kw_op);
+}
+
+/***************************************************************************
+ *  Start an online backup of the database to `path`, without blocking:
+ *  the pages are copied by rc_sqlite3_tick(), "pages_per_tick" each time,
+ *  or with "vacuum" a compacted snapshot is written by VACUUM INTO
+ *  in a thread with its own connection.
+ *  The copy goes to path.partial, renamed to path when complete.
+ *  One backup at a time by handle. Return 0 if started, -1 on error.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_backup_start(
+    hgobj gobj,
+    void *pDb,
+    const char *path,
+    json_t *jn_options  // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "sharded handle: backup each shard, see rc_sqlite3_shard()",
+            "path",         "%s", path,
+            NULL
+        );
+        JSON_DECREF(jn_options);
+        return -1;
+    }
+    if(h->backup && backup_running(h->backup)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", "backup already running",
+            "path",         "%s", h->backup->path,
+            NULL
+        );
+        JSON_DECREF(jn_options);
+        return -1;
+    }
+    if(h->backup) {
+        backup_free(h->backup);
+        h->backup = 0;
+    }
+
+    BACKUP *backup = gbmem_malloc(sizeof(BACKUP));
+    if(!backup) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(BACKUP),
+            NULL
+        );
+        JSON_DECREF(jn_options);
+        return -1;
+    }
+    pthread_mutex_init(&backup->mutex, 0);
+    backup->gobj = gobj;
+    backup->path = gbmem_strdup(path);
+    backup->partial = gbmem_malloc(strlen(path) + sizeof(".partial"));
+    if(backup->partial) {
+        sprintf(backup->partial, "%s.partial", path);
+    }
+    const char *event = kw_get_str(jn_options, "event", 0, 0);
+    if(event) {
+        backup->event = gbmem_strdup(event);
+    }
+    backup->vacuum = kw_get_bool(jn_options, "vacuum", 0, 0);
+    backup->pages_per_tick = kw_get_int(
+        jn_options, "pages_per_tick", DEFAULT_BACKUP_PAGES, 0
+    );
+    if(backup->pages_per_tick <= 0) {
+        backup->pages_per_tick = DEFAULT_BACKUP_PAGES;
+    }
+    backup->start = time_in_miliseconds();
+    backup->state = BACKUP_RUNNING;
+    JSON_DECREF(jn_options);
+    h->backup = backup;
+
+    if(!backup->path || !backup->partial) {
+        backup_free(backup);
+        h->backup = 0;
+        return -1;
+    }
+    unlink(backup->partial);
+
+    const char *database = sqlite3_db_filename(h->db, "main");
+    if(backup->vacuum && database && *database) {
+        /*
+         *  The thread has its own connection, the snapshot is a read transaction
+         */
+        backup->database = gbmem_strdup(database);
+        if(pthread_create(&backup->thread, 0, backup_vacuum_thread, backup)!=0) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+                "msg",          "%s", "pthread_create() FAILED",
+                NULL
+            );
+            backup_free(backup);
+            h->backup = 0;
+            return -1;
+        }
+        backup->thread_running = TRUE;
+        return 0;
+    }
+
+    if(backup->vacuum) {
+        /*
+         *  In-memory database: no other connection can see it, VACUUM INTO here
+         */
+        char *sql = sqlite3_mprintf("VACUUM INTO %Q;", backup->partial);
+        int ret = one_step(gobj, h, sql, 0);
+        sqlite3_free(sql);
+        if(ret < 0) {
+            // Error already logged
+            backup->errmsg = gbmem_strdup(sqlite3_errmsg(h->db));
+        }
+        return backup_end(gobj, h, ret<0? BACKUP_FAILED : BACKUP_DONE);
+    }
+
+    int ret = sqlite3_open_v2(
+        backup->partial,
+        &backup->dest,
+        SQLITE_OPEN_CREATE|SQLITE_OPEN_READWRITE,
+        0
+    );
+    if(ret == SQLITE_OK) {
+        backup->backup = sqlite3_backup_init(backup->dest, "main", h->db, "main");
+    }
+    if(!backup->backup) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_backup_init() FAILED",
+            "path",         "%s", backup->partial,
+            "errormsg",     "%s", sqlite3_errmsg(backup->dest),
+            NULL
+        );
+        backup->errmsg = gbmem_strdup(sqlite3_errmsg(backup->dest));
+        backup_end(gobj, h, BACKUP_FAILED);
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Copy the next pages of the backup, called from rc_sqlite3_tick().
+ ***************************************************************************/
+PRIVATE int backup_tick(hgobj gobj, DBA_HANDLE *h)
+{
+    BACKUP *backup = h->backup;
+
+    if(backup->vacuum) {
+        pthread_mutex_lock(&backup->mutex);
+        backup_state_t state = backup->state;
+        pthread_mutex_unlock(&backup->mutex);
+        if(state == BACKUP_RUNNING) {
+            return 0;
+        }
+        pthread_join(backup->thread, 0);
+        backup->thread_running = FALSE;
+        return backup_end(gobj, h, state);
+    }
+
+    /*
+     *  The pending writes of the group commit are committed first,
+     *  the backup copies committed pages.
+     */
+    if(h->gc_tx_open) {
+        gc_flush(gobj, h);
+    }
+    int ret = sqlite3_backup_step(backup->backup, backup->pages_per_tick);
+    backup->pages_total = sqlite3_backup_pagecount(backup->backup);
+    backup->pages_remaining = sqlite3_backup_remaining(backup->backup);
+
+    switch(ret) {
+        case SQLITE_OK:
+        case SQLITE_BUSY:
+        case SQLITE_LOCKED:
+            return 0;   // continue in the next tick
+        case SQLITE_DONE:
+            return backup_end(gobj, h, BACKUP_DONE);
+        default:
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SERVICE_ERROR,
+                "msg",          "%s", "sqlite3_backup_step() FAILED",
+                "path",         "%s", backup->partial,
+                "ret",          "%d", ret,
+                "errormsg",     "%s", sqlite3_errstr(ret),
+                NULL
+            );
+            backup->errmsg = gbmem_strdup(sqlite3_errstr(ret));
+            return backup_end(gobj, h, BACKUP_FAILED);
+    }
+}
+
+/***************************************************************************
+ *  Thread of VACUUM INTO, with its own read-only connection.
+ ***************************************************************************/
+PRIVATE void *backup_vacuum_thread(void *arg)
+{
+    BACKUP *backup = arg;
+    sqlite3 *db = 0;
+    backup_state_t state = BACKUP_FAILED;
+    char *errmsg = 0;
+
+    // The database of the handle, from the BACKUP to don't touch the handle
+    int ret = sqlite3_open_v2(backup->database, &db, SQLITE_OPEN_READONLY, 0);
+    if(ret == SQLITE_OK) {
+        char *sql = sqlite3_mprintf("VACUUM INTO %Q;", backup->partial);
+        ret = sqlite3_exec(db, sql, 0, 0, 0);
+        sqlite3_free(sql);
+    }
+    if(ret == SQLITE_OK) {
+        state = BACKUP_DONE;
+    } else {
+        errmsg = gbmem_strdup(db? sqlite3_errmsg(db) : sqlite3_errstr(ret));
+    }
+    sqlite3_close(db);
+
+    pthread_mutex_lock(&backup->mutex);
+    backup->errmsg = errmsg;
+    backup->state = state;
+    pthread_mutex_unlock(&backup->mutex);
+    return 0;
+}
+
+/***************************************************************************
+ *  The state of a VACUUM INTO is changed by the thread (under the mutex),
+ *  it's running until the thread is joined.
+ ***************************************************************************/
+PRIVATE BOOL backup_running(BACKUP *backup)
+{
+    pthread_mutex_lock(&backup->mutex);
+    BOOL running = backup->thread_running || backup->state == BACKUP_RUNNING;
+    pthread_mutex_unlock(&backup->mutex);
+    return running;
+}
+
+/***************************************************************************
+ *  End the backup: rename the copy, log, and send the event.
+ ***************************************************************************/
+PRIVATE int backup_end(hgobj gobj, DBA_HANDLE *h, backup_state_t state)
+{
+    BACKUP *backup = h->backup;
+    if(backup->backup) {
+        sqlite3_backup_finish(backup->backup);
+        backup->backup = 0;
+    }
+    if(backup->dest) {
+        sqlite3_close(backup->dest);
+        backup->dest = 0;
+    }
+    if(state == BACKUP_DONE && rename(backup->partial, backup->path)<0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "rename() FAILED",
+            "path",         "%s", backup->path,
+            "errno",        "%s", strerror(errno),
+            NULL
+        );
+        backup->errmsg = gbmem_strdup(strerror(errno));
+        state = BACKUP_FAILED;
+    }
+    if(state != BACKUP_DONE) {
+        unlink(backup->partial);
+    }
+    backup->state = state;
+    backup->elapsed = time_in_miliseconds() - backup->start;
+
+    if(state == BACKUP_DONE) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", backup->vacuum? "vacuum into done" : "backup done",
+            "path",         "%s", backup->path,
+            "pages",        "%d", backup->pages_total,
+            "elapsed_ms",   "%llu", (unsigned long long)backup->elapsed,
+            NULL
+        );
+    } else {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", backup->vacuum? "vacuum into FAILED" : "backup FAILED",
+            "path",         "%s", backup->path,
+            "errormsg",     "%s", backup->errmsg?backup->errmsg:"",
+            NULL
+        );
+    }
+
+    if(backup->event && backup->gobj) {
+        gobj_send_event(backup->gobj, backup->event, rc_sqlite3_backup_status(gobj, h), backup->gobj);
+    }
+    return state == BACKUP_DONE? 0 : -1;
+}
+
+/***************************************************************************
+ *  Abort the running backup, the partial copy is removed.
+ *  A VACUUM INTO can't be interrupted, it's waited.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_backup_cancel(hgobj gobj, void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    BACKUP *backup = h->backup;
+    if(!backup || !backup_running(backup)) {
+        return 0;
+    }
+    if(backup->thread_running) {
+        pthread_join(backup->thread, 0);
+        backup->thread_running = FALSE;
+    }
+    if(!backup->errmsg) {
+        backup->errmsg = gbmem_strdup("cancelled");
+    }
+    backup_end(gobj, h, BACKUP_FAILED);
+    return 0;
+}
+
+/***************************************************************************
+ *  Return {"state": "none"|"running"|"done"|"failed", "path", "vacuum",
+ *  "pages_total", "pages_remaining", "percent", "elapsed_ms", "errormsg"}
+ *  Return json is yours.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_backup_status(hgobj gobj, void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    BACKUP *backup = h->backup;
+    json_t *jn_status = json_object();
+    if(!backup) {
+        json_object_set_new(jn_status, "state", json_string("none"));
+        return jn_status;
+    }
+
+    pthread_mutex_lock(&backup->mutex);
+    backup_state_t state = backup->state;
+    pthread_mutex_unlock(&backup->mutex);
+    if(backup->thread_running && state != BACKUP_RUNNING) {
+        state = BACKUP_RUNNING; // until joined by backup_tick()
+    }
+
+    const char *states[] = {"running", "done", "failed"};
+    json_object_set_new(jn_status, "state", json_string(states[state]));
+    json_object_set_new(jn_status, "path", json_string(backup->path));
+    json_object_set_new(jn_status, "vacuum", json_boolean(backup->vacuum));
+    json_object_set_new(jn_status, "pages_total", json_integer(backup->pages_total));
+    json_object_set_new(jn_status, "pages_remaining", json_integer(backup->pages_remaining));
+    int percent = 0;
+    if(state == BACKUP_DONE) {
+        percent = 100;
+    } else if(backup->pages_total > 0) {
+        percent = 100 * (backup->pages_total - backup->pages_remaining) / backup->pages_total;
+    }
+    json_object_set_new(jn_status, "percent", json_integer(percent));
+    json_object_set_new(jn_status, "elapsed_ms", json_integer(
+        state == BACKUP_RUNNING? time_in_miliseconds() - backup->start : backup->elapsed
+    ));
+    if(state == BACKUP_FAILED) {
+        json_object_set_new(jn_status, "errormsg",
+            json_string(backup->errmsg?backup->errmsg:"")
+        );
+    }
+    return jn_status;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void backup_free(BACKUP *backup)
+{
+    if(backup->backup) {
+        sqlite3_backup_finish(backup->backup);
+    }
+    if(backup->dest) {
+        sqlite3_close(backup->dest);
+    }
+    pthread_mutex_destroy(&backup->mutex);
+    if(backup->path) {
+        gbmem_free(backup->path);
+    }
+    if(backup->partial) {
+        gbmem_free(backup->partial);
+    }
+    if(backup->database) {
+        gbmem_free(backup->database);
+    }
+    if(backup->event) {
+        gbmem_free(backup->event);
+    }
+    if(backup->errmsg) {
+        gbmem_free(backup->errmsg);
+    }
+    gbmem_free(backup);
+}
+
+/***************************************************************************
+ *  Disable the automatic checkpoint of the writer,
+ *  open the connection of the checkpoints and start the thread.
+ ***************************************************************************/
+PRIVATE CHECKPOINTER *checkpoint_start(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *database,
+    json_t *jn_properties // not owned
+)
+{
+    CHECKPOINTER *ck = gbmem_malloc(sizeof(CHECKPOINTER));
+    if(!ck) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(CHECKPOINTER),
+            NULL
+        );
+        return 0;
+    }
+    ck->interval = kw_get_int(
+        jn_properties, "checkpoint_interval", DEFAULT_CHECKPOINT_INTERVAL, 0
+    );
+    ck->idle = kw_get_int(
+        jn_properties, "checkpoint_idle", DEFAULT_CHECKPOINT_IDLE, 0
+    );
+    ck->wal_max = kw_get_int(
+        jn_properties, "checkpoint_wal_max", DEFAULT_CHECKPOINT_WAL_MAX, 0
+    );
+
+    int ret = sqlite3_open_v2(
+        database, &ck->db, SQLITE_OPEN_READWRITE|SQLITE_OPEN_NOMUTEX, 0
+    );
+    if(ret != SQLITE_OK) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_open_v2() FAILED",
+            "database",     "%s", database,
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errstr(ret),
+            NULL
+        );
+        sqlite3_close(ck->db);
+        gbmem_free(ck);
+        return 0;
+    }
+    sqlite3_busy_timeout(ck->db, DEFAULT_CHECKPOINT_BUSY_TIMEOUT);
+    // A read to open the wal, else the checkpoints of the connection do nothing
+    sqlite3_exec(ck->db, "SELECT count(*) FROM sqlite_master;", 0, 0, 0);
+    ck->wal = gbmem_strdup(sqlite3_filename_wal(sqlite3_db_filename(h->db, "main")));
+
+    pthread_mutex_init(&ck->mutex, 0);
+    pthread_cond_init(&ck->cond, 0);
+    if(pthread_create(&ck->thread, 0, checkpoint_thread, ck)!=0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "pthread_create() FAILED",
+            "database",     "%s", database,
+            NULL
+        );
+        sqlite3_close(ck->db);
+        pthread_cond_destroy(&ck->cond);
+        pthread_mutex_destroy(&ck->mutex);
+        gbmem_free(ck->wal);
+        gbmem_free(ck);
+        return 0;
+    }
+
+    sqlite3_wal_autocheckpoint(h->db, 0);
+    json_object_set_new(h->jn_pragmas, "wal_autocheckpoint", json_integer(0));
+    ck->last_changes = sqlite3_total_changes64(h->db);
+    return ck;
+}
+
+/***************************************************************************
+ *  Stop the thread and close its connection.
+ ***************************************************************************/
+PRIVATE void checkpoint_stop(CHECKPOINTER *ck)
+{
+    pthread_mutex_lock(&ck->mutex);
+    ck->stop = TRUE;
+    pthread_cond_signal(&ck->cond);
+    pthread_mutex_unlock(&ck->mutex);
+    pthread_join(ck->thread, 0);
+
+    sqlite3_close(ck->db);
+    pthread_cond_destroy(&ck->cond);
+    pthread_mutex_destroy(&ck->mutex);
+    gbmem_free(ck->wal);
+    if(ck->errmsg) {
+        gbmem_free(ck->errmsg);
+    }
+    gbmem_free(ck);
+}
+
+/***************************************************************************
+ *  A passive checkpoint, it doesn't block the writer nor the readers.
+ *  Truncate the wal if it's bigger than the max, without busy timeout:
+ *  waiting the readers it would hold the write lock and stall the writer.
+ *  Busy (readers or writer in the way), it's retried in the next tick.
+ ***************************************************************************/
+PRIVATE void checkpoint_run(CHECKPOINTER *ck, BOOL idle)
+{
+    uint64_t t0 = time_in_usec();
+    int wal_frames = 0;
+    int checkpointed_frames = 0;
+    BOOL truncated = FALSE;
+    struct stat st;
+
+    int ret = sqlite3_wal_checkpoint_v2(
+        ck->db, "main", SQLITE_CHECKPOINT_PASSIVE, &wal_frames, &checkpointed_frames
+    );
+    uint64_t wal_bytes = stat(ck->wal, &st)==0? (uint64_t)st.st_size : 0;
+    BOOL truncate = ret == SQLITE_OK && ck->wal_max && wal_bytes > ck->wal_max;
+    if(truncate) {
+        sqlite3_busy_timeout(ck->db, 0);
+        ret = sqlite3_wal_checkpoint_v2(
+            ck->db, "main", SQLITE_CHECKPOINT_TRUNCATE, &wal_frames, &checkpointed_frames
+        );
+        sqlite3_busy_timeout(ck->db, DEFAULT_CHECKPOINT_BUSY_TIMEOUT);
+        truncated = ret == SQLITE_OK;
+        wal_bytes = stat(ck->wal, &st)==0? (uint64_t)st.st_size : 0;
+    }
+    uint64_t us = time_in_usec() - t0;
+
+    pthread_mutex_lock(&ck->mutex);
+    ck->runs++;
+    if(idle) {
+        ck->idle_runs++;
+    }
+    if(truncated) {
+        ck->truncates++;
+    }
+    ck->truncate_retry = FALSE;
+    if(ret == SQLITE_BUSY) {
+        ck->busy++;
+        ck->truncate_retry = truncate;
+    } else if(ret != SQLITE_OK) {
+        ck->errors++;
+        if(ck->errmsg) {
+            gbmem_free(ck->errmsg);
+        }
+        ck->errmsg = gbmem_strdup(sqlite3_errmsg(ck->db));
+    }
+    ck->last_us = us;
+    if(us > ck->max_us) {
+        ck->max_us = us;
+    }
+    ck->total_us += us;
+    ck->wal_frames = wal_frames;
+    ck->checkpointed_frames = checkpointed_frames;
+    ck->wal_bytes = wal_bytes;
+    pthread_mutex_unlock(&ck->mutex);
+}
+
+/***************************************************************************
+ *  Checkpoint thread: a checkpoint each interval,
+ *  or when rc_sqlite3_tick() sees the writer idle.
+ ***************************************************************************/
+PRIVATE void *checkpoint_thread(void *arg)
+{
+    CHECKPOINTER *ck = arg;
+
+    pthread_mutex_lock(&ck->mutex);
+    while(!ck->stop) {
+        if(!ck->idle_request) {
+            if(ck->interval) {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += ck->interval / 1000;
+                ts.tv_nsec += (ck->interval % 1000) * 1000000;
+                ts.tv_sec += ts.tv_nsec / 1000000000;
+                ts.tv_nsec %= 1000000000;
+                pthread_cond_timedwait(&ck->cond, &ck->mutex, &ts);
+            } else {
+                pthread_cond_wait(&ck->cond, &ck->mutex);
+            }
+            if(ck->stop) {
+                break;
+            }
+            if(!ck->interval && !ck->idle_request) {
+                continue;
+            }
+        }
+        BOOL idle = ck->idle_request;
+        ck->idle_request = FALSE;
+        pthread_mutex_unlock(&ck->mutex);
+
+        checkpoint_run(ck, idle);
+
+        pthread_mutex_lock(&ck->mutex);
+    }
+    pthread_mutex_unlock(&ck->mutex);
+    return 0;
+}
+
+/***************************************************************************
+ *  From rc_sqlite3_tick(), in the thread of the writer:
+ *  request a checkpoint when there are no writes in `idle` miliseconds
+ *  or to retry a busy truncate, and log the errors of the thread.
+ ***************************************************************************/
+PRIVATE void checkpoint_tick(hgobj gobj, DBA_HANDLE *h)
+{
+    CHECKPOINTER *ck = h->checkpointer;
+    uint64_t now = time_in_miliseconds();
+    sqlite3_int64 changes = sqlite3_total_changes64(h->db);
+    if(changes != ck->last_changes) {
+        ck->last_changes = changes;
+        ck->last_write = now;
+        ck->dirty = TRUE;
+    } else if(ck->dirty && !h->gc_tx_open && now - ck->last_write >= ck->idle) {
+        ck->dirty = FALSE;
+        pthread_mutex_lock(&ck->mutex);
+        ck->idle_request = TRUE;
+        pthread_cond_signal(&ck->cond);
+        pthread_mutex_unlock(&ck->mutex);
+    }
+
+    pthread_mutex_lock(&ck->mutex);
+    if(ck->truncate_retry) {
+        ck->truncate_retry = FALSE;
+        ck->idle_request = TRUE;
+        pthread_cond_signal(&ck->cond);
+    }
+    if(ck->errors != ck->errors_logged) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", "wal checkpoint FAILED",
+            "database",     "%s", sqlite3_db_filename(h->db, "main"),
+            "errors",       "%llu", (unsigned long long)(ck->errors - ck->errors_logged),
+            "errormsg",     "%s", ck->errmsg?ck->errmsg:"",
+            NULL
+        );
+        ck->errors_logged = ck->errors;
+    }
+    pthread_mutex_unlock(&ck->mutex);
+}
+
+/***************************************************************************
+ *  Metrics of the checkpoints, return json is yours
+ ***************************************************************************/
+PRIVATE json_t *checkpoint_stats(CHECKPOINTER *ck)
+{
+    json_t *jn_checkpoint = json_object();
+    pthread_mutex_lock(&ck->mutex);
+    json_object_set_new(jn_checkpoint, "runs", json_integer(ck->runs));
+    json_object_set_new(jn_checkpoint, "idle_runs", json_integer(ck->idle_runs));
+    json_object_set_new(jn_checkpoint, "truncates", json_integer(ck->truncates));
+    json_object_set_new(jn_checkpoint, "busy", json_integer(ck->busy));
+    json_object_set_new(jn_checkpoint, "errors", json_integer(ck->errors));
+    json_object_set_new(jn_checkpoint, "last_us", json_integer(ck->last_us));
+    json_object_set_new(jn_checkpoint, "max_us", json_integer(ck->max_us));
+    json_object_set_new(jn_checkpoint, "avg_us",
+        json_integer(ck->runs? ck->total_us / ck->runs : 0)
+    );
+    json_object_set_new(jn_checkpoint, "wal_frames", json_integer(ck->wal_frames));
+    json_object_set_new(jn_checkpoint, "checkpointed_frames",
+        json_integer(ck->checkpointed_frames)
+    );
+    json_object_set_new(jn_checkpoint, "wal_bytes", json_integer(ck->wal_bytes));
+    json_object_set_new(jn_checkpoint, "wal_max", json_integer(ck->wal_max));
+    pthread_mutex_unlock(&ck->mutex);
+    return jn_checkpoint;
+}
+
+/***************************************************************************
+ *  Open the connection of the worker and start the thread.
+ ***************************************************************************/
+PRIVATE ASYNC_WORKER *async_start(
+    hgobj gobj,
+    const char *database,
+    json_t *jn_properties // not owned
+)
+{
+    ASYNC_WORKER *worker = gbmem_malloc(sizeof(ASYNC_WORKER));
+    if(!worker) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(ASYNC_WORKER),
+            NULL
+        );
+        return 0;
+    }
+
+    json_t *jn_worker_properties = json_deep_copy(jn_properties);
+    json_object_del(jn_worker_properties, "async");
+    json_object_del(jn_worker_properties, "read_connections");
+    json_object_del(jn_worker_properties, "checkpoint");
+    worker->h = dba_open(gobj, database, jn_worker_properties);
+    if(!worker->h) {
+        // Error already logged
+        gbmem_free(worker);
+        return 0;
+    }
+
+    pthread_mutex_init(&worker->mutex, 0);
+    pthread_cond_init(&worker->cond, 0);
+    if(pthread_create(&worker->thread, 0, async_thread, worker)!=0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SYSTEM_ERROR,
+            "msg",          "%s", "pthread_create() FAILED",
+            "database",     "%s", database,
+            NULL
+        );
+        dba_close(gobj, worker->h);
+        pthread_cond_destroy(&worker->cond);
+        pthread_mutex_destroy(&worker->mutex);
+        gbmem_free(worker);
+        return 0;
+    }
+    return worker;
+}
+
+/***************************************************************************
+ *  Execute the pending operations, stop the thread
+ *  and send the last completion events.
+ ***************************************************************************/
+PRIVATE void async_stop(hgobj gobj, DBA_HANDLE *h)
+{
+    ASYNC_WORKER *worker = h->async;
+    pthread_mutex_lock(&worker->mutex);
+    worker->stop = TRUE;
+    pthread_cond_signal(&worker->cond);
+    pthread_mutex_unlock(&worker->mutex);
+    pthread_join(worker->thread, 0);
+
+    async_dispatch(h);
+
+    dba_close(gobj, worker->h);
+    pthread_cond_destroy(&worker->cond);
+    pthread_mutex_destroy(&worker->mutex);
+    gbmem_free(worker);
+}
+
+/***************************************************************************
+ *  Sharded mode: open a handle by file, the handle returned only routes.
+ *  The first file is `database`, the others database-shard1, -shard2, ...
+ ***************************************************************************/
+PRIVATE DBA_HANDLE *shards_open(
+    hgobj gobj,
+    const char *database,
+    json_t *jn_properties // not owned
+)
+{
+    int size = kw_get_int(jn_properties, "shards", 0, 0);
+    DBA_HANDLE *h = gbmem_malloc(sizeof(DBA_HANDLE));
+    SHARD_SET *set = h? gbmem_malloc(sizeof(SHARD_SET)) : 0;
+    if(set) {
+        set->handles = gbmem_malloc(sizeof(DBA_HANDLE *) * size);
+    }
+    if(!h || !set || !set->handles) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        if(set) {
+            gbmem_free(set);
+        }
+        if(h) {
+            gbmem_free(h);
+        }
+        return 0;
+    }
+    h->shards = set;
+    set->jn_tables = json_object();
+    set->jn_keys = json_object();
+    set->jn_next_ids = json_object();
+    set->jn_id_limits = json_object();
+
+    const char *tablename;
+    json_t *jn_shard;
+    json_object_foreach(kw_get_dict(jn_properties, "shard_tables", 0, 0), tablename, jn_shard) {
+        json_int_t shard = json_integer_value(jn_shard);
+        if(!json_is_integer(jn_shard) || shard < 0 || shard >= size) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "shard of table out of range, table partitioned",
+                "tablename",    "%s", tablename,
+                "shards",       "%d", size,
+                NULL
+            );
+            continue;
+        }
+        json_object_set_new(set->jn_tables, tablename, json_integer(shard));
+    }
+
+    /*
+     *  The shards with the same properties: each one with its own writer,
+     *  and its own worker thread if "async".
+     */
+    json_t *jn_shard_properties = json_deep_copy(jn_properties);
+    json_object_del(jn_shard_properties, "shards");
+    json_object_del(jn_shard_properties, "shard_tables");
+    BOOL memory = strcmp(database, ":memory:")==0;
+    for(int i=0; i<size; i++) {
+        char path[PATH_MAX];
+        if(i==0 || memory) {
+            snprintf(path, sizeof(path), "%s", database);
+        } else {
+            snprintf(path, sizeof(path), "%s-shard%d", database, i);
+        }
+        DBA_HANDLE *shard = dba_open(gobj, path, json_incref(jn_shard_properties));
+        if(!shard) {
+            // Error already logged
+            break;
+        }
+        set->handles[set->size++] = shard;
+    }
+    JSON_DECREF(jn_shard_properties);
+
+    if(set->size < size) {
+        shards_close(gobj, h);
+        return 0;
+    }
+    return h;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int shards_close(hgobj gobj, DBA_HANDLE *h)
+{
+    SHARD_SET *set = h->shards;
+    int ret = 0;
+    for(int i=0; i<set->size; i++) {
+        if(dba_close(gobj, set->handles[i])!=0) {
+            ret = -1;
+        }
+    }
+    JSON_DECREF(set->jn_tables);
+    JSON_DECREF(set->jn_keys);
+    JSON_DECREF(set->jn_next_ids);
+    JSON_DECREF(set->jn_id_limits);
+    gbmem_free(set->handles);
+    gbmem_free(set);
+    gbmem_free(h);
+    return ret;
+}
+
+/***************************************************************************
+ *  Number of shards of the handle, 0 if it's not sharded.
+ ***************************************************************************/
+PUBLIC int rc_sqlite3_shards(void *pDb)
+{
+    DBA_HANDLE *h = pDb;
+    return h->shards? h->shards->size : 0;
+}
+
+/***************************************************************************
+ *  Handle of a shard, for the backups or the stats of one file.
+ *  Not sharded: the shard 0 is the handle.
+ ***************************************************************************/
+PUBLIC void *rc_sqlite3_shard(void *pDb, int shard)
+{
+    DBA_HANDLE *h = pDb;
+    if(!h->shards) {
+        return shard==0? h : 0;
+    }
+    if(shard < 0 || shard >= h->shards->size) {
+        return 0;
+    }
+    return h->shards->handles[shard];
+}
+
+/***************************************************************************
+ *  Shard of a table placed in one file, -1 if it's partitioned.
+ ***************************************************************************/
+PRIVATE int shard_of_table(SHARD_SET *set, const char *tablename)
+{
+    json_t *jn_shard = json_object_get(set->jn_tables, tablename);
+    return jn_shard? (int)json_integer_value(jn_shard) : -1;
+}
+
+/***************************************************************************
+ *  Partition column of a table, the key of dba_create_table() or id.
+ ***************************************************************************/
+PRIVATE const char *shard_column(SHARD_SET *set, const char *tablename)
+{
+    return kw_get_str(set->jn_keys, tablename, "id", 0);
+}
+
+/***************************************************************************
+ *  Shard of a value of the partition column:
+ *  integers by modulo, strings by FNV-1a hash.
+ ***************************************************************************/
+PRIVATE int shard_of_value(SHARD_SET *set, json_t *jn_value)
+{
+    uint64_t hash = 0;
+    if(json_is_integer(jn_value)) {
+        hash = (uint64_t)json_integer_value(jn_value);
+    } else if(json_is_string(jn_value)) {
+        hash = 14695981039346656037ULL;
+        for(const unsigned char *p = (const unsigned char *)json_string_value(jn_value); *p; p++) {
+            hash ^= *p;
+            hash *= 1099511628211ULL;
+        }
+    } else if(json_is_real(jn_value)) {
+        double d = json_real_value(jn_value);
+        memcpy(&hash, &d, sizeof(hash));
+    }
+    return (int)(hash % set->size);
+}
+
+/***************************************************************************
+ *  Shard of the records of a filter: the table is placed in one file,
+ *  or the filter has the partition column with a value.
+ *  Return -1 if the records can be in any shard.
+ ***************************************************************************/
+PRIVATE int shard_of_filter(SHARD_SET *set, const char *tablename, json_t *kw_filtro)
+{
+    int shard = shard_of_table(set, tablename);
+    if(shard >= 0) {
+        return shard;
+    }
+    json_t *jn_value = json_object_get(kw_filtro, shard_column(set, tablename));
+    if(json_is_integer(jn_value) || json_is_string(jn_value) || json_is_real(jn_value)) {
+        return shard_of_value(set, jn_value);
+    }
+    return -1;
+}
+
+/***************************************************************************
+ *  Handle of the shard of the operations without merge of the shards.
+ ***************************************************************************/
+PRIVATE DBA_HANDLE *shard_handle(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // not owned
+    const char *function
+)
+{
+    int shard = shard_of_filter(h->shards, tablename, kw_filtro);
+    if(shard < 0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", function,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "not supported over the shards of a partitioned table",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        return 0;
+    }
+    return h->shards->handles[shard];
+}
+
+/***************************************************************************
+ *  Reserve in __shard_ids__ of the first file the next block of ids of
+ *  a partitioned table, from `from` or after the last block reserved
+ *  (by this or other process). One statement, atomic in the file.
+ *  Return the first id of the block, -1 on error.
+ ***************************************************************************/
+PRIVATE json_int_t shard_reserve_ids(
+    hgobj gobj,
+    SHARD_SET *set,
+    const char *tablename,
+    json_int_t from
+)
+{
+    DBA_HANDLE *h = set->handles[0];
+    char sql[256];
+    snprintf(sql, sizeof(sql),
+        "INSERT INTO __shard_ids__ (tablename, next_id) VALUES (?, ?) "
+        "ON CONFLICT(tablename) DO UPDATE SET next_id = max(next_id + %d, excluded.next_id) "
+        "RETURNING next_id;",
+        SHARD_ID_BLOCK
+    );
+    STMT_CACHE *entry = stmt_acquire(gobj, h, sql);
+    json_t *jn_params = json_pack("[s,I]", tablename, from + SHARD_ID_BLOCK);
+    if(!entry || bind_params(gobj, entry->pStmt, jn_params, FALSE)<0) {
+        // Error already logged
+        if(entry) {
+            stmt_release(h, entry);
+        }
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    json_int_t limit = -1;
+    int ret = sqlite3_step(entry->pStmt);
+    if(ret == SQLITE_ROW) {
+        limit = sqlite3_column_int64(entry->pStmt, 0);
+        ret = sqlite3_step(entry->pStmt);
+    }
+    if(ret != SQLITE_DONE) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sql,
+            "error",        "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(h->db),
+            NULL
+        );
+        limit = -1;
+    }
+    stmt_release(h, entry);
+    JSON_DECREF(jn_params);
+    if(limit < 0) {
+        return -1;
+    }
+    json_object_set_new(set->jn_id_limits, tablename, json_integer(limit));
+    return limit - SHARD_ID_BLOCK;
+}
+
+/***************************************************************************
+ *  Id of a record of a partitioned table, unique in all the shards.
+ *  `used` > 0: id given by the user, the next ones go after it.
+ *  The ids are handed out from blocks reserved in __shard_ids__,
+ *  they are not reused after a restart although the last records
+ *  were deleted. The first time, the next id is after the last block
+ *  reserved and after the max id of the shards.
+ ***************************************************************************/
+PRIVATE json_int_t shard_next_id(
+    hgobj gobj,
+    SHARD_SET *set,
+    const char *tablename,
+    json_int_t used
+)
+{
+    json_t *jn_next = json_object_get(set->jn_next_ids, tablename);
+    if(!jn_next) {
+        char sql[256];
+        snprintf(sql, sizeof(sql), "SELECT max(id) FROM %s;", tablename);
+        json_int_t max_id = 0;
+        for(int i=0; i<set->size; i++) {
+            DBA_HANDLE *shard = set->handles[i];
+            STMT_CACHE *entry = stmt_acquire(gobj, shard, sql);
+            if(!entry) {
+                // Error already logged
+                return -1;
+            }
+            if(sqlite3_step(entry->pStmt) == SQLITE_ROW) {
+                json_int_t id = sqlite3_column_int64(entry->pStmt, 0);
+                if(id > max_id) {
+                    max_id = id;
+                }
+            }
+            stmt_release(shard, entry);
+        }
+        json_int_t first = shard_reserve_ids(gobj, set, tablename, max_id + 1);
+        if(first < 0) {
+            // Error already logged
+            return -1;
+        }
+        jn_next = json_integer(first);
+        json_object_set_new(set->jn_next_ids, tablename, jn_next);
+    }
+
+    json_int_t next = json_integer_value(jn_next);
+    json_int_t id = used > 0? used : next;
+    if(id < next) {
+        return id;
+    }
+    next = id + 1;
+    if(id >= kw_get_int(set->jn_id_limits, tablename, 0, 0)) {
+        json_int_t first = shard_reserve_ids(gobj, set, tablename, id);
+        if(first < 0) {
+            // Error already logged
+            return -1;
+        }
+        if(used <= 0) {
+            id = first;
+            next = first + 1;
+        } else if(first > next) {
+            next = first;   // the ids after the user's one were reserved by other
+        }
+    }
+    json_integer_set(jn_next, next);
+    return id;
+}
+
+/***************************************************************************
+ *  Shard of a new or upserted record of a partitioned table, by the
+ *  partition column, and set its id. Upserts keep the id of an
+ *  existing record with the same key.
+ *  Return the shard, -1 on error.
+ ***************************************************************************/
+PRIVATE int shard_route(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record,  // not owned, the id is set
+    BOOL upsert
+)
+{
+    SHARD_SET *set = h->shards;
+    const char *column = shard_column(set, tablename);
+    json_int_t id = kw_get_int(kw_record, "id", 0, 0);
+    int shard;
+
+    if(strcmp(column, "id")==0) {
+        id = shard_next_id(gobj, set, tablename, id);
+        shard = (int)((uint64_t)id % set->size);
+    } else {
+        json_t *jn_value = json_object_get(kw_record, column);
+        shard = shard_of_value(set, jn_value);
+        if(id == 0 && upsert && jn_value) {
+            json_t *kw_filtro = json_object();
+            json_object_set(kw_filtro, column, jn_value);
+            DBA_CURSOR *cursor = rc_sqlite3_cursor_open(
+                gobj, set->handles[shard], tablename, kw_filtro, 0
+            );
+            if(cursor) {
+                json_t *kw_found = rc_sqlite3_cursor_next(gobj, cursor);
+                if(kw_found) {
+                    id = kw_get_int(kw_found, "id", 0, 0);
+                    JSON_DECREF(kw_found);
+                }
+                rc_sqlite3_cursor_close(gobj, cursor);
+            }
+        }
+        id = shard_next_id(gobj, set, tablename, id);
+    }
+    if(id < 0) {
+        // Error already logged
+        return -1;
+    }
+    json_object_set_new(kw_record, "id", json_integer(id));
+    return shard;
+}
+
+/***************************************************************************
+ *  The upserts of a partitioned table go by its partition column:
+ *  the conflict key, by default the key of the table, must be it,
+ *  a record with the same key in other shard would not conflict.
+ ***************************************************************************/
+PRIVATE BOOL shard_upsert_key(hgobj gobj, SHARD_SET *set, const char *tablename, const char *key)
+{
+    const char *column = shard_column(set, tablename);
+    if(!key) {
+        key = kw_get_str(set->handles[0]->jn_table_keys, tablename, "id", 0);
+    }
+    if(strcmp(key, column)!=0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "upsert key of a partitioned table must be its partition key",
+            "tablename",    "%s", tablename,
+            "key",          "%s", key,
+            "partition",    "%s", column,
+            NULL
+        );
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Table placed in its shard, or partitioned in all the shards
+ *  by its key (a single column) or by id.
+ ***************************************************************************/
+PRIVATE int shards_create_table(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    const char *key,
+    json_t *kw_fields   // owned
+)
+{
+    SHARD_SET *set = h->shards;
+    int shard = shard_of_table(set, tablename);
+    if(shard >= 0) {
+        return dba_create_table(gobj, set->handles[shard], tablename, key, kw_fields);
+    }
+
+    if(!json_object_get(kw_fields, "id")) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "partitioned table without id field, place it in a shard",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        KW_DECREF(kw_fields);
+        return -1;
+    }
+    json_object_set_new(set->jn_keys, tablename,
+        json_string(key && is_column_name(key)? key : "id")
+    );
+    json_object_del(set->jn_next_ids, tablename);
+    json_object_del(set->jn_id_limits, tablename);
+
+    /*
+     *  Sequence of the ids of the partitioned tables, in the first file
+     */
+    int ret = one_step(gobj, set->handles[0],
+        "CREATE TABLE IF NOT EXISTS __shard_ids__ ("
+            "tablename TEXT PRIMARY KEY, "
+            "next_id INTEGER NOT NULL);",
+        0
+    );
+    for(int i=0; i<set->size && ret>=0; i++) {
+        ret = dba_create_table(gobj, set->handles[i], tablename, key, json_incref(kw_fields));
+    }
+    KW_DECREF(kw_fields);
+    return ret;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int shards_drop_table(hgobj gobj, DBA_HANDLE *h, const char *tablename)
+{
+    SHARD_SET *set = h->shards;
+    int shard = shard_of_table(set, tablename);
+    if(shard >= 0) {
+        return dba_drop_table(gobj, set->handles[shard], tablename);
+    }
+    int ret = 0;
+    for(int i=0; i<set->size; i++) {
+        if(dba_drop_table(gobj, set->handles[i], tablename)<0) {
+            ret = -1;
+        }
+    }
+    if(sqlite3_table_column_metadata(
+            set->handles[0]->db, 0, "__shard_ids__", "tablename", 0, 0, 0, 0, 0)==SQLITE_OK) {
+        json_t *jn_params = json_pack("[s]", tablename);
+        if(one_step(gobj, set->handles[0], "DELETE FROM __shard_ids__ WHERE tablename=?;", jn_params)<0) {
+            ret = -1;
+        }
+        JSON_DECREF(jn_params);
+    }
+    json_object_del(set->jn_keys, tablename);
+    json_object_del(set->jn_next_ids, tablename);
+    json_object_del(set->jn_id_limits, tablename);
+    return ret;
+}
+
+/***************************************************************************
+ *  Return the id of the record, -1 on error.
+ ***************************************************************************/
+PRIVATE json_int_t shards_create_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record   // owned
+)
+{
+    SHARD_SET *set = h->shards;
+    int shard = shard_of_table(set, tablename);
+    if(shard >= 0) {
+        return dba_create_record(gobj, set->handles[shard], tablename, kw_record);
+    }
+    shard = shard_route(gobj, h, tablename, kw_record, FALSE);
+    if(shard < 0) {
+        // Error already logged
+        KW_DECREF(kw_record);
+        return -1;
+    }
+    json_int_t id = kw_get_int(kw_record, "id", 0, 0);
+    if((json_int_t)dba_create_record(gobj, set->handles[shard], tablename, kw_record) < 0) {
+        // Error already logged
+        return -1;
+    }
+    return id;
+}
+
+/***************************************************************************
+ *  Update (kw_record) or delete (kw_record null) in the shard of the
+ *  filter, or in all the shards. Not atomic over the shards.
+ *  Return the number of records changed, -1 on error.
+ ***************************************************************************/
+PRIVATE int shards_write(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *kw_record   // owned, null: delete
+)
+{
+    SHARD_SET *set = h->shards;
+    const char *column = shard_column(set, tablename);
+    if(shard_of_table(set, tablename) < 0 && strcmp(column, "id")!=0 &&
+            json_object_get(kw_record, column)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "partition key of a record can't be updated",
+            "tablename",    "%s", tablename,
+            "partition",    "%s", column,
+            NULL
+        );
+        KW_DECREF(kw_filtro);
+        KW_DECREF(kw_record);
+        return -1;
+    }
+
+    int first = 0, last = set->size;
+    int shard = shard_of_filter(set, tablename, kw_filtro);
+    if(shard >= 0) {
+        first = shard;
+        last = shard + 1;
+    }
+    int changes = 0;
+    for(int i=first; i<last; i++) {
+        int ret;
+        if(kw_record) {
+            // The record is modified by the update, a copy by shard
+            ret = dba_update_record(
+                gobj, set->handles[i], tablename, json_incref(kw_filtro), json_copy(kw_record)
+            );
+        } else {
+            ret = dba_delete_record(gobj, set->handles[i], tablename, json_incref(kw_filtro));
+        }
+        if(ret < 0) {
+            // Error already logged
+            changes = -1;
+            break;
+        }
+        changes += ret;
+    }
+    KW_DECREF(kw_filtro);
+    KW_DECREF(kw_record);
+    return changes;
+}
+
+/***************************************************************************
+ *  Create or upsert the records in their shards, one transaction
+ *  by shard: all or nothing in each shard, not over the shards.
+ *  Return the ids in the order of jn_records, or null on error.
+ ***************************************************************************/
+PRIVATE json_t *shards_create_records(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *jn_records, // owned
+    BOOL upsert,
+    const char *key
+)
+{
+    SHARD_SET *set = h->shards;
+    int shard = shard_of_table(set, tablename);
+    if(shard >= 0) {
+        return upsert?
+            rc_sqlite3_upsert_records(gobj, set->handles[shard], tablename, jn_records, key) :
+            rc_sqlite3_create_records(gobj, set->handles[shard], tablename, jn_records);
+    }
+    if(upsert && !shard_upsert_key(gobj, set, tablename, key)) {
+        // Error already logged
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+    if(!json_is_array(jn_records)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "jn_records must be an array",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+
+    json_t *jn_shard_records[set->size];
+    for(int i=0; i<set->size; i++) {
+        jn_shard_records[i] = json_array();
+    }
+    json_t *jn_ids = json_array();
+    size_t idx;
+    json_t *kw_record;
+    json_array_foreach(jn_records, idx, kw_record) {
+        if(!json_is_object(kw_record)) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "record must be an object",
+                "tablename",    "%s", tablename,
+                "idx",          "%d", (int)idx,
+                NULL
+            );
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        json_t *kw_copy = json_copy(kw_record);
+        shard = shard_route(gobj, h, tablename, kw_copy, upsert);
+        if(shard < 0) {
+            // Error already logged
+            JSON_DECREF(kw_copy);
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        json_array_append_new(jn_ids, json_integer(kw_get_int(kw_copy, "id", 0, 0)));
+        json_array_append_new(jn_shard_records[shard], kw_copy);
+    }
+    JSON_DECREF(jn_records);
+
+    for(int i=0; i<set->size; i++) {
+        if(!jn_ids || json_array_size(jn_shard_records[i])==0) {
+            JSON_DECREF(jn_shard_records[i]);
+            continue;
+        }
+        json_t *jn_shard_ids = upsert?
+            rc_sqlite3_upsert_records(gobj, set->handles[i], tablename, jn_shard_records[i], key) :
+            rc_sqlite3_create_records(gobj, set->handles[i], tablename, jn_shard_records[i]);
+        if(!jn_shard_ids) {
+            // Error already logged
+            JSON_DECREF(jn_ids);
+        }
+        JSON_DECREF(jn_shard_ids);
+    }
+    return jn_ids;
+}
+
+/***************************************************************************
+ *  Cursor of a sharded handle: in the shard of the table or of the filter,
+ *  else over all the shards, merged in id order. Options "after_id",
+ *  "until_id", "limit" and "offset", not "order_by".
+ ***************************************************************************/
+PRIVATE DBA_CURSOR *shards_cursor_open(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+)
+{
+    SHARD_SET *set = h->shards;
+    int shard = shard_of_filter(set, tablename, kw_filtro);
+    if(shard >= 0) {
+        return rc_sqlite3_cursor_open(gobj, set->handles[shard], tablename, kw_filtro, jn_options);
+    }
+    if(json_object_get(jn_options, "order_by")) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "order_by not supported over the shards, ordered by id",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        KW_DECREF(kw_filtro);
+        JSON_DECREF(jn_options);
+        return 0;
+    }
+
+    DBA_CURSOR *cursor = gbmem_malloc(sizeof(DBA_CURSOR));
+    if(cursor) {
+        cursor->shards = gbmem_malloc(sizeof(DBA_CURSOR *) * set->size);
+        cursor->heads = gbmem_malloc(sizeof(json_t *) * set->size);
+    }
+    if(!cursor || !cursor->shards || !cursor->heads) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        if(cursor) {
+            if(cursor->shards) {
+                gbmem_free(cursor->shards);
+            }
+            if(cursor->heads) {
+                gbmem_free(cursor->heads);
+            }
+            gbmem_free(cursor);
+        }
+        KW_DECREF(kw_filtro);
+        JSON_DECREF(jn_options);
+        return 0;
+    }
+    cursor->limit = kw_get_int(jn_options, "limit", -1, 0);
+    cursor->offset = kw_get_int(jn_options, "offset", 0, 0);
+
+    /*
+     *  The shards ordered by id (any option), each one with the records
+     *  of the offset and the limit, skipped here.
+     */
+    json_t *jn_shard_options = jn_options? json_copy(jn_options) : json_object();
+    JSON_DECREF(jn_options);
+    json_object_del(jn_shard_options, "offset");
+    json_object_set_new(jn_shard_options, "limit", json_integer(
+        cursor->limit < 0? -1 : cursor->limit + cursor->offset
+    ));
+    for(int i=0; i<set->size; i++) {
+        DBA_CURSOR *shard_cursor = rc_sqlite3_cursor_open(
+            gobj,
+            set->handles[i],
+            tablename,
+            json_incref(kw_filtro),
+            json_incref(jn_shard_options)
+        );
+        if(!shard_cursor) {
+            // Error already logged
+            cursor->error = TRUE;
+            break;
+        }
+        cursor->shards[cursor->nshards] = shard_cursor;
+        cursor->heads[cursor->nshards] = rc_sqlite3_cursor_next(gobj, shard_cursor);
+        cursor->nshards++;
+    }
+    JSON_DECREF(jn_shard_options);
+    KW_DECREF(kw_filtro);
+
+    if(cursor->error) {
+        shards_cursor_close(gobj, cursor);
+        return 0;
+    }
+    return cursor;
+}
+
+/***************************************************************************
+ *  Next record of the shards: the lowest id of the heads.
+ ***************************************************************************/
+PRIVATE json_t *shards_cursor_next(hgobj gobj, DBA_CURSOR *cursor)
+{
+    while(!cursor->eof) {
+        int lowest = -1;
+        json_int_t lowest_id = 0;
+        for(int i=0; i<cursor->nshards; i++) {
+            if(!cursor->heads[i]) {
+                continue;
+            }
+            json_int_t id = kw_get_int(cursor->heads[i], "id", 0, 0);
+            if(lowest < 0 || id < lowest_id) {
+                lowest = i;
+                lowest_id = id;
+            }
+        }
+        if(lowest < 0 || cursor->limit == 0) {
+            cursor->eof = TRUE;
+            break;
+        }
+
+        json_t *kw_record = cursor->heads[lowest];
+        cursor->heads[lowest] = rc_sqlite3_cursor_next(gobj, cursor->shards[lowest]);
+        if(cursor->offset > 0) {
+            cursor->offset--;
+            JSON_DECREF(kw_record);
+            continue;
+        }
+        if(cursor->limit > 0) {
+            cursor->limit--;
+        }
+        cursor->rows++;
+        return kw_record;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Return 0 if the loads of all the shards were right, -1 otherwise.
+ ***************************************************************************/
+PRIVATE int shards_cursor_close(hgobj gobj, DBA_CURSOR *cursor)
+{
+    int ret = cursor->error?-1:0;
+    for(int i=0; i<cursor->nshards; i++) {
+        JSON_DECREF(cursor->heads[i]);
+        if(rc_sqlite3_cursor_close(gobj, cursor->shards[i])<0) {
+            ret = -1;
+        }
+    }
+    gbmem_free(cursor->shards);
+    gbmem_free(cursor->heads);
+    gbmem_free(cursor);
+    return ret;
+}
+
+/***************************************************************************
+ *  Async operation in the worker of its shard. The operations of
+ *  a partitioned table must go to one shard: a record, or a filter
+ *  with the partition key.
+ ***************************************************************************/
+PRIVATE int shards_async_submit(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *event,
+    json_t *kw_op  // owned
+)
+{
+    SHARD_SET *set = h->shards;
+    const char *op = kw_get_str(kw_op, "op", "", 0);
+    const char *tablename = kw_get_str(kw_op, "tablename", "", 0);
+
+    int shard = shard_of_table(set, tablename);
+    if(shard < 0) {
+        json_t *kw_record = json_object_get(kw_op, "record");
+        if(strcmp(op, "create_record")==0 && json_is_object(kw_record)) {
+            shard = shard_route(gobj, h, tablename, kw_record, FALSE);
+        } else if(strcmp(op, "upsert_record")==0 && json_is_object(kw_record)) {
+            if(shard_upsert_key(gobj, set, tablename, kw_get_str(kw_op, "key", 0, 0))) {
+                shard = shard_route(gobj, h, tablename, kw_record, TRUE);
+            }
+        } else if(strcmp(op, "update_record")==0 || strcmp(op, "delete_record")==0 ||
+                strcmp(op, "load_table")==0) {
+            shard = shard_of_filter(set, tablename, json_object_get(kw_op, "filter"));
+        }
+    }
+    if(shard < 0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "async operation over the shards, use the synchronous api",
+            "op",           "%s", op,
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        JSON_DECREF(kw_op);
+        return -1;
+    }
+    return rc_sqlite3_async_submit(gobj, set->handles[shard], event, kw_op);
+}
+
+/***************************************************************************
+ *  Insert an array of records in one transaction.
+ *  Records with the same column set reuse the same compiled statement.
+ *  All or nothing: on error the transaction is rolled back.
+ *  Return the list of ids given by sqlite, in the order of jn_records,
+ *  or null on error.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_create_records(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *jn_records  // owned
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_create_records(gobj, h, tablename, jn_records, FALSE, 0);
+    }
+    if(!json_is_array(jn_records)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "jn_records must be an array",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+
+    uint64_t t0 = time_in_usec();
+    TABLE_STATS *stats = table_stats(h, tablename);
+    gc_begin(gobj, h);
+    if(tr_begin(gobj, h, "create_records")<0) {
+        // Error already logged
+        stats_add(h, stats, STATS_OP_CREATE, t0, -1);
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+
+    json_t *jn_ids = json_array();
+    size_t idx;
+    json_t *kw_record;
+    json_array_foreach(jn_records, idx, kw_record) {
+        if(!json_is_object(kw_record)) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "record must be an object",
+                "tablename",    "%s", tablename,
+                "idx",          "%d", (int)idx,
+                NULL
+            );
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        /*
+         *  insert_record() modifies the record (remove id 0), use a copy
+         */
+        json_int_t id = insert_record(gobj, h, tablename, json_copy(kw_record));
+        if(id < 0) {
+            // Error already logged
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        json_array_append_new(jn_ids, json_integer(id));
+    }
+    JSON_DECREF(jn_records);
+
+    if(!jn_ids) {
+        tr_rollback(gobj, h, "create_records");
+        stats_add(h, stats, STATS_OP_CREATE, t0, -1);
+        return 0;
+    }
+    if(tr_commit(gobj, h, "create_records")<0) {
+        // Error already logged
+        tr_rollback(gobj, h, "create_records");
+        stats_add(h, stats, STATS_OP_CREATE, t0, -1);
+        JSON_DECREF(jn_ids);
+        return 0;
+    }
+    gc_written(gobj, h, json_array_size(jn_ids));
+    stats_add(h, stats, STATS_OP_CREATE, t0, json_array_size(jn_ids));
+    return jn_ids;
+}
+
+/***************************************************************************
+ *  Insert the record, or update it if a record with its key exists,
+ *  in one statement. `key` is the conflict target, a primary or unique key
+ *  ("email", "owner, name"), by default the key of dba_create_table().
+ *  Return the id of the record inserted or updated, -1 on error.
+ ***************************************************************************/
+PUBLIC json_int_t rc_sqlite3_upsert_record(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_record,  // owned
+    const char *key
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        SHARD_SET *set = h->shards;
+        int shard = shard_of_table(set, tablename);
+        if(shard < 0) {
+            if(!shard_upsert_key(gobj, set, tablename, key)) {
+                // Error already logged
+                KW_DECREF(kw_record);
+                return -1;
+            }
+            shard = shard_route(gobj, h, tablename, kw_record, TRUE);
+            if(shard < 0) {
+                // Error already logged
+                KW_DECREF(kw_record);
+                return -1;
+            }
+        }
+        return rc_sqlite3_upsert_record(gobj, set->handles[shard], tablename, kw_record, key);
+    }
+    uint64_t t0 = time_in_usec();
+    gc_begin(gobj, h);
+    json_int_t id = upsert_record(gobj, h, tablename, kw_record, key);
+    if(id >= 0) {
+        gc_written(gobj, h, 1);
+    }
+    stats_add(h, table_stats(h, tablename), STATS_OP_UPSERT, t0, id<0?-1:1);
+    return id;
+}
+
+/***************************************************************************
+ *  Upsert an array of records in one transaction, all or nothing.
+ *  Return the list of ids, in the order of jn_records, or null on error.
+ ***************************************************************************/
+PUBLIC json_t *rc_sqlite3_upsert_records(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *jn_records, // owned
+    const char *key
+)
+{
+    DBA_HANDLE *h = pDb;
+    if(h->shards) {
+        return shards_create_records(gobj, h, tablename, jn_records, TRUE, key);
+    }
+    if(!json_is_array(jn_records)) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "jn_records must be an array",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+
+    uint64_t t0 = time_in_usec();
+    TABLE_STATS *stats = table_stats(h, tablename);
+    gc_begin(gobj, h);
+    if(tr_begin(gobj, h, "upsert_records")<0) {
+        // Error already logged
+        stats_add(h, stats, STATS_OP_UPSERT, t0, -1);
+        JSON_DECREF(jn_records);
+        return 0;
+    }
+
+    json_t *jn_ids = json_array();
+    size_t idx;
+    json_t *kw_record;
+    json_array_foreach(jn_records, idx, kw_record) {
+        if(!json_is_object(kw_record)) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "record must be an object",
+                "tablename",    "%s", tablename,
+                "idx",          "%d", (int)idx,
+                NULL
+            );
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        json_int_t id = upsert_record(gobj, h, tablename, json_copy(kw_record), key);
+        if(id < 0) {
+            // Error already logged
+            JSON_DECREF(jn_ids);
+            break;
+        }
+        json_array_append_new(jn_ids, json_integer(id));
+    }
+    JSON_DECREF(jn_records);
+
+    if(!jn_ids) {
+        tr_rollback(gobj, h, "upsert_records");
+        stats_add(h, stats, STATS_OP_UPSERT, t0, -1);
+        return 0;
+    }
+    if(tr_commit(gobj, h, "upsert_records")<0) {
+        // Error already logged
+        tr_rollback(gobj, h, "upsert_records");
+        stats_add(h, stats, STATS_OP_UPSERT, t0, -1);
+        JSON_DECREF(jn_ids);
+        return 0;
+    }
+    gc_written(gobj, h, json_array_size(jn_ids));
+    stats_add(h, stats, STATS_OP_UPSERT, t0, json_array_size(jn_ids));
+    return jn_ids;
+}
+
+/***************************************************************************
+ *  Upsert a record, return the id of the row inserted or updated, -1 on error.
+ ***************************************************************************/
+PRIVATE json_int_t upsert_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record,  // owned
+    const char *key
+)
+{
+    if(!key) {
+        key = kw_get_str(h->jn_table_keys, tablename, "id", 0);
+    }
+    if(kw_get_int(kw_record, "id", 0, 0)==0) {
+        // Let sqlite assign the id to the new records
+        json_object_del(kw_record, "id");
+    }
+
+    json_t *jn_params = json_array();
+    GBUFFER *gbuf_sql = sqlite_upsert(
+        gobj,
+        tablename,
+        key,
+        kw_record, // owned
+        jn_params
+    );
+    if(!gbuf_sql) {
+        // Error already logged
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    const char *sql = gbuf_cur_rd_pointer(gbuf_sql);
+    STMT_CACHE *entry = stmt_acquire(gobj, h, sql);
+    if(!entry || bind_params(gobj, entry->pStmt, jn_params, is_jsonb_table(h, tablename))<0) {
+        // Error already logged
+        if(entry) {
+            stmt_release(h, entry);
+        }
+        gbuf_decref(gbuf_sql);
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    /*
+     *  RETURNING id: the row inserted or updated
+     */
+    uint64_t t0 = 0;
+    int fullscan_step = 0, vm_step = 0;
+    if(h->slow_query_us) {
+        t0 = time_in_usec();
+        fullscan_step = sqlite3_stmt_status(entry->pStmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+        vm_step = sqlite3_stmt_status(entry->pStmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    }
+
+    json_int_t id = -1;
+    int ret = sqlite3_step(entry->pStmt);
+    if(ret == SQLITE_ROW) {
+        id = sqlite3_column_int64(entry->pStmt, 0);
+        ret = sqlite3_step(entry->pStmt);
+    }
+    if(ret != SQLITE_DONE) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sql,
+            "error",        "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(h->db),
+            NULL
+        );
+        id = -1;
+    } else if(h->slow_query_us && time_in_usec() - t0 >= h->slow_query_us) {
+        slow_query(
+            gobj,
+            h,
+            h,
+            entry->pStmt,
+            time_in_usec() - t0,
+            1,
+            fullscan_step,
+            vm_step
+        );
+    }
+    stmt_release(h, entry);
+    if(id >= 0 && h->memory && !h->memory_lost) {
+        memory_mirror(gobj, h, sql, jn_params, is_jsonb_table(h, tablename));
+    }
+    gbuf_decref(gbuf_sql);
+    JSON_DECREF(jn_params);
+    return id;
+}
+
+/***************************************************************************
+ *  Insert a record, return the id given by sqlite, -1 on error.
+ ***************************************************************************/
+PRIVATE json_int_t insert_record(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *tablename,
+    json_t *kw_record // owned
+)
+{
+    json_int_t id = kw_get_int(kw_record, "id", 0, 0);
+    if(id==0) {
+        /*
+         *  Remove the id columns
+         *  to let sqlite assign the id if not set by user
+         */
+        json_object_del(kw_record, "id");
+    }
+    /*
+     *  Insert sqlite sql
+     */
+    json_t *jn_params = json_array();
+    GBUFFER *gbuf_sql = sqlite_insert_new(
+        gobj,
+        tablename,
+        kw_record, // owned
+        jn_params
+    );
+    if(!gbuf_sql) {
+        // Error already logged
+        JSON_DECREF(jn_params);
+        return -1;
+    }
+
+    /*
+     *  Ejecuta el script
+     */
+    int ret = one_step_bind(
+        gobj,
+        h,
+        gbuf_cur_rd_pointer(gbuf_sql),
+        jn_params,
+        is_jsonb_table(h, tablename)
+    );
+    gbuf_decref(gbuf_sql);
+    JSON_DECREF(jn_params);
+    if(ret < 0) {
+        // Error already logged
+        return -1;
+    }
+
+    /*
+     *  Get the id given by sqlite (given by us, or not).
+     */
+    sqlite3_int64 rowid = sqlite3_last_insert_rowid(h->db);
+    if(h->memory && !h->memory_lost && sqlite3_last_insert_rowid(h->memory->db) != rowid) {
+        memory_lost(gobj, h, "INSERT", "id of the copy differs");
+    }
+    return rowid;
+}
+
+/***************************************************************************
+ *  Transactions are savepoints, they can be nested.
+ *  The outermost savepoint works as BEGIN DEFERRED ... COMMIT.
+ ***************************************************************************/
+PRIVATE int tr_begin(hgobj gobj, DBA_HANDLE *h, const char *name)
+{
+    char sql[128];
+    snprintf(sql, sizeof(sql), "SAVEPOINT %s;", name);
+    return one_step(gobj, h, sql, 0);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int tr_commit(hgobj gobj, DBA_HANDLE *h, const char *name)
+{
+    char sql[128];
+    snprintf(sql, sizeof(sql), "RELEASE %s;", name);
+    return one_step(gobj, h, sql, 0);
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE int tr_rollback(hgobj gobj, DBA_HANDLE *h, const char *name)
+{
+    char sql[128];
+    snprintf(sql, sizeof(sql), "ROLLBACK TO %s;", name);
+    int ret = one_step(gobj, h, sql, 0);
+    snprintf(sql, sizeof(sql), "RELEASE %s;", name);
+    ret += one_step(gobj, h, sql, 0);
+    return ret<0?-1:0;
+}
+
+/***************************************************************************
+ *  Apply the pragmas found in jn_properties,
+ *  and save the effective values (what sqlite has really set).
+ *  foreign_keys is ON by default.
+ ***************************************************************************/
+PRIVATE int apply_pragmas(hgobj gobj, DBA_HANDLE *h, json_t *jn_properties)
+{
+    char sql[128];
+    int errors = 0;
+
+    if(!kw_has_key(jn_properties, "foreign_keys")) {
+        one_step(gobj, h, "PRAGMA foreign_keys = ON;", 0);
+    }
+
+    h->jn_pragmas = json_object();
+    for(int i=0; pragma_names[i]; i++) {
+        const char *name = pragma_names[i];
+        json_t *jn_value = json_object_get(jn_properties, name);
+        if(jn_value && pragma_set(gobj, h, name, jn_value)<0) {
+            // Error already logged
+            errors++;
+        }
+
+        /*
+         *  Effective value
+         */
+        snprintf(sql, sizeof(sql), "PRAGMA %s;", name);
+        json_t *jn_effective = pragma_exec(gobj, h, sql);
+        if(jn_effective) {
+            json_object_set_new(h->jn_pragmas, name, jn_effective);
+        }
+    }
+
+    char *pragmas = json_dumps(h->jn_pragmas, JSON_COMPACT);
+    log_info(0,
+        "gobj",         "%s", gobj_full_name(gobj),
+        "function",     "%s", __FUNCTION__,
+        "msgset",       "%s", MSGSET_DATABASE,
+        "msg",          "%s", "sqlite pragmas",
+        "database",     "%s", sqlite3_db_filename(h->db, "main"),
+        "pragmas",      "%s", pragmas?pragmas:"",
+        NULL
+    );
+    if(pragmas) {
+        gbmem_free(pragmas);
+    }
+
+    return errors?-1:0;
+}
+
+/***************************************************************************
+ *  Set a pragma
+ ***************************************************************************/
+PRIVATE int pragma_set(hgobj gobj, DBA_HANDLE *h, const char *name, json_t *jn_value)
+{
+    char sql[128];
+
+    if(json_is_string(jn_value)) {
+        /*
+         *  Values are keywords (WAL, NORMAL, MEMORY,...), don't let inject sql
+         */
+        const char *value = json_string_value(jn_value);
+        BOOL valid = *value?TRUE:FALSE;
+        for(const char *p=value; *p; p++) {
+            if(!((*p>='a' && *p<='z') || (*p>='A' && *p<='Z') || (*p>='0' && *p<='9') || *p=='_' || *p=='-')) {
+                valid = FALSE;
+                break;
+            }
+        }
+        if(!valid) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "pragma value not valid",
+                "pragma",       "%s", name,
+                "value",        "%s", value,
+                NULL
+            );
+            return -1;
+        }
+        snprintf(sql, sizeof(sql), "PRAGMA %s = %s;", name, value);
+
+    } else if(json_is_integer(jn_value)) {
+        snprintf(sql, sizeof(sql), "PRAGMA %s = %"JSON_INTEGER_FORMAT";",
+            name, json_integer_value(jn_value)
+        );
+    } else if(json_is_boolean(jn_value)) {
+        snprintf(sql, sizeof(sql), "PRAGMA %s = %s;",
+            name, json_is_true(jn_value)?"ON":"OFF"
+        );
+    } else {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "pragma value must be string, integer or boolean",
+            "pragma",       "%s", name,
+            NULL
+        );
+        return -1;
+    }
+
+    json_t *jn_set = pragma_exec(gobj, h, sql);
+    if(!jn_set) {
+        // Error already logged
+        return -1;
+    }
+    JSON_DECREF(jn_set);
+    return 0;
+}
+
+/***************************************************************************
+ *  Execute a pragma, return the first column of the first row,
+ *  json null if the pragma doesn't return rows, 0 on error.
+ ***************************************************************************/
+PRIVATE json_t *pragma_exec(hgobj gobj, DBA_HANDLE *h, const char *sql)
+{
+    sqlite3_stmt *pStmt;
+    int ret = sqlite3_prepare_v2(h->db, sql, -1, &pStmt, 0);
+    if(ret != SQLITE_OK) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_prepare_v2() FAILED",
+            "sql",          "%s", sql,
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(h->db),
+            NULL
+        );
+        return 0;
+    }
+
+    json_t *jn_value = 0;
+    while((ret = sqlite3_step(pStmt)) == SQLITE_ROW) {
+        if(jn_value) {
+            continue;
+        }
+        switch(sqlite3_column_type(pStmt, 0)) {
+            case SQLITE_INTEGER:
+                jn_value = json_integer(sqlite3_column_int64(pStmt, 0));
+                break;
+            case SQLITE_FLOAT:
+                jn_value = json_real(sqlite3_column_double(pStmt, 0));
+                break;
+            case SQLITE_NULL:
+                jn_value = json_null();
+                break;
+            default:
+                jn_value = json_string((const char *)sqlite3_column_text(pStmt, 0));
+                break;
+        }
+    }
+    if(ret != SQLITE_DONE) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sql,
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errmsg(h->db),
+            NULL
+        );
+        JSON_DECREF(jn_value);
+        sqlite3_finalize(pStmt);
+        return 0;
+    }
+    sqlite3_finalize(pStmt);
+
+    return jn_value?jn_value:json_null();
+}
+
+/***************************************************************************
+ *  Group commit: open the transaction of the group if it's not open.
+ ***************************************************************************/
+PRIVATE int gc_begin(hgobj gobj, DBA_HANDLE *h)
+{
+    if(!h->gc_enabled || h->gc_tx_open) {
+        return 0;
+    }
+    if(one_step(gobj, h, "BEGIN;", 0)<0) {
+        // Error already logged, the write goes in autocommit mode
+        return -1;
+    }
+    h->gc_tx_open = TRUE;
+    h->gc_tx_start = time_in_miliseconds();
+    return 0;
+}
+
+/***************************************************************************
+ *  Group commit: account the writes done, commit if the batch is full
+ *  or the first write of the group is older than the max latency.
+ ***************************************************************************/
+PRIVATE void gc_written(hgobj gobj, DBA_HANDLE *h, size_t writes)
+{
+    if(!h->gc_tx_open) {
+        return;
+    }
+    h->gc_pending += writes;
+    if(h->gc_pending > h->gc_max_pending) {
+        h->gc_max_pending = h->gc_pending;
+    }
+    if(h->gc_pending >= h->gc_batch_size ||
+            time_in_miliseconds() - h->gc_tx_start >= h->gc_max_latency) {
+        gc_flush(gobj, h);
+    }
+}
+
+/***************************************************************************
+ *  Group commit: commit the transaction of the group.
+ *  On failure the transaction keeps open, it's retried in the next flush.
+ ***************************************************************************/
+PRIVATE int gc_flush(hgobj gobj, DBA_HANDLE *h)
+{
+    if(!h->gc_tx_open) {
+        return 0;
+    }
+    uint64_t t0 = time_in_usec();
+    if(one_step(gobj, h, "COMMIT;", 0)<0) {
+        // Error already logged
+        return -1;
+    }
+    uint64_t elapsed = time_in_usec() - t0;
+
+    h->gc_tx_open = FALSE;
+    h->gc_flushes++;
+    h->gc_flushed_writes += h->gc_pending;
+    h->gc_pending = 0;
+    h->gc_last_flush_us = elapsed;
+    h->gc_total_flush_us += elapsed;
+    if(elapsed > h->gc_max_flush_us) {
+        h->gc_max_flush_us = elapsed;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Monotonic time in microseconds
+ ***************************************************************************/
+PRIVATE uint64_t time_in_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/***************************************************************************
+ *  Statistics of a table, created the first time.
+ ***************************************************************************/
+PRIVATE TABLE_STATS *table_stats(DBA_HANDLE *h, const char *tablename)
+{
+    pthread_mutex_lock(&h->stats_mutex);
+    TABLE_STATS *stats = h->table_stats;
+    while(stats) {
+        if(strcmp(stats->tablename, tablename)==0) {
+            break;
+        }
+        stats = stats->next;
+    }
+    if(!stats) {
+        stats = gbmem_malloc(sizeof(TABLE_STATS));
+        if(stats) {
+            memset(stats, 0, sizeof(TABLE_STATS));
+            stats->tablename = gbmem_strdup(tablename);
+            stats->next = h->table_stats;
+            h->table_stats = stats;
+        }
+    }
+    pthread_mutex_unlock(&h->stats_mutex);
+    return stats;
+}
+
+/***************************************************************************
+ *  Account an operation started at t0 (usec).
+ ***************************************************************************/
+PRIVATE void stats_add(
+    DBA_HANDLE *h,
+    TABLE_STATS *stats,
+    stats_op_t op,
+    uint64_t t0,
+    json_int_t rows     // -1: error
+)
+{
+    if(!stats) {
+        return;
+    }
+    uint64_t elapsed = time_in_usec() - t0;
+    int bucket = 0;
+    while(bucket < STATS_BUCKETS-1 && (elapsed >> bucket)) {
+        bucket++;
+    }
+
+    pthread_mutex_lock(&h->stats_mutex);
+    OP_STATS *op_stats = &stats->ops[op];
+    op_stats->calls++;
+    if(rows < 0) {
+        op_stats->errors++;
+    } else {
+        op_stats->rows += rows;
+    }
+    op_stats->total_us += elapsed;
+    if(elapsed > op_stats->max_us) {
+        op_stats->max_us = elapsed;
+    }
+    op_stats->histogram[bucket]++;
+    pthread_mutex_unlock(&h->stats_mutex);
+}
+
+/***************************************************************************
+ *  {tablename: {rows_read, rows_written, ops: {op: {calls, ..., histogram}}}}
+ *  The keys of the histogram are the upper bound in usec of the bucket.
+ ***************************************************************************/
+PRIVATE json_t *stats_tables(DBA_HANDLE *h)
+{
+    json_t *jn_tables = json_object();
+
+    pthread_mutex_lock(&h->stats_mutex);
+    for(TABLE_STATS *stats = h->table_stats; stats; stats = stats->next) {
+        json_t *jn_table = json_object();
+        json_t *jn_ops = json_object();
+        uint64_t rows_written = 0;
+        for(int op=0; op<STATS_OPS; op++) {
+            OP_STATS *op_stats = &stats->ops[op];
+            if(op != STATS_OP_LOAD) {
+                rows_written += op_stats->rows;
+            }
+            if(!op_stats->calls) {
+                continue;
+            }
+            json_t *jn_op = json_object();
+            json_object_set_new(jn_op, "calls", json_integer(op_stats->calls));
+            json_object_set_new(jn_op, "errors", json_integer(op_stats->errors));
+            json_object_set_new(jn_op, "rows", json_integer(op_stats->rows));
+            json_object_set_new(jn_op, "total_us", json_integer(op_stats->total_us));
+            json_object_set_new(jn_op, "max_us", json_integer(op_stats->max_us));
+            json_object_set_new(jn_op, "avg_us",
+                json_integer(op_stats->total_us / op_stats->calls)
+            );
+            json_t *jn_histogram = json_object();
+            for(int i=0; i<STATS_BUCKETS; i++) {
+                if(!op_stats->histogram[i]) {
+                    continue;
+                }
+                char key[32];
+                if(i == STATS_BUCKETS-1) {
+                    snprintf(key, sizeof(key), "inf");
+                } else {
+                    snprintf(key, sizeof(key), "%llu", 1ULL << i);
+                }
+                json_object_set_new(jn_histogram, key, json_integer(op_stats->histogram[i]));
+            }
+            json_object_set_new(jn_op, "histogram", jn_histogram);
+            json_object_set_new(jn_ops, stats_op_names[op], jn_op);
+        }
+        json_object_set_new(jn_table, "rows_read",
+            json_integer(stats->ops[STATS_OP_LOAD].rows)
+        );
+        json_object_set_new(jn_table, "rows_written", json_integer(rows_written));
+        json_object_set_new(jn_table, "ops", jn_ops);
+        json_object_set_new(jn_tables, stats->tablename, jn_table);
+    }
+    pthread_mutex_unlock(&h->stats_mutex);
 
-        } else if(ret == SQLITE_DONE) {
-            break;
+    return jn_tables;
+}
+
+/***************************************************************************
+ *  sqlite3_db_status() of a connection
+ ***************************************************************************/
+PRIVATE json_t *stats_db_status(sqlite3 *db)
+{
+    static const struct {
+        const char *name;
+        int op;
+        BOOL highwater;
+    } db_status[] = {
+        {"cache_hit",           SQLITE_DBSTATUS_CACHE_HIT,              FALSE},
+        {"cache_miss",          SQLITE_DBSTATUS_CACHE_MISS,             FALSE},
+        {"cache_write",         SQLITE_DBSTATUS_CACHE_WRITE,            FALSE},
+        {"cache_spill",         SQLITE_DBSTATUS_CACHE_SPILL,            FALSE},
+        {"cache_used",          SQLITE_DBSTATUS_CACHE_USED,             FALSE},
+        {"lookaside_used",      SQLITE_DBSTATUS_LOOKASIDE_USED,         FALSE},
+        {"lookaside_max_used",  SQLITE_DBSTATUS_LOOKASIDE_USED,         TRUE},
+        {"lookaside_hit",       SQLITE_DBSTATUS_LOOKASIDE_HIT,          TRUE},
+        {"lookaside_miss_size", SQLITE_DBSTATUS_LOOKASIDE_MISS_SIZE,    TRUE},
+        {"lookaside_miss_full", SQLITE_DBSTATUS_LOOKASIDE_MISS_FULL,    TRUE},
+        {"schema_used",         SQLITE_DBSTATUS_SCHEMA_USED,            FALSE},
+        {"stmt_used",           SQLITE_DBSTATUS_STMT_USED,              FALSE},
+        {0}
+    };
+
+    json_t *jn_status = json_object();
+    for(int i=0; db_status[i].name; i++) {
+        int cur = 0, hiwtr = 0;
+        if(sqlite3_db_status(db, db_status[i].op, &cur, &hiwtr, 0)==SQLITE_OK) {
+            json_object_set_new(
+                jn_status,
+                db_status[i].name,
+                json_integer(db_status[i].highwater?hiwtr:cur)
+            );
+        }
+    }
+    return jn_status;
+}
+
+/***************************************************************************
+ *  sqlite3_stmt_status() of the cached statements of a connection,
+ *  added to jn_statements by sql (the same sql of several connections is summed).
+ ***************************************************************************/
+PRIVATE void stats_statements(DBA_HANDLE *h, json_t *jn_statements)
+{
+    static const struct {
+        const char *name;
+        int op;
+    } stmt_status[] = {
+        {"fullscan_step",   SQLITE_STMTSTATUS_FULLSCAN_STEP},
+        {"sort",            SQLITE_STMTSTATUS_SORT},
+        {"autoindex",       SQLITE_STMTSTATUS_AUTOINDEX},
+        {"vm_step",         SQLITE_STMTSTATUS_VM_STEP},
+        {"run",             SQLITE_STMTSTATUS_RUN},
+        {"reprepare",       SQLITE_STMTSTATUS_REPREPARE},
+        {0}
+    };
+
+    for(STMT_CACHE *entry = h->lru_head; entry; entry = entry->next) {
+        json_t *jn_stmt = json_object_get(jn_statements, entry->sql);
+        if(!jn_stmt) {
+            jn_stmt = json_object();
+            json_object_set_new(jn_statements, entry->sql, jn_stmt);
+        }
+        for(int i=0; stmt_status[i].name; i++) {
+            json_int_t value = sqlite3_stmt_status(entry->pStmt, stmt_status[i].op, 0);
+            value += kw_get_int(jn_stmt, stmt_status[i].name, 0, 0);
+            json_object_set_new(jn_stmt, stmt_status[i].name, json_integer(value));
+        }
+    }
+}
+
+/***************************************************************************
+ *  Slow query log.
+ *  The sql has the values as bound parameters, the same query with
+ *  other values has the same sql, it's normalized collapsing the spaces.
+ *  Each sql is logged once, with its query plan, and the logs are
+ *  limited to slow_query_rate by minute. All are counted in stats.
+ ***************************************************************************/
+PRIVATE void slow_query(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    DBA_HANDLE *conn,       // connection of the statement
+    sqlite3_stmt *pStmt,
+    uint64_t elapsed,       // usec
+    json_int_t rows,        // returned or changed
+    int fullscan_step,      // sqlite3_stmt_status() before the execution
+    int vm_step
+)
+{
+    const char *sql_ = sqlite3_sql(pStmt);
+    char *sql = gbmem_malloc(strlen(sql_) + 1);
+    if(!sql) {
+        return;
+    }
+    char *p = sql;
+    for(const char *q = sql_; *q; q++) {
+        if(isspace((unsigned char)*q)) {
+            if(p == sql || p[-1] == ' ') {
+                continue;
+            }
+            *p++ = ' ';
+        } else if(*q == ';' && p > sql && p[-1] == ' ') {
+            p[-1] = ';';
+        } else {
+            *p++ = *q;
+        }
+    }
+    while(p > sql && p[-1] == ' ') {
+        p--;
+    }
+    *p = 0;
+
+    fullscan_step = sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0) -
+        fullscan_step;
+    vm_step = sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_VM_STEP, 0) - vm_step;
+
+    pthread_mutex_lock(&h->stats_mutex);
+    json_t *jn_query = json_object_get(h->jn_slow_queries, sql);
+    if(!jn_query) {
+        jn_query = json_object();
+        json_object_set_new(h->jn_slow_queries, sql, jn_query);
+    }
+    json_object_set_new(jn_query, "count",
+        json_integer(kw_get_int(jn_query, "count", 0, 0) + 1)
+    );
+    if(elapsed > kw_get_int(jn_query, "max_us", 0, 0)) {
+        json_object_set_new(jn_query, "max_us", json_integer(elapsed));
+    }
+    json_object_set_new(jn_query, "last_us", json_integer(elapsed));
+    json_object_set_new(jn_query, "rows", json_integer(rows));
+    json_object_set_new(jn_query, "fullscan_step", json_integer(fullscan_step));
+    json_object_set_new(jn_query, "vm_step", json_integer(vm_step));
+    BOOL need_plan = !json_object_get(jn_query, "plan");
+
+    /*
+     *  Rate limit, in windows of a minute
+     */
+    BOOL log_it = FALSE;
+    uint64_t suppressed = 0;
+    if(!kw_get_bool(jn_query, "logged", 0, 0)) {
+        uint64_t now = time_in_miliseconds();
+        if(now - h->slow_window_start >= 60*1000) {
+            h->slow_window_start = now;
+            h->slow_window_logs = 0;
+        }
+        if(h->slow_window_logs < h->slow_query_rate) {
+            h->slow_window_logs++;
+            log_it = TRUE;
+            suppressed = h->slow_suppressed;
+            h->slow_suppressed = 0;
+            json_object_set_new(jn_query, "logged", json_true());
+        } else {
+            h->slow_suppressed++;
+        }
+    }
+    pthread_mutex_unlock(&h->stats_mutex);
+
+    if(!need_plan && !log_it) {
+        gbmem_free(sql);
+        return;
+    }
+
+    /*
+     *  EXPLAIN QUERY PLAN, in the connection of the statement
+     */
+    GBUFFER *gbuf_plan = gbuf_create(256, 4*1024, 0, 0);
+    BOOL full_scan = FALSE;
+    char *eqp = sqlite3_mprintf("EXPLAIN QUERY PLAN %s", sql_);
+    sqlite3_stmt *pEqp = 0;
+    if(eqp && gbuf_plan && sqlite3_prepare_v2(conn->db, eqp, -1, &pEqp, 0)==SQLITE_OK) {
+        while(sqlite3_step(pEqp)==SQLITE_ROW) {
+            const char *detail = (const char *)sqlite3_column_text(pEqp, 3);
+            if(!detail) {
+                continue;
+            }
+            if(strncmp(detail, "SCAN ", 5)==0 && !strstr(detail, "INDEX")) {
+                full_scan = TRUE;
+            }
+            gbuf_printf(gbuf_plan, "%s%s", gbuf_leftbytes(gbuf_plan)?"; ":"", detail);
+        }
+    }
+    sqlite3_finalize(pEqp);
+    sqlite3_free(eqp);
+    const char *plan = gbuf_plan && gbuf_leftbytes(gbuf_plan)?
+        gbuf_cur_rd_pointer(gbuf_plan) : "";
+
+    if(need_plan) {
+        pthread_mutex_lock(&h->stats_mutex);
+        json_object_set_new(jn_query, "plan", json_string(plan));
+        json_object_set_new(jn_query, "full_scan", json_boolean(full_scan));
+        pthread_mutex_unlock(&h->stats_mutex);
+    }
+
+    if(log_it) {
+        log_warning(0,
+            "gobj",             "%s", gobj_full_name(gobj),
+            "function",         "%s", __FUNCTION__,
+            "msgset",           "%s", MSGSET_DATABASE,
+            "msg",              "%s", "slow query",
+            "sql",              "%s", sql,
+            "duration_us",      "%llu", (unsigned long long)elapsed,
+            "threshold_ms",     "%llu", (unsigned long long)(h->slow_query_us/1000),
+            "rows",             "%lld", (long long)rows,
+            "fullscan_step",    "%d", fullscan_step,
+            "vm_step",          "%d", vm_step,
+            "full_scan",        "%s", full_scan?"yes":"no",
+            "plan",             "%s", plan,
+            "suppressed",       "%llu", (unsigned long long)suppressed,
+            NULL
+        );
+    }
+    if(gbuf_plan) {
+        gbuf_decref(gbuf_plan);
+    }
+    gbmem_free(sql);
+}
+
+/***************************************************************************
+ *  Execute a statement without result rows.
+ *  With jn_params the compiled statement is taken from the cache.
+ ***************************************************************************/
+PRIVATE int one_step(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params   // not owned. If null the statement is not cached.
+)
+{
+    return one_step_bind(gobj, h, sql, jn_params, FALSE);
+}
+
+/***************************************************************************
+ *  one_step() binding the objects and arrays as jsonb or as json text.
+ ***************************************************************************/
+PRIVATE int one_step_bind(
+    hgobj gobj,
+    DBA_HANDLE *h,
+    const char *sql,
+    json_t *jn_params,  // not owned. If null the statement is not cached.
+    BOOL jsonb          // bind objects and arrays as jsonb
+)
+{
+    if(verbose) {
+        log_info(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_DATABASE,
+            "msg",          "%s", "sql one step",
+            "sql",          "%s", sql,
+            NULL
+        );
+    }
+
+    STMT_CACHE *entry;
+    STMT_CACHE tmp;
+    if(jn_params) {
+        entry = stmt_acquire(gobj, h, sql);
+        if(!entry) {
+            // Error already logged
+            return -1;
+        }
+        if(bind_params(gobj, entry->pStmt, jn_params, jsonb)<0) {
+            // Error already logged
+            stmt_release(h, entry);
+            return -1;
+        }
+    } else {
+        const char *pzTail;
+        memset(&tmp, 0, sizeof(tmp));
+        int ret = sqlite3_prepare_v2(
+            h->db,
+            sql,
+            -1,
+            &tmp.pStmt,
+            &pzTail
+        );
+        if(ret != SQLITE_OK) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_SERVICE_ERROR,
+                "msg",          "%s", "sqlite3_prepare_v2() FAILED",
+                "sql",          "%s", sql,
+                "ret",          "%d", ret,
+                "error",        "%d", sqlite3_errcode(h->db),
+                "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(h->db)),
+                NULL
+            );
+            log_debug_dump(
+                0,
+                sql,
+                strlen(sql),
+                "sqlite3_prepare_v2() FAILED"
+            );
+            return -1;
+        }
+        entry = &tmp;
+    }
+
+    uint64_t t0 = 0;
+    int fullscan_step = 0, vm_step = 0;
+    if(h->slow_query_us) {
+        t0 = time_in_usec();
+        fullscan_step = sqlite3_stmt_status(entry->pStmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+        vm_step = sqlite3_stmt_status(entry->pStmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    }
+
+    int ret = sqlite3_step(entry->pStmt);
+    if(ret != SQLITE_DONE) {
+        const char *errmsg = sqlite3_errstr(sqlite3_errcode(h->db));
+        if(entry == &tmp) {
+            sqlite3_finalize(tmp.pStmt);
+        } else {
+            stmt_release(h, entry);
+        }
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_step() FAILED",
+            "sql",          "%s", sql,
+            "error",        "%d", ret,
+            "errormsg",     "%s", errmsg?errmsg:"?",
+            NULL
+        );
+        return -1;
+    }
+    if(h->slow_query_us) {
+        uint64_t elapsed = time_in_usec() - t0;
+        if(elapsed >= h->slow_query_us) {
+            slow_query(
+                gobj,
+                h,
+                h,
+                entry->pStmt,
+                elapsed,
+                entry == &tmp? 0 : sqlite3_changes64(h->db),  // tmp: control statements
+                fullscan_step,
+                vm_step
+            );
+        }
+    }
+    if(entry == &tmp) {
+        sqlite3_finalize(tmp.pStmt);
+    } else {
+        stmt_release(h, entry);
+    }
+
+    if(h->memory && !h->memory_lost) {
+        memory_mirror(gobj, h, sql, jn_params, jsonb);
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Unlink from the lru list
+ ***************************************************************************/
+PRIVATE void lru_unlink(DBA_HANDLE *h, STMT_CACHE *entry)
+{
+    if(entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        h->lru_head = entry->next;
+    }
+    if(entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        h->lru_tail = entry->prev;
+    }
+    entry->prev = entry->next = 0;
+}
+
+/***************************************************************************
+ *  Link as the most recently used
+ ***************************************************************************/
+PRIVATE void lru_push_front(DBA_HANDLE *h, STMT_CACHE *entry)
+{
+    entry->prev = 0;
+    entry->next = h->lru_head;
+    if(h->lru_head) {
+        h->lru_head->prev = entry;
+    } else {
+        h->lru_tail = entry;
+    }
+    h->lru_head = entry;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void stmt_entry_free(STMT_CACHE *entry)
+{
+    decoder_free(entry->decoder);
+    sqlite3_finalize(entry->pStmt);
+    if(entry->sql) {
+        gbmem_free(entry->sql);
+    }
+    gbmem_free(entry);
+}
 
-        } else {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "sqlite3_step() FAILED",
-                "ret",          "%d", ret,
-                "error",        "%d", sqlite3_errcode(pDb),
-                "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(pDb)),
-                NULL
-            );
-            sqlite3_finalize(pStmt);
-            gbuf_decref(gbuf_sql);
-            return jn_record_list;
+/***************************************************************************
+ *  Evict the least recently used statements not in use,
+ *  until there is room for a new one.
+ ***************************************************************************/
+PRIVATE void stmt_cache_evict(DBA_HANDLE *h)
+{
+    STMT_CACHE *entry = h->lru_tail;
+    while(entry && h->stmt_cache_count >= h->stmt_cache_size) {
+        STMT_CACHE *prev = entry->prev;
+        if(!entry->in_use) {
+            lru_unlink(h, entry);
+            json_object_del(h->jn_stmt_index, entry->sql);
+            stmt_entry_free(entry);
+            h->stmt_cache_count--;
+            h->stmt_cache_evictions++;
         }
+        entry = prev;
     }
-    sqlite3_finalize(pStmt);
-
-    gbuf_decref(gbuf_sql);
+}
 
-    return jn_record_list;
+/***************************************************************************
+ *  Finalize all cached statements not in use.
+ ***************************************************************************/
+PRIVATE void stmt_cache_flush(DBA_HANDLE *h)
+{
+    STMT_CACHE *entry = h->lru_head;
+    while(entry) {
+        STMT_CACHE *next = entry->next;
+        if(!entry->in_use) {
+            lru_unlink(h, entry);
+            json_object_del(h->jn_stmt_index, entry->sql);
+            stmt_entry_free(entry);
+            h->stmt_cache_count--;
+        }
+        entry = next;
+    }
 }
 
 /***************************************************************************
- *
+ *  Get a compiled statement for sql, from the cache or a new one.
+ *  Return it with stmt_release().
  ***************************************************************************/
-PRIVATE int one_step(hgobj gobj, const char *sql, sqlite3 *pDb)
+PRIVATE STMT_CACHE *stmt_acquire(hgobj gobj, DBA_HANDLE *h, const char *sql)
 {
-    sqlite3_stmt *pStmt;
-    if(verbose) {
-        log_info(0,
+    STMT_CACHE *entry = 0;
+    json_t *jn_entry = json_object_get(h->jn_stmt_index, sql);
+    if(jn_entry) {
+        entry = (STMT_CACHE *)(size_t)json_integer_value(jn_entry);
+        if(!entry->in_use) {
+            h->stmt_cache_hits++;
+            entry->in_use = TRUE;
+            lru_unlink(h, entry);
+            lru_push_front(h, entry);
+            return entry;
+        }
+        // In use by a re-entrant call, compile a temporary one.
+    }
+    h->stmt_cache_misses++;
+
+    entry = gbmem_malloc(sizeof(STMT_CACHE));
+    if(!entry) {
+        log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_DATABASE,
-            "msg",          "%s", "sql one step",
-            "sql",          "%s", sql,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            "size",         "%d", (int)sizeof(STMT_CACHE),
             NULL
         );
+        return 0;
     }
-    const char *pzTail;
-    int ret = sqlite3_prepare_v2(
-        pDb,
+
+    BOOL cache_it = (!jn_entry && h->stmt_cache_size > 0)?TRUE:FALSE;
+    int ret = sqlite3_prepare_v3(
+        h->db,
         sql,
         -1,
-        &pStmt,
-        &pzTail
+        cache_it?SQLITE_PREPARE_PERSISTENT:0,
+        &entry->pStmt,
+        0
     );
     if(ret != SQLITE_OK) {
         log_error(0,
             "gobj",         "%s", gobj_full_name(gobj),
             "function",     "%s", __FUNCTION__,
             "msgset",       "%s", MSGSET_SERVICE_ERROR,
-            "msg",          "%s", "sqlite3_prepare_v2() FAILED",
+            "msg",          "%s", "sqlite3_prepare_v3() FAILED",
             "sql",          "%s", sql,
             "ret",          "%d", ret,
-            "error",        "%d", sqlite3_errcode(pDb),
-            "errormsg",     "%s", sqlite3_errstr(sqlite3_errcode(pDb)),
+            "error",        "%d", sqlite3_errcode(h->db),
+            "errormsg",     "%s", sqlite3_errmsg(h->db),
             NULL
         );
         log_debug_dump(
             0,
             sql,
             strlen(sql),
-            "sqlite3_prepare_v2() FAILED"
+            "sqlite3_prepare_v3() FAILED"
         );
-        return -1;
+        sqlite3_finalize(entry->pStmt);
+        gbmem_free(entry);
+        return 0;
     }
+    entry->in_use = TRUE;
 
-    ret = sqlite3_step(pStmt);
-    if(ret != SQLITE_DONE) {
-        const char *errmsg = sqlite3_errstr(sqlite3_errcode(pDb));
-        sqlite3_finalize(pStmt);
-        log_error(0,
-            "gobj",         "%s", gobj_full_name(gobj),
-            "function",     "%s", __FUNCTION__,
-            "msgset",       "%s", MSGSET_SERVICE_ERROR,
-            "msg",          "%s", "sqlite3_step() FAILED",
-            "error",        "%d", ret,
-            "errormsg",     "%s", errmsg?errmsg:"?",
-            NULL
-        );
-        return -1;
+    if(cache_it) {
+        stmt_cache_evict(h);
+        if(h->stmt_cache_count < h->stmt_cache_size) {
+            entry->sql = gbmem_strdup(sql);
+            entry->cached = TRUE;
+            json_object_set_new(
+                h->jn_stmt_index,
+                sql,
+                json_integer((json_int_t)(size_t)entry)
+            );
+            lru_push_front(h, entry);
+            h->stmt_cache_count++;
+        }
     }
-    sqlite3_finalize(pStmt);
+    return entry;
+}
 
-    return 0;
+/***************************************************************************
+ *  Give back a statement got with stmt_acquire()
+ ***************************************************************************/
+PRIVATE void stmt_release(DBA_HANDLE *h, STMT_CACHE *entry)
+{
+    if(!entry->cached) {
+        stmt_entry_free(entry);
+        return;
+    }
+    sqlite3_reset(entry->pStmt);
+    sqlite3_clear_bindings(entry->pStmt);
+    entry->in_use = FALSE;
 }
 
 /***************************************************************************
@@ -571,6 +6797,10 @@ PRIVATE GBUFFER *sqlite_create_table(
     const char *k;
     json_t *jn_value;
     json_object_foreach(kw_fields, k, jn_value) {
+        if(strcmp(k, "__indexes__")==0 || strcmp(k, "__paths__")==0 ||
+                strcmp(k, "__json_storage__")==0 || strcmp(k, "__change_feed__")==0) {
+            continue;
+        }
         const char *type = jsontype2sqltype(jn_value);
         if(!type) {
             log_error(0,
@@ -605,6 +6835,118 @@ PRIVATE GBUFFER *sqlite_create_table(
     return gbuf_script;
 }
 
+/***************************************************************************
+ *  Index definition, one of:
+ *      "owner"                                 single column
+ *      ["owner", "created DESC"]               composite
+ *      "config.region"                         json path declared in "__paths__"
+ *      {
+ *          "fields": ["email"],                or "owner"
+ *          "unique": true,
+ *          "where": "deleted=0",               partial index
+ *          "name": "users_email"               default tablename_fields
+ *      }
+ ***************************************************************************/
+PRIVATE GBUFFER *sqlite_create_index(
+    hgobj gobj,
+    const char *tablename,
+    json_t *jn_index    // not owned
+)
+{
+    json_t *jn_fields = jn_index;
+    BOOL unique = FALSE;
+    const char *where = 0;
+    const char *name = 0;
+    if(json_is_object(jn_index)) {
+        jn_fields = json_object_get(jn_index, "fields");
+        unique = kw_get_bool(jn_index, "unique", 0, 0);
+        where = kw_get_str(jn_index, "where", 0, 0);
+        name = kw_get_str(jn_index, "name", 0, 0);
+    }
+    if(!(json_is_string(jn_fields) ||
+            (json_is_array(jn_fields) && json_array_size(jn_fields)>0))) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "index without fields",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        return 0;
+    }
+
+    GBUFFER *gbuf_script = gbuf_create(1*1024, gbmem_get_maximum_block(), 0, 0);
+    if(!gbuf_script) {
+        // Error already logged
+        return 0;
+    }
+
+    /*
+     *  Column list, and the default name: tablename_field1_field2
+     */
+    char default_name[256];
+    snprintf(default_name, sizeof(default_name), "%s", tablename);
+    char columns[1024] = {0};
+    int len = 0;
+    for(size_t i=0; i<(json_is_array(jn_fields)?json_array_size(jn_fields):1); i++) {
+        const char *field = json_is_array(jn_fields)?
+            json_string_value(json_array_get(jn_fields, i)):
+            json_string_value(jn_fields);
+        if(!field || !*field) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "index field must be a string",
+                "tablename",    "%s", tablename,
+                NULL
+            );
+            gbuf_decref(gbuf_script);
+            return 0;
+        }
+        char path_column[256];
+        const char *sp = strchr(field, ' ');
+        snprintf(path_column, sizeof(path_column), "%.*s",
+            sp? (int)(sp - field) : (int)strlen(field), field
+        );
+        if(strchr(path_column, '.') && path_column_name(path_column, path_column, sizeof(path_column))) {
+            // json path: index its generated column
+            len += snprintf(columns + len, sizeof(columns) - len, "%s%s%s",
+                i?", ":"", path_column, sp?sp:""
+            );
+        } else {
+            len += snprintf(columns + len, sizeof(columns) - len, "%s%s", i?", ":"", field);
+        }
+        if(len >= sizeof(columns)) {
+            len = sizeof(columns) - 1;
+        }
+
+        // Name part: the field without the order/collation words
+        size_t n = strlen(default_name);
+        if(n + 1 < sizeof(default_name)) {
+            default_name[n++] = '_';
+            for(const char *p = field; *p && *p != ' ' && n + 1 < sizeof(default_name); p++) {
+                default_name[n++] = isalnum((unsigned char)*p)? *p : '_';
+            }
+            default_name[n] = 0;
+        }
+    }
+
+    gbuf_printf(gbuf_script, "CREATE %sINDEX IF NOT EXISTS %s ON %s (%s)",
+        unique?"UNIQUE ":"",
+        name?name:default_name,
+        tablename,
+        columns
+    );
+    if(where) {
+        gbuf_printf(gbuf_script, " WHERE %s", where);
+    }
+    gbuf_printf(gbuf_script, ";");
+
+    return gbuf_script;
+}
+
 /***************************************************************************
  *
  ***************************************************************************/
@@ -620,56 +6962,354 @@ PRIVATE GBUFFER *sqlite_drop_table(hgobj gobj, const char *tablename)
 }
 
 /***************************************************************************
- *
+ *  Object/array fields of the table stored as jsonb?
  ***************************************************************************/
-PRIVATE int write_db_value(hgobj gobj, GBUFFER *gbuf_script, json_t *value)
+PRIVATE BOOL is_jsonb_table(DBA_HANDLE *h, const char *tablename)
 {
-    if(json_is_string(value)) {
-        const char *s = json_string_value(value);
-        char *sq = sqlite3_mprintf("%q", s);
-        if(sq) {
-            gbuf_printf(gbuf_script, "'%s'", sq);
-            sqlite3_free(sq);
-        } else {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "sqlite3_mprintf() FAILED",
-                "str",          "%s", s,
-                NULL
+    return json_object_get(h->jn_json_storage, tablename)?TRUE:FALSE;
+}
+
+/***************************************************************************
+ *  jsonb, the binary json of sqlite (3.45+), encoded and decoded here
+ *  to not depend on the sqlite version:
+ *  each element is a header and a payload.
+ *  Header: low 4 bits the type, high 4 bits the payload size (0-11),
+ *  or 12,13,14,15: the size follows in 1,2,4,8 bytes big-endian.
+ ***************************************************************************/
+#define JSONB_NULL      0
+#define JSONB_TRUE      1
+#define JSONB_FALSE     2
+#define JSONB_INT       3
+#define JSONB_INT5      4
+#define JSONB_FLOAT     5
+#define JSONB_FLOAT5    6
+#define JSONB_TEXT      7
+#define JSONB_TEXTJ     8
+#define JSONB_TEXT5     9
+#define JSONB_TEXTRAW   10
+#define JSONB_ARRAY     11
+#define JSONB_OBJECT    12
+
+/***************************************************************************
+ *  Write the header (if bf) and return its length.
+ ***************************************************************************/
+PRIVATE size_t jsonb_header(unsigned char *bf, int type, size_t payload)
+{
+    int n;
+    int code;
+    if(payload <= 11) {
+        n = 0; code = (int)payload;
+    } else if(payload <= 0xFF) {
+        n = 1; code = 12;
+    } else if(payload <= 0xFFFF) {
+        n = 2; code = 13;
+    } else if(payload <= 0xFFFFFFFF) {
+        n = 4; code = 14;
+    } else {
+        n = 8; code = 15;
+    }
+    if(bf) {
+        bf[0] = (unsigned char)((code << 4) | type);
+        for(int i=0; i<n; i++) {
+            bf[1+i] = (unsigned char)(payload >> (8*(n-1-i)));
+        }
+    }
+    return 1 + n;
+}
+
+/***************************************************************************
+ *  Write an element (if bf) and return its length.
+ ***************************************************************************/
+PRIVATE size_t jsonb_element(unsigned char *bf, int type, const char *payload, size_t len)
+{
+    size_t n = jsonb_header(bf, type, len);
+    if(bf) {
+        memcpy(bf + n, payload, len);
+    }
+    return n + len;
+}
+
+/***************************************************************************
+ *  Encode json to jsonb in bf, if bf is null only compute the size.
+ *  Return the size.
+ ***************************************************************************/
+PRIVATE size_t json2jsonb(json_t *jn, unsigned char *bf)
+{
+    char number[64];
+    int n;
+
+    switch(json_typeof(jn)) {
+        case JSON_TRUE:
+            return jsonb_header(bf, JSONB_TRUE, 0);
+        case JSON_FALSE:
+            return jsonb_header(bf, JSONB_FALSE, 0);
+        case JSON_INTEGER:
+            n = snprintf(number, sizeof(number), "%" JSON_INTEGER_FORMAT, json_integer_value(jn));
+            return jsonb_element(bf, JSONB_INT, number, n);
+        case JSON_REAL:
+            n = snprintf(number, sizeof(number), "%.17g", json_real_value(jn));
+            if(!strpbrk(number, ".eE")) {
+                n += snprintf(number + n, sizeof(number) - n, ".0");
+            }
+            return jsonb_element(bf, JSONB_FLOAT, number, n);
+        case JSON_STRING:
+            return jsonb_element(
+                bf, JSONB_TEXTRAW, json_string_value(jn), json_string_length(jn)
             );
+        case JSON_ARRAY:
+        case JSON_OBJECT:
+            {
+                size_t payload = 0;
+                if(json_is_array(jn)) {
+                    size_t idx;
+                    json_t *jn_item;
+                    json_array_foreach(jn, idx, jn_item) {
+                        payload += json2jsonb(jn_item, 0);
+                    }
+                } else {
+                    const char *key;
+                    json_t *jn_item;
+                    json_object_foreach(jn, key, jn_item) {
+                        payload += jsonb_element(0, JSONB_TEXTRAW, key, strlen(key));
+                        payload += json2jsonb(jn_item, 0);
+                    }
+                }
+                size_t len = jsonb_header(
+                    bf, json_is_array(jn)?JSONB_ARRAY:JSONB_OBJECT, payload
+                );
+                if(!bf) {
+                    return len + payload;
+                }
+                if(json_is_array(jn)) {
+                    size_t idx;
+                    json_t *jn_item;
+                    json_array_foreach(jn, idx, jn_item) {
+                        len += json2jsonb(jn_item, bf + len);
+                    }
+                } else {
+                    const char *key;
+                    json_t *jn_item;
+                    json_object_foreach(jn, key, jn_item) {
+                        len += jsonb_element(bf + len, JSONB_TEXTRAW, key, strlen(key));
+                        len += json2jsonb(jn_item, bf + len);
+                    }
+                }
+                return len;
+            }
+        case JSON_NULL:
+        default:
+            return jsonb_header(bf, JSONB_NULL, 0);
+    }
+}
+
+/***************************************************************************
+ *  Decode the element at bf. Return null if it's not valid jsonb.
+ ***************************************************************************/
+PRIVATE json_t *jsonb_decode(const unsigned char *bf, size_t len, size_t *consumed)
+{
+    if(len < 1) {
+        return 0;
+    }
+    int type = bf[0] & 0x0F;
+    int code = bf[0] >> 4;
+    size_t hlen = 1;
+    size_t payload = code;
+    if(code >= 12) {
+        int n = 1 << (code - 12);
+        if(len < 1 + n) {
+            return 0;
         }
+        payload = 0;
+        for(int i=0; i<n; i++) {
+            payload = (payload << 8) | bf[1+i];
+        }
+        hlen += n;
+    }
+    if(payload > len - hlen) {
+        return 0;
+    }
+    const char *p = (const char *)bf + hlen;
+    *consumed = hlen + payload;
+
+    char number[64];
+    switch(type) {
+        case JSONB_NULL:
+            return payload==0? json_null() : 0;
+        case JSONB_TRUE:
+            return payload==0? json_true() : 0;
+        case JSONB_FALSE:
+            return payload==0? json_false() : 0;
+
+        case JSONB_INT:
+        case JSONB_INT5:
+        case JSONB_FLOAT:
+        case JSONB_FLOAT5:
+            {
+                if(payload == 0 || payload >= sizeof(number)) {
+                    return 0;
+                }
+                memcpy(number, p, payload);
+                number[payload] = 0;
+                char *end;
+                if(type == JSONB_INT || type == JSONB_INT5) {
+                    json_int_t v = strtoll(number, &end, type==JSONB_INT? 10 : 0);
+                    return *end? 0 : json_integer(v);
+                } else {
+                    double v = strtod(number, &end);
+                    return *end? 0 : json_real(v);
+                }
+            }
+
+        case JSONB_TEXT:
+        case JSONB_TEXTRAW:
+            return json_stringn(p, payload);
+
+        case JSONB_TEXTJ:
+        case JSONB_TEXT5:
+            {
+                /*
+                 *  With escapes: let jansson unescape it.
+                 */
+                char *s = gbmem_malloc(payload + 3);
+                if(!s) {
+                    return 0;
+                }
+                s[0] = '"';
+                memcpy(s + 1, p, payload);
+                s[payload + 1] = '"';
+                s[payload + 2] = 0;
+                json_t *jn = json_loadb(s, payload + 2, JSON_DECODE_ANY, 0);
+                gbmem_free(s);
+                if(!json_is_string(jn)) {
+                    JSON_DECREF(jn);
+                }
+                return jn;
+            }
+
+        case JSONB_ARRAY:
+        case JSONB_OBJECT:
+            {
+                json_t *jn = type==JSONB_ARRAY? json_array() : json_object();
+                const unsigned char *q = (const unsigned char *)p;
+                size_t left = payload;
+                while(left > 0) {
+                    size_t n;
+                    json_t *jn_key = 0;
+                    if(type == JSONB_OBJECT) {
+                        jn_key = jsonb_decode(q, left, &n);
+                        if(!json_is_string(jn_key)) {
+                            JSON_DECREF(jn_key);
+                            JSON_DECREF(jn);
+                            return 0;
+                        }
+                        q += n; left -= n;
+                    }
+                    json_t *jn_value = jsonb_decode(q, left, &n);
+                    if(!jn_value) {
+                        JSON_DECREF(jn_key);
+                        JSON_DECREF(jn);
+                        return 0;
+                    }
+                    q += n; left -= n;
+                    if(jn_key) {
+                        json_object_set_new(jn, json_string_value(jn_key), jn_value);
+                        JSON_DECREF(jn_key);
+                    } else {
+                        json_array_append_new(jn, jn_value);
+                    }
+                }
+                return jn;
+            }
+
+        default:
+            return 0;
+    }
+}
+
+/***************************************************************************
+ *  Decode a jsonb object or array, null if it's not one.
+ ***************************************************************************/
+PRIVATE json_t *jsonb2json(const unsigned char *bf, size_t len)
+{
+    if(len < 1 || ((bf[0] & 0x0F) != JSONB_OBJECT && (bf[0] & 0x0F) != JSONB_ARRAY)) {
+        return 0;
+    }
+    size_t consumed;
+    json_t *jn = jsonb_decode(bf, len, &consumed);
+    if(jn && consumed != len) {
+        JSON_DECREF(jn);
+        return 0;
+    }
+    return jn;
+}
+
+/***************************************************************************
+ *  Bind a json value to the parameter `idx` of the statement.
+ *  Strings are bound without copy, the json value must be alive
+ *  until the statement is reset (jn_params keeps a reference).
+ ***************************************************************************/
+PRIVATE int bind_db_value(hgobj gobj, sqlite3_stmt *pStmt, int idx, json_t *value, BOOL jsonb)
+{
+    int ret;
+    if(json_is_string(value)) {
+        ret = sqlite3_bind_text64(
+            pStmt,
+            idx,
+            json_string_value(value),
+            json_string_length(value),
+            SQLITE_STATIC,
+            SQLITE_UTF8
+        );
     } else if(json_is_integer(value)) {
-        json_int_t d = json_integer_value(value);
-        gbuf_printf(gbuf_script, "%" JSON_INTEGER_FORMAT, d);
+        ret = sqlite3_bind_int64(pStmt, idx, json_integer_value(value));
     } else if(json_is_real(value)) {
-        double d = json_real_value(value);
-        gbuf_printf(gbuf_script, "%.f", d);
+        ret = sqlite3_bind_double(pStmt, idx, json_real_value(value));
     } else if(json_is_true(value)) {
-        gbuf_printf(gbuf_script, "1");
+        ret = sqlite3_bind_int(pStmt, idx, 1);
     } else if(json_is_false(value)) {
-        gbuf_printf(gbuf_script, "0");
+        ret = sqlite3_bind_int(pStmt, idx, 0);
     } else if(json_is_null(value)) {
-        gbuf_printf(gbuf_script, "0");
+        ret = sqlite3_bind_int(pStmt, idx, 0);
+    } else if(jsonb && (json_is_array(value) || json_is_object(value))) {
+        size_t size = json2jsonb(value, 0);
+        unsigned char *bf = gbmem_malloc(size);
+        if(!bf) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_MEMORY_ERROR,
+                "msg",          "%s", "gbmem_malloc() FAILED",
+                "size",         "%d", (int)size,
+                NULL
+            );
+            return -1;
+        }
+        json2jsonb(value, bf);
+        ret = sqlite3_bind_blob64(pStmt, idx, bf, size, gbmem_free);
+
     } else if(json_is_array(value) || json_is_object(value)) {
         char *s = json_dumps(value, JSON_ENCODE_ANY|JSON_COMPACT); //|JSON_SORT_KEYS
-
-        char *sq = sqlite3_mprintf("%q", s);
-        if(sq) {
-            gbuf_printf(gbuf_script, "'%s'", sq);
-            sqlite3_free(sq);
-        } else {
+        if(!s) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
                 "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "sqlite3_mprintf() FAILED",
-                "str",          "%s", s,
+                "msg",          "%s", "json_dumps() FAILED",
                 NULL
             );
+            return -1;
         }
-        gbmem_free(s);
+        /*
+         *  sqlite takes the dumped buffer, it's freed by sqlite.
+         */
+        ret = sqlite3_bind_text64(
+            pStmt,
+            idx,
+            s,
+            strlen(s),
+            gbmem_free,
+            SQLITE_UTF8
+        );
 
     } else {
         log_error(0,
@@ -681,6 +7321,36 @@ PRIVATE int write_db_value(hgobj gobj, GBUFFER *gbuf_script, json_t *value)
         );
         return -1;
     }
+
+    if(ret != SQLITE_OK) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_SERVICE_ERROR,
+            "msg",          "%s", "sqlite3_bind() FAILED",
+            "idx",          "%d", idx,
+            "ret",          "%d", ret,
+            "errormsg",     "%s", sqlite3_errstr(ret),
+            NULL
+        );
+        return -1;
+    }
+    return 0;
+}
+
+/***************************************************************************
+ *  Bind the list of values, in order, to the parameters of the statement
+ ***************************************************************************/
+PRIVATE int bind_params(hgobj gobj, sqlite3_stmt *pStmt, json_t *jn_params, BOOL jsonb)
+{
+    size_t idx;
+    json_t *value;
+    json_array_foreach(jn_params, idx, value) {
+        if(bind_db_value(gobj, pStmt, (int)idx+1, value, jsonb)<0) {
+            // Error already logged
+            return -1;
+        }
+    }
     return 0;
 }
 
@@ -690,7 +7360,8 @@ PRIVATE int write_db_value(hgobj gobj, GBUFFER *gbuf_script, json_t *value)
 PRIVATE GBUFFER *sqlite_insert_new(
     hgobj gobj,
     const char *tablename,
-    json_t *kw_record // owned
+    json_t *kw_record, // owned
+    json_t *jn_params  // not owned, values to bind are appended
 )
 {
     GBUFFER *gbuf_script = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
@@ -726,41 +7397,136 @@ PRIVATE GBUFFER *sqlite_insert_new(
         if(i > 0) {
             gbuf_printf(gbuf_script, ", ");
         }
+        gbuf_printf(gbuf_script, "?");
+        json_array_append(jn_params, value);
+        i++;
+    }
 
-        int ret = write_db_value(gobj, gbuf_script, value);
-        if(ret < 0) {
+    gbuf_printf(gbuf_script, ");");
+
+    KW_DECREF(kw_record);
+
+    return gbuf_script;
+}
+
+/***************************************************************************
+ *  INSERT ... ON CONFLICT(key) DO UPDATE SET col=excluded.col ... RETURNING id
+ *  The key columns and the id are not updated.
+ ***************************************************************************/
+PRIVATE GBUFFER *sqlite_upsert(
+    hgobj gobj,
+    const char *tablename,
+    const char *key,
+    json_t *kw_record,  // owned
+    json_t *jn_params   // not owned, values to bind are appended
+)
+{
+    /*
+     *  Key columns
+     */
+    json_t *jn_keys = json_object();
+    const char *p = key;
+    while(p) {
+        const char *comma = strchr(p, ',');
+        char column[128];
+        int n = comma? (int)(comma - p) : (int)strlen(p);
+        while(n > 0 && *p == ' ') {
+            p++; n--;
+        }
+        while(n > 0 && p[n-1] == ' ') {
+            n--;
+        }
+        snprintf(column, sizeof(column), "%.*s", n, p);
+        if(!is_column_name(column)) {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "json type INVALID",
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "upsert key not valid",
                 "tablename",    "%s", tablename,
                 "key",          "%s", key,
                 NULL
             );
+            JSON_DECREF(jn_keys);
+            KW_DECREF(kw_record);
+            return 0;
         }
+        json_object_set_new(jn_keys, column, json_true());
+        p = comma? comma+1 : 0;
+    }
+
+    GBUFFER *gbuf_script = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
+    if(!gbuf_script) {
+        // Error already logged
+        JSON_DECREF(jn_keys);
+        KW_DECREF(kw_record);
+        return 0;
+    }
+    gbuf_printf(gbuf_script, "INSERT INTO %s (", tablename);
 
+    const char *k;
+    json_t *value;
+    int i = 0;
+    json_object_foreach(kw_record, k, value) {
+        gbuf_printf(gbuf_script, i?", %s":"%s", k);
+        i++;
+    }
+    gbuf_printf(gbuf_script, ") VALUES (");
+    i = 0;
+    json_object_foreach(kw_record, k, value) {
+        gbuf_printf(gbuf_script, i?", ?":"?");
+        json_array_append(jn_params, value);
         i++;
     }
+    gbuf_printf(gbuf_script, ") ON CONFLICT(%s) DO UPDATE SET ", key);
 
-    gbuf_printf(gbuf_script, ");");
+    i = 0;
+    json_object_foreach(kw_record, k, value) {
+        if(json_object_get(jn_keys, k) || strcasecmp(k, "id")==0) {
+            continue;
+        }
+        gbuf_printf(gbuf_script, i?", %s=excluded.%s":"%s=excluded.%s", k, k);
+        i++;
+    }
+    if(i == 0) {
+        // Only key columns: touch the key, to return the id of the row
+        json_object_foreach(jn_keys, k, value) {
+            gbuf_printf(gbuf_script, "%s=excluded.%s", k, k);
+            break;
+        }
+    }
+    gbuf_printf(gbuf_script, " RETURNING id;");
 
+    JSON_DECREF(jn_keys);
     KW_DECREF(kw_record);
-
     return gbuf_script;
 }
 
 /***************************************************************************
- *  WRITE: update resource
- *  mandatory id
+ *  WRITE: update the records of the filter (same grammar as the selects)
  ***************************************************************************/
-PRIVATE GBUFFER *sqlite_update_id(
+PRIVATE GBUFFER *sqlite_update(
     hgobj gobj,
     const char *tablename,
-    json_int_t id,
-    json_t *kw_record // owned
+    json_t *kw_filtro,  // not owned
+    json_t *kw_record,  // owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
 )
 {
+    if(json_object_size(kw_filtro)==0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "update without filter",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        KW_DECREF(kw_record);
+        return 0;
+    }
+
     GBUFFER *gbuf_script = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
     if(!gbuf_script) {
         // Error already logged
@@ -784,47 +7550,58 @@ PRIVATE GBUFFER *sqlite_update_id(
         if(i > 0) {
             gbuf_printf(gbuf_script, ", ");
         }
-        gbuf_printf(gbuf_script, "%s", key);
-        gbuf_printf(gbuf_script, " = ");
-
-        int ret = write_db_value(gobj, gbuf_script, value);
-        if(ret < 0) {
-            log_error(0,
-                "gobj",         "%s", gobj_full_name(gobj),
-                "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "json type INVALID",
-                "tablename",    "%s", tablename,
-                "key",          "%s", key,
-                NULL
-            );
-        }
-
+        gbuf_printf(gbuf_script, "%s = ?", key);
+        json_array_append(jn_params, value);
         i++;
     }
-
-    gbuf_printf(gbuf_script, " WHERE id=%" JSON_INTEGER_FORMAT ";", id);
-
     KW_DECREF(kw_record);
 
+    gbuf_printf(gbuf_script, " WHERE ");
+    if(sqlite_where(gobj, gbuf_script, kw_filtro, jn_paths, jn_params)<0) {
+        // Error already logged
+        gbuf_decref(gbuf_script);
+        return 0;
+    }
+    gbuf_printf(gbuf_script, ";");
+
     return gbuf_script;
 }
 
 /***************************************************************************
- *  WRITE: delete resource
- *  mandatory id
+ *  WRITE: delete the records of the filter (same grammar as the selects)
  ***************************************************************************/
-PRIVATE GBUFFER *sqlite_delete_id(
+PRIVATE GBUFFER *sqlite_delete(
     hgobj gobj,
     const char *tablename,
-    json_int_t id)
+    json_t *kw_filtro,  // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
+)
 {
+    if(json_object_size(kw_filtro)==0) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+            "msg",          "%s", "delete without filter",
+            "tablename",    "%s", tablename,
+            NULL
+        );
+        return 0;
+    }
+
     GBUFFER *gbuf_script = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
     if(!gbuf_script) {
         // Error already logged
         return 0;
     }
-    gbuf_printf(gbuf_script, "DELETE FROM %s WHERE id=%" JSON_INTEGER_FORMAT ";", tablename, id);
+    gbuf_printf(gbuf_script, "DELETE FROM %s WHERE ", tablename);
+    if(sqlite_where(gobj, gbuf_script, kw_filtro, jn_paths, jn_params)<0) {
+        // Error already logged
+        gbuf_decref(gbuf_script);
+        return 0;
+    }
+    gbuf_printf(gbuf_script, ";");
     return gbuf_script;
 }
 
@@ -834,7 +7611,10 @@ PRIVATE GBUFFER *sqlite_delete_id(
 PRIVATE GBUFFER *sqlite_select(
     hgobj gobj,
     const char *tablename,
-    json_t *kw_filtro  // owned
+    json_t *kw_filtro,  // owned
+    json_t *jn_options, // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
 )
 {
     GBUFFER *gbuf_script = gbuf_create(4*1024, gbmem_get_maximum_block(), 0, 0);
@@ -846,28 +7626,86 @@ PRIVATE GBUFFER *sqlite_select(
 
     gbuf_printf(gbuf_script, "SELECT * FROM %s ", tablename);
 
-    if(json_object_size(kw_filtro)>0) {
+    int cols = 0;
+    if(json_object_size(kw_filtro) > 0) {
         gbuf_printf(gbuf_script, " WHERE ");
-        int cols = 0;
-        const char *k;
-        json_t *jn_value;
-        json_object_foreach(kw_filtro, k, jn_value) {
-            if(cols > 0)  {
-                gbuf_printf(gbuf_script, " AND ");
-            }
-            if(json_is_integer(jn_value)) {
-                gbuf_printf(gbuf_script, "%s=%"JSON_INTEGER_FORMAT, k, json_integer_value(jn_value));
-
-            } else if(json_is_string(jn_value)) {
-                gbuf_printf(gbuf_script, "%s='%s'", k, json_string_value(jn_value));
+        if(sqlite_where(gobj, gbuf_script, kw_filtro, jn_paths, jn_params)<0) {
+            // Error already logged
+            gbuf_decref(gbuf_script);
+            KW_DECREF(kw_filtro);
+            return 0;
+        }
+        cols++;
+    }
 
-            } else if(json_is_real(jn_value)) {
-                gbuf_printf(gbuf_script, "%s=%f", k, json_real_value(jn_value));
+    /*
+     *  Keyset pagination, id ranges
+     */
+    json_t *jn_after_id = json_object_get(jn_options, "after_id");
+    json_t *jn_until_id = json_object_get(jn_options, "until_id");
+    json_t *jn_limit = json_object_get(jn_options, "limit");
+    if(jn_after_id) {
+        gbuf_printf(gbuf_script, cols?" AND ":" WHERE ");
+        gbuf_printf(gbuf_script, "id>?");
+        json_array_append(jn_params, jn_after_id);
+        cols++;
+    }
+    if(jn_until_id) {
+        gbuf_printf(gbuf_script, cols?" AND ":" WHERE ");
+        gbuf_printf(gbuf_script, "id<=?");
+        json_array_append(jn_params, jn_until_id);
+        cols++;
+    }
 
+    /*
+     *  Ordering, by default by id if paginating
+     */
+    json_t *jn_order_by = json_object_get(jn_options, "order_by");
+    json_t *jn_offset = json_object_get(jn_options, "offset");
+    if(jn_order_by) {
+        if(json_is_string(jn_order_by)) {
+            jn_order_by = json_pack("[O]", jn_order_by);
+        } else {
+            JSON_INCREF(jn_order_by);
+        }
+        gbuf_printf(gbuf_script, " ORDER BY ");
+        size_t idx;
+        json_t *jn_field;
+        json_array_foreach(jn_order_by, idx, jn_field) {
+            const char *field = json_string_value(jn_field);
+            if(!is_order_term(field)) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                    "msg",          "%s", "order_by: field [ASC|DESC] expected",
+                    "tablename",    "%s", tablename,
+                    "order_by",     "%s", field?field:"",
+                    NULL
+                );
+                JSON_DECREF(jn_order_by);
+                gbuf_decref(gbuf_script);
+                KW_DECREF(kw_filtro);
+                return 0;
             }
-            cols++;
+            gbuf_printf(gbuf_script, "%s%s", idx?", ":"", field);
+        }
+        JSON_DECREF(jn_order_by);
+    } else if(jn_after_id || jn_until_id || jn_limit || jn_offset) {
+        gbuf_printf(gbuf_script, " ORDER BY id");
+    }
+    if(jn_limit || jn_offset) {
+        gbuf_printf(gbuf_script, " LIMIT ?");
+        if(jn_limit) {
+            json_array_append(jn_params, jn_limit);
+        } else {
+            json_array_append_new(jn_params, json_integer(-1));
         }
     }
+    if(jn_offset) {
+        gbuf_printf(gbuf_script, " OFFSET ?");
+        json_array_append(jn_params, jn_offset);
+    }
     gbuf_printf(gbuf_script, " ;");
 
     KW_DECREF(kw_filtro);
@@ -875,50 +7713,507 @@ PRIVATE GBUFFER *sqlite_select(
 }
 
 /***************************************************************************
- *
+ *  Names written in the sql: field names and order_by terms.
  ***************************************************************************/
-PRIVATE json_t *sqlrow2json(
+PRIVATE BOOL is_column_name(const char *name)
+{
+    if(!name || !(isalpha((unsigned char)*name) || *name=='_')) {
+        return FALSE;
+    }
+    for(const char *p = name; *p; p++) {
+        if(!(isalnum((unsigned char)*p) || *p=='_')) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/***************************************************************************
+ *  "field", "field ASC", "field DESC"
+ ***************************************************************************/
+PRIVATE BOOL is_order_term(const char *term)
+{
+    if(!term) {
+        return FALSE;
+    }
+    char name[128];
+    const char *sp = strchr(term, ' ');
+    if(!sp) {
+        return is_column_name(term);
+    }
+    if(sp - term >= sizeof(name)) {
+        return FALSE;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int)(sp - term), term);
+    return is_column_name(name) &&
+        (strcasecmp(sp+1, "ASC")==0 || strcasecmp(sp+1, "DESC")==0);
+}
+
+/***************************************************************************
+ *  Generated column of a json path: config.region -> __path_config__region
+ *  The field and the keys of the path must be names.
+ ***************************************************************************/
+PRIVATE BOOL path_column_name(const char *path, char *bf, size_t bfsize)
+{
+    char segment[128];
+    char column[256];
+    int len = snprintf(column, sizeof(column), "%s", PATH_COLUMN_PREFIX);
+    const char *p = path;
+    int segments = 0;
+    while(p) {
+        const char *dot = strchr(p, '.');
+        int n = dot? (int)(dot - p) : (int)strlen(p);
+        if(n >= sizeof(segment)) {
+            return FALSE;
+        }
+        snprintf(segment, sizeof(segment), "%.*s", n, p);
+        if(!is_column_name(segment)) {
+            return FALSE;
+        }
+        len += snprintf(column + len, sizeof(column) - len, "%s%s", segments?"__":"", segment);
+        if(len >= sizeof(column)) {
+            return FALSE;
+        }
+        segments++;
+        p = dot? dot+1 : 0;
+    }
+    if(segments < 2 || len >= bfsize) {
+        return FALSE;
+    }
+    snprintf(bf, bfsize, "%s", column);
+    return TRUE;
+}
+
+/***************************************************************************
+ *  Sql of a filter key: a column, the generated column of a declared
+ *  json path, or json_extract() of a not declared one (without index).
+ ***************************************************************************/
+PRIVATE BOOL filter_field(
+    const char *key,
+    json_t *jn_paths,
+    char *bf,
+    size_t bfsize
+)
+{
+    if(!strchr(key, '.')) {
+        if(!is_column_name(key) || strlen(key) >= bfsize) {
+            return FALSE;
+        }
+        snprintf(bf, bfsize, "%s", key);
+        return TRUE;
+    }
+
+    json_t *jn_column = json_object_get(jn_paths, key);
+    if(jn_column) {
+        snprintf(bf, bfsize, "%s", json_string_value(jn_column));
+        return TRUE;
+    }
+
+    char column[256];
+    if(!path_column_name(key, column, sizeof(column))) {
+        return FALSE;
+    }
+    const char *dot = strchr(key, '.');
+    int len = snprintf(bf, bfsize, "json_extract(%.*s, '$%s')", (int)(dot - key), key, dot);
+    return len < bfsize;
+}
+
+/***************************************************************************
+ *  Predicates of a field: {"$gt": 1, "$lte": 10}
+ *  Return the number of terms written, -1 on error.
+ ***************************************************************************/
+PRIVATE int sqlite_predicate(
     hgobj gobj,
-    sqlite3_stmt *pStmt)
+    GBUFFER *gbuf_script,
+    const char *field,
+    json_t *jn_ops,     // not owned
+    json_t *jn_params   // not owned, values to bind are appended
+)
 {
-    json_t *kw_record = json_object();
+    int terms = 0;
+    const char *op;
+    json_t *jn_value;
+    json_object_foreach(jn_ops, op, jn_value) {
+        gbuf_printf(gbuf_script, terms?" AND ":"");
+        terms++;
 
-    int cols = sqlite3_column_count(pStmt);
-    for(int i=0; i<cols; i++) {
-        const char *key = sqlite3_column_name(pStmt, i);
-        const char *type = sqlite3_column_decltype(pStmt, i);
-        if(strcasecmp(type, "INTEGER")==0) {
-            sqlite3_int64 v_i = sqlite3_column_int64(pStmt, i);
-            json_object_set_new(kw_record, key, json_integer((json_int_t)v_i));
-
-        } else if(strcasecmp(type, "REAL")==0) {
-            double v_d = sqlite3_column_double(pStmt, i);
-            json_object_set_new(kw_record, key, json_real(v_d));
-
-        } else if(strcasecmp(type, "TEXT")==0) {
-            const char *v_s = (const char *)sqlite3_column_text(pStmt, i);
-            json_object_set_new(kw_record, key, json_string(v_s));
-
-        } else if(strcasecmp(type, "BLOB")==0) {
-            int size = sqlite3_column_bytes(pStmt, i);
-            const char *v_b = sqlite3_column_blob(pStmt, i);
-            if(v_b) {
-                json_t *jn_v = nonlegalbuffer2json(v_b, size, TRUE);
-                if(jn_v) {
-                    json_object_set_new(kw_record, key, jn_v);
+        const char *sql_op = 0;
+        for(int i=0; binary_ops[i].op; i++) {
+            if(strcmp(op, binary_ops[i].op)==0) {
+                sql_op = binary_ops[i].sql;
+                break;
+            }
+        }
+        if(sql_op) {
+            gbuf_printf(gbuf_script, "%s%s?", field, sql_op);
+            json_array_append(jn_params, jn_value);
+
+        } else if((strcmp(op, "$in")==0 || strcmp(op, "$nin")==0) && json_is_array(jn_value)) {
+            BOOL in = strcmp(op, "$in")==0;
+            if(json_array_size(jn_value)==0) {
+                // Nothing is in an empty set
+                gbuf_printf(gbuf_script, in?"0":"1");
+            } else {
+                gbuf_printf(gbuf_script, "%s %sIN (", field, in?"":"NOT ");
+                size_t idx;
+                json_t *jn_item;
+                json_array_foreach(jn_value, idx, jn_item) {
+                    gbuf_printf(gbuf_script, idx?", ?":"?");
+                    json_array_append(jn_params, jn_item);
                 }
+                gbuf_printf(gbuf_script, ")");
             }
 
+        } else if(strcmp(op, "$between")==0 &&
+                json_is_array(jn_value) && json_array_size(jn_value)==2) {
+            gbuf_printf(gbuf_script, "%s BETWEEN ? AND ?", field);
+            json_array_append(jn_params, json_array_get(jn_value, 0));
+            json_array_append(jn_params, json_array_get(jn_value, 1));
+
+        } else if(strcmp(op, "$null")==0) {
+            gbuf_printf(gbuf_script, "%s IS %sNULL", field, json_is_true(jn_value)?"":"NOT ");
+
         } else {
             log_error(0,
                 "gobj",         "%s", gobj_full_name(gobj),
                 "function",     "%s", __FUNCTION__,
-                "msgset",       "%s", MSGSET_SERVICE_ERROR,
-                "msg",          "%s", "sqlite3_column_type() type UNKNOWN",
-                "col",          "%s", key,
-                "type",         "%s", type,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "filter operator not valid",
+                "field",        "%s", field,
+                "op",           "%s", op,
+                NULL
+            );
+            return -1;
+        }
+    }
+    return terms;
+}
+
+/***************************************************************************
+ *  Write the condition of a filter, bound parameters appended to jn_params.
+ *      {"field": value}                    field=?
+ *      {"field": {"$op": value, ...}}      see sqlite_predicate()
+ *      {"$or": [filter, ...]}              (filter) OR (filter)
+ *      {"$and": [filter, ...]}             (filter) AND (filter)
+ *      {"field.path": value}               json path inside a json field
+ *  The terms of a filter are joined by AND.
+ *  Return the number of terms written, -1 on error.
+ ***************************************************************************/
+PRIVATE int sqlite_where(
+    hgobj gobj,
+    GBUFFER *gbuf_script,
+    json_t *kw_filtro,  // not owned
+    json_t *jn_paths,   // not owned, declared json paths of the table
+    json_t *jn_params   // not owned, values to bind are appended
+)
+{
+    if(json_object_size(kw_filtro)==0) {
+        gbuf_printf(gbuf_script, "1");
+        return 1;
+    }
+
+    int terms = 0;
+    const char *k;
+    json_t *jn_value;
+    json_object_foreach(kw_filtro, k, jn_value) {
+        gbuf_printf(gbuf_script, terms?" AND ":"");
+        terms++;
+
+        if(strcmp(k, "$or")==0 || strcmp(k, "$and")==0) {
+            BOOL is_or = strcmp(k, "$or")==0;
+            if(!json_is_array(jn_value)) {
+                log_error(0,
+                    "gobj",         "%s", gobj_full_name(gobj),
+                    "function",     "%s", __FUNCTION__,
+                    "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                    "msg",          "%s", "filter group must be an array of filters",
+                    "group",        "%s", k,
+                    NULL
+                );
+                return -1;
+            }
+            if(json_array_size(jn_value)==0) {
+                gbuf_printf(gbuf_script, is_or?"0":"1");
+                continue;
+            }
+            gbuf_printf(gbuf_script, "(");
+            size_t idx;
+            json_t *jn_filter;
+            json_array_foreach(jn_value, idx, jn_filter) {
+                gbuf_printf(gbuf_script, idx?(is_or?" OR (":" AND ("):"(");
+                if(!json_is_object(jn_filter) ||
+                        sqlite_where(gobj, gbuf_script, jn_filter, jn_paths, jn_params)<0) {
+                    log_error(0,
+                        "gobj",         "%s", gobj_full_name(gobj),
+                        "function",     "%s", __FUNCTION__,
+                        "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                        "msg",          "%s", "filter of group not valid",
+                        "group",        "%s", k,
+                        NULL
+                    );
+                    return -1;
+                }
+                gbuf_printf(gbuf_script, ")");
+            }
+            gbuf_printf(gbuf_script, ")");
+            continue;
+        }
+
+        char field[256];
+        if(!filter_field(k, jn_paths, field, sizeof(field))) {
+            log_error(0,
+                "gobj",         "%s", gobj_full_name(gobj),
+                "function",     "%s", __FUNCTION__,
+                "msgset",       "%s", MSGSET_PARAMETER_ERROR,
+                "msg",          "%s", "filter field name not valid",
+                "field",        "%s", k,
                 NULL
             );
+            return -1;
+        }
+
+        /*
+         *  An object with operators, or any other value to compare with =
+         */
+        const char *first = json_is_object(jn_value)? json_object_iter_key(
+            json_object_iter(jn_value)) : 0;
+        if(first && *first == '$') {
+            gbuf_printf(gbuf_script, "(");
+            if(sqlite_predicate(gobj, gbuf_script, field, jn_value, jn_params)<0) {
+                // Error already logged
+                return -1;
+            }
+            gbuf_printf(gbuf_script, ")");
+        } else {
+            gbuf_printf(gbuf_script, "%s=?", field);
+            json_array_append(jn_params, jn_value);
+        }
+    }
+    return terms;
+}
+
+/***************************************************************************
+ *  Column type from the declared type, with the sqlite affinity rules.
+ ***************************************************************************/
+PRIVATE col_type_t decltype2coltype(const char *decltype)
+{
+    if(!decltype || !*decltype) {
+        return COL_DYNAMIC;
+    }
+    if(strcasecmp(decltype, "INTEGER")==0) {
+        return COL_INTEGER;
+    } else if(strcasecmp(decltype, "TEXT")==0) {
+        return COL_TEXT;
+    } else if(strcasecmp(decltype, "BLOB")==0) {
+        return COL_BLOB;
+    } else if(strcasecmp(decltype, "REAL")==0) {
+        return COL_REAL;
+    }
+
+    if(strcasestr(decltype, "INT")) {
+        return COL_INTEGER;
+    } else if(strcasestr(decltype, "CHAR") ||
+            strcasestr(decltype, "CLOB") ||
+            strcasestr(decltype, "TEXT")) {
+        return COL_TEXT;
+    } else if(strcasestr(decltype, "BLOB")) {
+        return COL_BLOB;
+    } else if(strcasestr(decltype, "REAL") ||
+            strcasestr(decltype, "FLOA") ||
+            strcasestr(decltype, "DOUB")) {
+        return COL_REAL;
+    }
+    return COL_DYNAMIC;
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE void decoder_free(ROW_DECODER *decoder)
+{
+    if(!decoder) {
+        return;
+    }
+    for(int i=0; i<decoder->cols; i++) {
+        if(decoder->names[i]) {
+            gbmem_free(decoder->names[i]);
+        }
+    }
+    if(decoder->names) {
+        gbmem_free(decoder->names);
+    }
+    if(decoder->types) {
+        gbmem_free(decoder->types);
+    }
+    gbmem_free(decoder);
+}
+
+/***************************************************************************
+ *  Build the row decoder plan of a statement.
+ ***************************************************************************/
+PRIVATE ROW_DECODER *decoder_create(hgobj gobj, sqlite3_stmt *pStmt)
+{
+    int cols = sqlite3_column_count(pStmt);
+    ROW_DECODER *decoder = gbmem_malloc(sizeof(ROW_DECODER));
+    if(decoder) {
+        decoder->names = gbmem_malloc(sizeof(char *) * (cols+1));
+        decoder->types = gbmem_malloc(sizeof(col_type_t) * (cols+1));
+    }
+    if(!decoder || !decoder->names || !decoder->types) {
+        log_error(0,
+            "gobj",         "%s", gobj_full_name(gobj),
+            "function",     "%s", __FUNCTION__,
+            "msgset",       "%s", MSGSET_MEMORY_ERROR,
+            "msg",          "%s", "gbmem_malloc() FAILED",
+            NULL
+        );
+        decoder_free(decoder);
+        return 0;
+    }
+    decoder->reprepares = sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_REPREPARE, 0);
+    for(int i=0; i<cols; i++) {
+        decoder->names[i] = gbmem_strdup(sqlite3_column_name(pStmt, i));
+        decoder->types[i] = decltype2coltype(sqlite3_column_decltype(pStmt, i));
+        if(strncmp(decoder->names[i], PATH_COLUMN_PREFIX, strlen(PATH_COLUMN_PREFIX))==0) {
+            decoder->types[i] = COL_HIDDEN;
+        }
+        decoder->cols++;
+    }
+    return decoder;
+}
+
+/***************************************************************************
+ *  Column converted to json with the sqlite storage class of the value.
+ ***************************************************************************/
+PRIVATE json_t *sqlcol2json(sqlite3_stmt *pStmt, int i, BOOL jsonb)
+{
+    switch(sqlite3_column_type(pStmt, i)) {
+        case SQLITE_INTEGER:
+            return json_integer((json_int_t)sqlite3_column_int64(pStmt, i));
+        case SQLITE_FLOAT:
+            return json_real(sqlite3_column_double(pStmt, i));
+        case SQLITE_TEXT:
+            return json_stringn(
+                (const char *)sqlite3_column_text(pStmt, i),
+                sqlite3_column_bytes(pStmt, i)
+            );
+        case SQLITE_BLOB:
+            if(jsonb) {
+                json_t *jn_v = jsonb2json(
+                    sqlite3_column_blob(pStmt, i),
+                    sqlite3_column_bytes(pStmt, i)
+                );
+                if(jn_v) {
+                    return jn_v;
+                }
+            }
+            return nonlegalbuffer2json(
+                sqlite3_column_blob(pStmt, i),
+                sqlite3_column_bytes(pStmt, i),
+                TRUE
+            );
+        case SQLITE_NULL:
+        default:
+            return json_null();
+    }
+}
+
+/***************************************************************************
+ *
+ ***************************************************************************/
+PRIVATE json_t *sqlrow2json(
+    hgobj gobj,
+    STMT_CACHE *entry)
+{
+    sqlite3_stmt *pStmt = entry->pStmt;
+
+    /*
+     *  The plan is rebuilt if sqlite re-prepared the statement (schema changed)
+     */
+    ROW_DECODER *decoder = entry->decoder;
+    if(!decoder ||
+            decoder->reprepares != sqlite3_stmt_status(pStmt, SQLITE_STMTSTATUS_REPREPARE, 0) ||
+            decoder->cols != sqlite3_column_count(pStmt)) {
+        decoder_free(decoder);
+        decoder = entry->decoder = decoder_create(gobj, pStmt);
+        if(!decoder) {
+            // Error already logged
+            return 0;
+        }
+    }
+
+    json_t *kw_record = json_object();
+
+    const int cols = decoder->cols;
+    for(int i=0; i<cols; i++) {
+        const char *key = decoder->names[i];
+        switch(decoder->types[i]) {
+            case COL_INTEGER:
+                json_object_set_new_nocheck(
+                    kw_record,
+                    key,
+                    json_integer((json_int_t)sqlite3_column_int64(pStmt, i))
+                );
+                break;
+
+            case COL_REAL:
+                json_object_set_new_nocheck(
+                    kw_record,
+                    key,
+                    json_real(sqlite3_column_double(pStmt, i))
+                );
+                break;
+
+            case COL_TEXT:
+                {
+                    const char *v_s = (const char *)sqlite3_column_text(pStmt, i);
+                    if(v_s) {
+                        json_object_set_new_nocheck(
+                            kw_record,
+                            key,
+                            json_stringn(v_s, sqlite3_column_bytes(pStmt, i))
+                        );
+                    }
+                }
+                break;
+
+            case COL_BLOB:
+                {
+                    const char *v_b = sqlite3_column_blob(pStmt, i);
+                    if(v_b) {
+                        json_t *jn_v = 0;
+                        if(entry->jsonb && sqlite3_column_type(pStmt, i)==SQLITE_BLOB) {
+                            jn_v = jsonb2json(
+                                (const unsigned char *)v_b,
+                                sqlite3_column_bytes(pStmt, i)
+                            );
+                        }
+                        if(!jn_v) {
+                            jn_v = nonlegalbuffer2json(
+                                v_b,
+                                sqlite3_column_bytes(pStmt, i),
+                                TRUE
+                            );
+                        }
+                        if(jn_v) {
+                            json_object_set_new_nocheck(kw_record, key, jn_v);
+                        }
+                    }
+                }
+                break;
+
+            case COL_HIDDEN:
+                break;
+
+            case COL_DYNAMIC:
+            default:
+                {
+                    json_t *jn_v = sqlcol2json(pStmt, i, entry->jsonb);
+                    if(jn_v) {
+                        json_object_set_new_nocheck(kw_record, key, jn_v);
+                    }
+                }
+                break;
         }
     }
 
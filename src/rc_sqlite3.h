@@ -20,6 +20,425 @@ extern "C"{
  ***************************************************************/
 PUBLIC dba_persistent_t *dba_rc_sqlite3(void);
 
+/*
+ *  Secondary indexes of dba_create_table(), in the "__indexes__" key of kw_fields,
+ *  created with CREATE INDEX IF NOT EXISTS:
+ *      "__indexes__": [
+ *          "owner",                                single
+ *          ["owner", "created DESC"],              composite
+ *          {"fields": ["email"], "unique": true},  unique
+ *          {"fields": "owner", "where": "deleted=0", "name": "users_alive"}   partial
+ *      ]
+ *  The default name is tablename_field1_field2.
+ *
+ *  Json paths inside object/array fields, in the "__paths__" key of kw_fields,
+ *  added as virtual generated columns (json_extract), the value is the type:
+ *      "__paths__": {"config.region": "", "config.limits.max": 0}
+ *  They can be indexed ("__indexes__": ["config.region"]) and filtered
+ *  ({"config.region": "eu"}). They are not returned in the records.
+ */
+
+/*
+ *  Compact load: the records in a record set, not in json objects.
+ *  Numbers are kept in fixed width, text and json as bytes, in the blocks
+ *  of an arena, and the field names only once. Records and values are
+ *  converted to json only when asked, and all the memory is freed by
+ *  rc_sqlite3_recordset_free().
+ *  kw_filtro and jn_options as in rc_sqlite3_cursor_open().
+ *  Return null on error.
+ */
+PUBLIC void *rc_sqlite3_load_recordset(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+);
+PUBLIC void rc_sqlite3_recordset_free(void *recordset);
+PUBLIC size_t rc_sqlite3_recordset_rows(void *recordset);
+PUBLIC int rc_sqlite3_recordset_cols(void *recordset);
+PUBLIC size_t rc_sqlite3_recordset_memory(void *recordset); // bytes allocated
+PUBLIC const char *rc_sqlite3_recordset_col_name(void *recordset, int col);
+PUBLIC int rc_sqlite3_recordset_col(void *recordset, const char *field); // -1 if not found
+
+/*
+ *  SQLITE_NULL, SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT,
+ *  or SQLITE_BLOB for json (object/array) values.
+ */
+PUBLIC int rc_sqlite3_recordset_type(void *recordset, size_t row, int col);
+PUBLIC json_int_t rc_sqlite3_recordset_int(void *recordset, size_t row, int col);
+PUBLIC double rc_sqlite3_recordset_real(void *recordset, size_t row, int col);
+PUBLIC const char *rc_sqlite3_recordset_text( // string or json text, valid until free
+    void *recordset,
+    size_t row,
+    int col,
+    size_t *len     // optional
+);
+PUBLIC json_t *rc_sqlite3_recordset_value(void *recordset, size_t row, int col); // yours
+PUBLIC json_t *rc_sqlite3_recordset_record(void *recordset, size_t row); // yours
+
+/*
+ *  Change feed of a table, "__change_feed__": true in kw_fields of dba_create_table().
+ *  Triggers journal each insert, update and delete of the table (from any
+ *  connection) in __changes__, with a version that always grows.
+ *  Load the rows changed after a version, the last change of each row:
+ *      {
+ *          "version": last version returned, to the next call,
+ *          "reload": true if changes after since_version were trimmed,
+ *                    load the full table and continue from "version",
+ *          "changes": [{"version", "op": "insert"|"update"|"delete",
+ *                       "rowid", "record": current record, null if deleted}]
+ *      }
+ *  sqlite reuses the rowid of a deleted row (the table without
+ *  AUTOINCREMENT): a delete and an insert with the same rowid come
+ *  as the insert, replace the record of the rowid.
+ *  Return json is yours, null on error or if the table has no change feed.
+ */
+PUBLIC json_t *rc_sqlite3_load_changes(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_int_t since_version
+);
+
+/*
+ *  Remove from the journal the changes of the table with version <= `version`.
+ *  Return the number of changes removed, -1 on error.
+ */
+PUBLIC json_int_t rc_sqlite3_changes_trim(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_int_t version
+);
+
+/*
+ *  Storage of the object/array fields of a table, in the "__json_storage__"
+ *  key of kw_fields of dba_create_table():
+ *      "text"  (default) json text.
+ *      "jsonb" binary json, the format of sqlite 3.45+, smaller and
+ *              decoded without parsing text. Json paths of jsonb tables
+ *              need sqlite 3.45+ (json_extract() of jsonb).
+ *  The loads of a "jsonb" table decode both formats, the rows can be mixed;
+ *  blobs of the other tables are never taken as jsonb.
+ *  Convert the existing rows to "jsonb" or back to "text" with:
+ *  Return the number of values converted, -1 on error.
+ */
+PUBLIC json_int_t rc_sqlite3_json_storage_migrate(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    const char *storage     // "jsonb" or "text"
+);
+
+/*
+ *  Statistics of the handle returned by dba_open()
+ *
+ *  jn_properties of dba_open():
+ *      "stmt_cache_size":  max prepared statements cached by handle,
+ *                          LRU evicted. 0 disable the cache. Default 64.
+ *      "group_commit":     TRUE: writes go to an open transaction committed
+ *                          each "group_commit_size" writes (default 100)
+ *                          or "group_commit_latency" miliseconds (default 100).
+ *                          A crash loses the writes not committed.
+ *
+ *      "async":            TRUE: start a worker thread with its own connection
+ *                          to run the operations of rc_sqlite3_async_submit().
+ *                          Needs a database file, ignored with :memory: or "in_memory".
+ *
+ *      "read_connections": number of read-only connections (SQLITE_OPEN_READONLY,
+ *                          SQLITE_OPEN_NOMUTEX) used by the loads and cursors,
+ *                          so reads don't wait the writer. Use it with WAL.
+ *                          Reads go to the writer while it has an open
+ *                          transaction (group commit), to see its own writes.
+ *
+ *      "index_advisor":    TRUE: check the query plan of each new select with filter,
+ *                          log the filter columns not covered by an index
+ *                          (full table scan). Listed in "index_advisor" of stats.
+ *
+ *      "slow_query_ms":    log the statements and loads slower than it (0, default,
+ *                          disabled) with the sql, duration, rows returned or changed,
+ *                          steps of full scans and the EXPLAIN QUERY PLAN.
+ *                          Each sql is logged once, listed in "slow_queries" of stats.
+ *      "slow_query_rate":  max slow query logs by minute (default 10).
+ *
+ *      "shards":           number of files (> 1): sharded mode, see rc_sqlite3_shard().
+ *      "shard_tables":     {tablename: shard}, tables placed in one file.
+ *
+ *      "checkpoint":       TRUE: WAL checkpoints out of the writes. The automatic
+ *                          checkpoint of the writer is disabled, a thread with its
+ *                          own connection does PASSIVE checkpoints (they don't block
+ *                          the writer) each "checkpoint_interval" miliseconds
+ *                          (default 1000, 0 only at idle) and when rc_sqlite3_tick()
+ *                          sees no writes in "checkpoint_idle" miliseconds (default 100).
+ *                          If the wal is bigger than "checkpoint_wal_max" bytes
+ *                          (default 64M) it's truncated (TRUNCATE checkpoint) without
+ *                          waiting: with readers or the writer in the way it's
+ *                          counted in "busy" and retried in the next rc_sqlite3_tick().
+ *                          Needs WAL journal_mode.
+ *
+ *      "in_memory":        TRUE: the file is restored at open in an in-memory copy
+ *                          that serves the loads and cursors. The writes go to the
+ *                          file and then to the copy, statement by statement
+ *                          (use "group_commit" to batch the commits of the file).
+ *                          The handle must be the only writer of the file.
+ *                          If the copy fails a write it's dropped and the reads
+ *                          go to the file. Ignores "read_connections" and "async".
+ *
+ *      Pragmas applied at open, string, integer or boolean values:
+ *          "page_size", "journal_mode", "synchronous", "cache_size",
+ *          "mmap_size", "temp_store", "busy_timeout", "wal_autocheckpoint",
+ *          "foreign_keys" (ON by default).
+ *      The effective values are logged and returned in "pragmas" of stats.
+ *
+ *      Example: {"journal_mode": "WAL", "synchronous": "NORMAL",
+ *                "cache_size": -65536, "mmap_size": 268435456}
+ *
+ *  Keys of the stats:
+ *      "tables":       {tablename: {rows_read, rows_written, ops: {op: {calls, errors,
+ *                      rows, total_us, max_us, avg_us, histogram}}}}, op is
+ *                      create, update, delete, upsert or load (dba_load_table(),
+ *                      cursors, streams, pages). The keys of the latency histogram
+ *                      are the upper bound of the bucket in usec: 1, 2, 4, ... "inf".
+ *      "db_status":    sqlite3_db_status() of the connection: page cache
+ *                      hit/miss/write/spill/used, lookaside, schema and statement memory.
+ *      "statements":   {sql: {fullscan_step, sort, autoindex, vm_step, run, reprepare}},
+ *                      sqlite3_stmt_status() of the cached statements, of the writer
+ *                      and the free readers. fullscan_step > 0 is a scan.
+ *      "read_pool":    with "db_status" of each reader (null if busy).
+ *      "async":        with the "tables" and "db_status" of the worker connection.
+ *      "in_memory":    {lost, writes, restore_ms, db_status} of the copy.
+ *      "checkpoint":   {runs, idle_runs, truncates, busy, errors, last_us, max_us,
+ *                      avg_us, wal_frames, checkpointed_frames, wal_bytes, wal_max},
+ *                      duration of the checkpoints and wal size after the last one.
+ */
+PUBLIC json_t *rc_sqlite3_stats(hgobj gobj, void *pDb);  // Return json is yours
+
+/*
+ *  Sharded mode, "shards": N in dba_open(): the database is N files,
+ *  `database` and database-shard1 ... -shardN-1, each one with its own
+ *  writer connection (and worker thread with "async"), opened with the
+ *  same properties. The handle only routes the operations:
+ *    - tables of "shard_tables" go whole to their file.
+ *    - the other tables are partitioned in all the files by their key
+ *      (the key of dba_create_table() if it's one column, else id):
+ *      integers by modulo, strings by hash. They need an id field,
+ *      the ids are given by the handle, unique in all the files:
+ *      handed out from blocks reserved in the table __shard_ids__ of
+ *      the first file, not reused after a restart (the unused ids of
+ *      the last block are skipped). Other processes writing the same
+ *      files get other blocks, but the ids given in the records are
+ *      not reserved: only one writer can give its own ids.
+ *  Writes and loads with the partition key in the filter ({"id": 5})
+ *  go to one file, the others to all the files: the changes are added
+ *  (not atomic over the files) and the loads merged in id order
+ *  (no "order_by"). Upserts of a partitioned table go by its partition
+ *  key, that can't be updated; other conflict keys are refused.
+ *  The batches are one transaction by file.
+ *  Cursors, record sets, change feed, async and backups of a partitioned
+ *  table need one file; rc_sqlite3_stats() returns {"shards": [stats]}.
+ *  Return the number of files, 0 if the handle is not sharded.
+ */
+PUBLIC int rc_sqlite3_shards(void *pDb);
+
+/*
+ *  Handle of a file of the sharded handle, to backup it or for its stats.
+ *  Not sharded: the shard 0 is pDb. Don't close it.
+ */
+PUBLIC void *rc_sqlite3_shard(void *pDb, int shard);
+
+/*
+ *  Group commit: commit now the pending writes (barrier).
+ */
+PUBLIC int rc_sqlite3_flush(hgobj gobj, void *pDb);
+
+/*
+ *  Call it periodically, from the timer of your gobj.
+ *  Group commit: commit the pending writes older than the max latency.
+ *  Async mode: send the events of the completed operations.
+ */
+PUBLIC int rc_sqlite3_tick(hgobj gobj, void *pDb);
+
+/*
+ *  Online backup without blocking: the pages are copied by rc_sqlite3_tick(),
+ *  a few each time, the writes can go on. The writes of the handle are
+ *  updated in the copy, a write of other connection (async worker,
+ *  other process) restarts the copy.
+ *  The copy is written to path.partial and renamed to path when complete.
+ *  jn_options:
+ *      "pages_per_tick":   pages copied by tick (default 256)
+ *      "vacuum":           TRUE: compacted snapshot with VACUUM INTO, in a thread
+ *                          with its own connection (in the caller for :memory:)
+ *      "event":            event sent to gobj at the end, kw is the status
+ *  One backup at a time by handle. Return 0 if started, -1 on error.
+ */
+PUBLIC int rc_sqlite3_backup_start(
+    hgobj gobj,
+    void *pDb,
+    const char *path,
+    json_t *jn_options  // owned
+);
+
+/*
+ *  {"state": "none"|"running"|"done"|"failed", "path", "vacuum",
+ *   "pages_total", "pages_remaining", "percent", "elapsed_ms", "errormsg"}
+ *  Return json is yours.
+ */
+PUBLIC json_t *rc_sqlite3_backup_status(hgobj gobj, void *pDb);
+
+/*
+ *  Abort the running backup and remove the partial copy.
+ */
+PUBLIC int rc_sqlite3_backup_cancel(hgobj gobj, void *pDb);
+
+/*
+ *  Filter of the loads and cursors (kw_filtro), compiled to sql with bound values.
+ *  The terms of a filter are joined by AND:
+ *      {"owner": "x"}                          owner = 'x'
+ *      {"size": {"$gt": 1, "$lte": 10}}        $eq $ne $gt $gte $lt $lte
+ *      {"size": {"$between": [1, 10]}}
+ *      {"owner": {"$in": ["x", "y"]}}          $in $nin
+ *      {"name": {"$like": "a%"}}               $like $glob
+ *      {"deleted": {"$null": true}}            IS NULL, false: IS NOT NULL
+ *      {"$or": [{filter}, {filter}]}           $or $and
+ *      {"config.region": "eu"}                 json path, with index if declared
+ *
+ *  dba_update_record() and dba_delete_record() use the same filter, in one
+ *  UPDATE/DELETE statement, and return the number of records changed
+ *  (-1 on error). An empty filter is an error.
+ */
+
+/*
+ *  Cursor over the records of a table, in bounded memory.
+ *  jn_options: "after_id" (records with id > after_id),
+ *              "until_id" (records with id <= until_id),
+ *              "order_by" ("field" or ["field DESC", "field2"]),
+ *              "limit" (max records), "offset" (records to skip).
+ *  Without "order_by", with any option the records are ordered by id.
+ */
+PUBLIC void *rc_sqlite3_cursor_open(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_t *jn_options  // owned
+);
+PUBLIC json_t *rc_sqlite3_cursor_next(hgobj gobj, void *cursor); // Return record is yours, null at end
+PUBLIC int rc_sqlite3_cursor_close(hgobj gobj, void *cursor); // Return -1 if the load failed
+
+/*
+ *  Load without accumulate: dba_stream takes the ownership of each record,
+ *  return 0 to continue, -1 to break.
+ *  Return the number of records streamed, -1 on error.
+ */
+PUBLIC int rc_sqlite3_load_stream(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    const char *resource,
+    void *user_data,    // To use as parameter in dba_stream() callback.
+    json_t *kw_filtro,  // owned
+    dba_record_cb dba_stream
+);
+
+/*
+ *  dba_load_table() with `threads` threads, each one loading a range of ids
+ *  with a reader of the pool ("read_connections" of dba_open()).
+ *  dba_filter is called from this thread, in id order.
+ *  The records are decoded in the threads: the json allocator must be thread-safe.
+ *  Return null (jn_record_list released) if any range failed, never a partial table.
+ */
+PUBLIC json_t *rc_sqlite3_load_table_parallel(
+    hgobj gobj,
+    void *pDb,
+    const char* tablename,
+    const char* resource,
+    void *user_data,    // To use as parameter in dba_record_cb() callback.
+    json_t *kw_filtro,  // owned
+    dba_record_cb dba_filter,
+    json_t *jn_record_list,
+    int threads
+);
+
+/*
+ *  Keyset pagination: up to `limit` records with id > after_id, ordered by id.
+ *  Return json is yours.
+ */
+PUBLIC json_t *rc_sqlite3_load_page(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_filtro,  // owned
+    json_int_t after_id,
+    size_t limit
+);
+
+/*
+ *  Async mode: run an operation in the worker thread of the handle.
+ *  On completion `event` is sent to gobj, from rc_sqlite3_tick(),
+ *  with kw {"op", "tablename", "user", "ret", "result", "errormsg" if failed},
+ *  the errors are logged there too.
+ *
+ *  kw_op: {
+ *      "op": "create_table" | "drop_table" | "create_record" | "create_records" |
+ *            "upsert_record" | "upsert_records" |
+ *            "update_record" | "delete_record" | "load_table" | "flush",
+ *      "tablename", "key", "fields", "record", "records", "filter", "options",
+ *      "user": any json, returned in the event
+ *  }
+ *  The synchronous api keeps working on the main connection of the handle,
+ *  it learns the tables created or dropped by the worker when their event is sent.
+ *  The operations run without gobj, but the records and results are built
+ *  in the worker thread: the json allocator must be thread-safe.
+ */
+PUBLIC int rc_sqlite3_async_submit(
+    hgobj gobj,
+    void *pDb,
+    const char *event,
+    json_t *kw_op  // owned
+);
+
+/*
+ *  Insert the array of records in one transaction, all or nothing.
+ *  Return the list of ids given to the records (in the same order),
+ *  or null on error. Return json is yours.
+ */
+PUBLIC json_t *rc_sqlite3_create_records(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *jn_records  // owned
+);
+
+/*
+ *  Insert the record, or update it if one with the same key exists,
+ *  in one statement (INSERT ... ON CONFLICT(key) DO UPDATE, sqlite 3.35+).
+ *  key: primary or unique key, "email" or "owner, name",
+ *       null: the key of dba_create_table(), or "id".
+ *  The key columns and the id of an existing record are not updated.
+ *  Return the id of the record inserted or updated, -1 on error.
+ */
+PUBLIC json_int_t rc_sqlite3_upsert_record(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *kw_record,  // owned
+    const char *key
+);
+
+/*
+ *  Upsert the array of records in one transaction, all or nothing.
+ *  Return the list of ids (in the same order), or null on error.
+ *  Return json is yours.
+ */
+PUBLIC json_t *rc_sqlite3_upsert_records(
+    hgobj gobj,
+    void *pDb,
+    const char *tablename,
+    json_t *jn_records, // owned
+    const char *key
+);
+
 #ifdef __cplusplus
 }
 #endif